@@ -1,40 +1,278 @@
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
 #include <iostream>
-#include <fstream>
+#include <string>
+#include <vector>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/Module.h>
+
+#include <llvm/Support/MemoryBuffer.h>
 #include <llvm/Support/raw_ostream.h>
-#include <llvm/Support/FileSystem.h>
 
-#if LLVM_VERSION_MAJOR >= 4
-#include <llvm/Bitcode/BitcodeWriter.h>
-#else
-#include <llvm/Bitcode/ReaderWriter.h>
-#endif
+#include "batch.h"
+#include "cache.h"
+#include "codegen.h"
+#include "compiler.h"
+#include "interp.h"
+#include "jit.h"
+#include "server.h"
+#include "stats.h"
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+}
+
+// Parses arg after its first skip characters as a number, false unless it
+// is all digits and fits value
+template <typename T>
+static bool _parse_number(const std::string &arg, size_t skip, T &value) {
+    return !llvm::StringRef(arg).drop_front(skip).getAsInteger(10, value);
+}
 
-#include "lexer.h"
-#include "parser.h"
+static bool _report_stats(const CompileStats &stats, bool print, const std::string &json_path) {
+    if (print) stats.print(llvm::errs());
+    if (json_path.empty()) return true;
+    std::error_code e;
+    llvm::raw_fd_ostream out(json_path, e);
+    if (e) {
+        std::cout << "Could not open " << json_path << ": " << e.message() << "\n";
+        return false;
+    }
+    stats.printJSON(out);
+    return true;
+}
+
+// Serves until SIGINT or SIGTERM, which only this thread waits for
+static bool _serve(const std::string &socket_path, unsigned int threads) {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    // Blocked before the workers start so that they inherit the mask
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    CompileServer server(socket_path, threads);
+    if (!server.start()) return false;
+    std::cerr << "Listening on " << socket_path << "\n";
+    int sig;
+    sigwait(&signals, &sig);
+    server.stop();
+    std::cerr << server.requests() << " requests, " << server.failures() << " failed\n";
+    return true;
+}
+
+static bool _compile_remote(const std::string &socket_path, const llvm::MemoryBuffer &source,
+                            const CompileOptions &options, const std::string &out_path) {
+    llvm::SmallVector<char, 0> out;
+    std::string error;
+    if (!compileRemote(socket_path, source.getBuffer(), options, out, error)) {
+        std::cout << source.getBufferIdentifier().str() << ": " << error << "\n";
+        return false;
+    }
+    std::error_code e;
+    llvm::raw_fd_ostream file(out_path, e);
+    if (e) {
+        std::cout << "Could not open " << out_path << ": " << e.message() << "\n";
+        return false;
+    }
+    file.write(out.data(), out.size());
+    return true;
+}
 
 int main(int argc, char **argv) {
-    if (argc != 3) {
-        std::cout << "Usage: basiccompiler INPUTFILE OUTPUTFILE\n";
+    bool run = false;
+    bool interp = false;
+    bool opt_given = false;
+    bool codegen_threads_given = false;
+    bool bad_number = false;
+    uint32_t hot_threshold = 10000;
+    std::string batch_dir;
+    std::string serve_path;
+    std::string connect_path;
+    unsigned int threads = 0;
+    bool print_stats = false;
+    std::string stats_json;
+    std::string cache_dir;
+    uint64_t cache_mb = 1024;
+    CompileOptions options;
+    std::vector<std::string> files;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--run") {
+            run = true;
+        } else if (arg == "--interp") {
+            run = interp = true;
+        } else if (arg.compare(0, 16, "--hot-threshold=") == 0) {
+            bad_number |= !_parse_number(arg, 16, hot_threshold);
+        } else if (arg.size() == 3 && arg[0] == '-' && arg[1] == 'O' &&
+                   arg[2] >= '0' && arg[2] <= '3') {
+            options.opt_level = arg[2] - '0';
+            opt_given = true;
+        } else if (arg == "--emit=bc") {
+            options.emit = OutputKind::Bitcode;
+        } else if (arg == "--emit=asm") {
+            options.emit = OutputKind::Assembly;
+        } else if (arg == "--emit=obj") {
+            options.emit = OutputKind::Object;
+        } else if (arg == "--emit=exe") {
+            options.emit = OutputKind::Executable;
+        } else if (arg.compare(0, 8, "--batch=") == 0) {
+            batch_dir = arg.substr(8);
+        } else if (arg.compare(0, 8, "--serve=") == 0) {
+            serve_path = arg.substr(8);
+        } else if (arg.compare(0, 10, "--connect=") == 0) {
+            connect_path = arg.substr(10);
+        } else if (arg.compare(0, 18, "--codegen-threads=") == 0) {
+            bad_number |= !_parse_number(arg, 18, options.codegen_threads);
+            options.codegen_threads = std::max(1u, options.codegen_threads);
+            codegen_threads_given = true;
+        } else if (arg.compare(0, 19, "--profile-generate=") == 0) {
+            options.profile_generate = arg.substr(19);
+        } else if (arg.compare(0, 14, "--profile-use=") == 0) {
+            options.profile_use = arg.substr(14);
+        } else if (arg.compare(0, 14, "--incremental=") == 0) {
+            options.incremental_dir = arg.substr(14);
+        } else if (arg.compare(0, 2, "-j") == 0 && arg.size() > 2) {
+            bad_number |= !_parse_number(arg, 2, threads);
+        } else if (arg == "--stats") {
+            print_stats = true;
+        } else if (arg.compare(0, 13, "--stats-json=") == 0) {
+            stats_json = arg.substr(13);
+        } else if (arg.compare(0, 12, "--cache-dir=") == 0) {
+            cache_dir = arg.substr(12);
+        } else if (arg.compare(0, 13, "--cache-size=") == 0) {
+            bad_number |= !_parse_number(arg, 13, cache_mb);
+        } else if (arg.compare(0, 6, "-mcpu=") == 0) {
+            options.cpu = arg.substr(6);
+        } else if (arg.compare(0, 7, "-mattr=") == 0) {
+            options.features = arg.substr(7);
+        } else {
+            files.push_back(arg);
+        }
+    }
+    if (!serve_path.empty() && files.empty() && !bad_number) return _serve(serve_path, threads) ? 0 : 1;
+    bool batch = !batch_dir.empty();
+    bool usage = batch ? files.empty() : files.size() != (run ? 1 : 2);
+    // One incremental directory holds the parts of one program
+    bool incremental = !options.incremental_dir.empty();
+    // The server only gets the source, optimization level, output kind and
+    // target, anything else would silently build something else
+    bool local_only = run || batch || incremental || codegen_threads_given ||
+                      !options.profile_generate.empty() || !options.profile_use.empty() ||
+                      !cache_dir.empty() || print_stats || !stats_json.empty();
+    if (usage || bad_number || (!connect_path.empty() && local_only) || (incremental && (run || batch))) {
+        std::cout << "Usage: basiccompiler [OPTIONS] INPUTFILE OUTPUTFILE\n"
+                  << "       basiccompiler [OPTIONS] --run INPUTFILE\n"
+                  << "       basiccompiler [OPTIONS] --interp INPUTFILE\n"
+                  << "       basiccompiler [OPTIONS] --batch=OUTDIR [-jN] INPUT...\n"
+                  << "       basiccompiler --serve=SOCKET [-jN]\n"
+                  << "       basiccompiler [OPTIONS] --connect=SOCKET INPUTFILE OUTPUTFILE\n"
+                  << "Options:\n"
+                  << "  -O0 -O1 -O2 -O3           optimization level\n"
+                  << "  --emit=bc|asm|obj|exe     output kind (default bc)\n"
+                  << "  -mcpu=CPU                 target CPU, 'native' for the host\n"
+                  << "  -mattr=+FEAT,-FEAT        target features\n"
+                  << "  --interp                  interpret, JIT compiling once a loop is hot\n"
+                  << "  --hot-threshold=N         backward jumps before --interp compiles (default\n"
+                  << "                            10000, 0 never compiles)\n"
+                  << "  --batch=OUTDIR            compile every INPUT (.bas file or directory)\n"
+                  << "  -jN                       batch or server worker threads (default: all\n"
+                  << "                            cores)\n"
+                  << "  --serve=SOCKET            compile requests from --connect clients on the\n"
+                  << "                            Unix socket SOCKET until interrupted\n"
+                  << "  --connect=SOCKET          have the server on SOCKET compile (bc, asm and\n"
+                  << "                            obj only, with -O, -mcpu and -mattr as the\n"
+                  << "                            only other options)\n"
+                  << "  --codegen-threads=N       split large programs and optimize and compile\n"
+                  << "                            their parts on N threads (obj and exe only)\n"
+                  << "  --profile-generate=FILE   instrument the program to write a profile of\n"
+                  << "                            its blocks and IFs to FILE when it ends\n"
+                  << "  --profile-use=FILE        optimize for the profile in FILE\n"
+                  << "  --incremental=DIR         keep the compiled parts of the program in DIR and\n"
+                  << "                            only recompile those that changed (obj and exe)\n"
+                  << "  --cache-dir=DIR           reuse outputs of identical earlier compiles\n"
+                  << "  --cache-size=MB           cache size limit (default 1024)\n"
+                  << "  --stats                   print phase times and sizes to stderr\n"
+                  << "  --stats-json=FILE         write the same statistics as JSON\n";
         return 1;
     }
 
-    std::ifstream input_file(argv[1]);
-    BASICLexer lexer;
-    if (!lexer.readFromStream(input_file)) return 1;
+    std::unique_ptr<CompileCache> cache;
+    if (!cache_dir.empty() && !run && connect_path.empty()) {
+        cache.reset(new CompileCache(cache_dir, cache_mb * 1024 * 1024));
+        if (!cache->open()) return 1;
+    }
+    if (batch) {
+        bool ok = compileBatch(files, batch_dir, options, threads, cache.get());
+        if (cache) cache->reportStats();
+        return ok ? 0 : 1;
+    }
+
+    auto compile_start = std::chrono::steady_clock::now();
+    auto source = llvm::MemoryBuffer::getFile(files[0]);
+    if (!source) {
+        std::cout << "Could not open " << files[0] << ": " << source.getError().message() << "\n";
+        return 1;
+    }
 
-    BASICParser parser;
-    if (!parser.parseFromTokenList(lexer.getTokens())) return 1;
-    llvm::Module *mod = parser.generateModule();
-    if (mod == nullptr) return 1;
+    if (!connect_path.empty()) {
+        return _compile_remote(connect_path, **source, options, files[1]) ? 0 : 1;
+    }
 
-#if LLVM_VERSION_MAJOR > 3 || (LLVM_VERSION_MAJOR == 3 && LLVM_VERSION_MINOR >= 6)
-    std::error_code e;
-#else
-    std::string e;
-#endif
-    llvm::raw_fd_ostream output_file(argv[2], e, llvm::sys::fs::OpenFlags::F_None);
-    llvm::WriteBitcodeToFile(mod, output_file);
+    CompileStats stats;
+    bool want_stats = print_stats || !stats_json.empty();
+    CompileStats *stats_ptr = want_stats ? &stats : nullptr;
+
+    if (!run) {
+        bool ok = compileToFile((*source)->getMemBufferRef(), options, files[1], cache.get(), stats_ptr);
+        if (cache) cache->reportStats();
+        if (ok && !_report_stats(stats, print_stats, stats_json)) return 1;
+        return ok ? 0 : 1;
+    }
+
+    if (interp) {
+        // Hot loops are worth optimizing unless asked otherwise
+        if (!opt_given) options.opt_level = 2;
+        BASICInterpreter interpreter;
+        if (!interpreter.load((*source)->getMemBufferRef())) return 1;
+        double load_secs = secondsSince(compile_start);
+        auto exec_start = std::chrono::steady_clock::now();
+        int ret = interpreter.run(hot_threshold, options);
+        fflush(stdout);
+        double exec_secs = secondsSince(exec_start);
+        std::cerr << "load: " << load_secs * 1000 << " ms, "
+                  << "execute: " << exec_secs * 1000 << " ms";
+        if (interpreter.tierUpLabel() >= 0) {
+            std::cerr << " (JIT at line " << interpreter.tierUpLabel() << ", compile: "
+                      << interpreter.tierUpSeconds() * 1000 << " ms)";
+        }
+        std::cerr << "\n";
+        return ret;
+    }
+
+    // JIT code always runs on this machine
+    options.cpu = "native";
+    CompiledModule result;
+    if (!compileModule((*source)->getMemBufferRef(), options, result, stats_ptr)) return 1;
+    BASICJIT jit;
+    {
+        PhaseTimer timer(stats_ptr ? &stats.codegen : nullptr);
+        if (!jit.addModule(std::move(result.mod), std::move(result.ctx))) return 1;
+        if (!jit.lookupMain()) return 1;
+    }
+    double compile_secs = secondsSince(compile_start);
+    stats.peak_rss_kb = peakRSSKilobytes();
+
+    auto exec_start = std::chrono::steady_clock::now();
+    int ret = jit.run();
+    fflush(stdout);
+    double exec_secs = secondsSince(exec_start);
 
-    return 0;
+    std::cerr << "compile: " << compile_secs * 1000 << " ms, "
+              << "execute: " << exec_secs * 1000 << " ms\n";
+    if (!_report_stats(stats, print_stats, stats_json)) return 1;
+    return ret;
 }
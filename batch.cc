@@ -0,0 +1,130 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <thread>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+
+#include "batch.h"
+#include "compiler.h"
+
+static const char *_output_extension(OutputKind kind) {
+    switch (kind) {
+        case OutputKind::Bitcode: return ".bc";
+        case OutputKind::Assembly: return ".s";
+        case OutputKind::Object: return ".o";
+        case OutputKind::Executable: return "";
+    }
+    return "";
+}
+
+struct BatchFile {
+    std::string path;
+    // Output path relative to the output directory, without the extension
+    std::string out;
+
+    bool operator<(const BatchFile &other) const {return path < other.path;}
+};
+
+// Files found in a directory keep their path below it, so that programs
+// with the same name in different subdirectories do not collide
+static bool _collect_inputs(const std::vector<std::string> &inputs,
+                            std::vector<BatchFile> &files) {
+    for (auto &input : inputs) {
+        if (!llvm::sys::fs::is_directory(input)) {
+            files.push_back({input, llvm::sys::path::stem(input).str()});
+            continue;
+        }
+        std::error_code e;
+        for (llvm::sys::fs::recursive_directory_iterator it(input, e), end;
+             it != end && !e; it.increment(e)) {
+            if (llvm::sys::path::extension(it->path()) != ".bas") continue;
+            llvm::SmallString<128> out(llvm::StringRef(it->path()).drop_front(input.size()));
+            llvm::sys::path::replace_extension(out, "");
+            files.push_back({it->path(), out.str().ltrim(llvm::sys::path::get_separator()).str()});
+        }
+        if (e) {
+            printf("Could not read directory %s: %s\n", input.c_str(), e.message().c_str());
+            return false;
+        }
+    }
+    // Deterministic output order regardless of directory iteration order
+    std::sort(files.begin(), files.end());
+
+    // Two inputs writing the same output would race and lose one result
+    std::map<std::string, const std::string *> outputs;
+    bool ok = true;
+    for (auto &file : files) {
+        auto inserted = outputs.emplace(file.out, &file.path);
+        if (!inserted.second) {
+            printf("%s and %s would both be compiled to %s\n", inserted.first->second->c_str(),
+                   file.path.c_str(), file.out.c_str());
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+bool compileBatch(const std::vector<std::string> &inputs, const std::string &out_dir,
+                  const CompileOptions &options, unsigned int threads,
+                  CompileCache *cache) {
+    std::vector<BatchFile> files;
+    if (!_collect_inputs(inputs, files)) return false;
+    if (std::error_code e = llvm::sys::fs::create_directories(out_dir)) {
+        printf("Could not create %s: %s\n", out_dir.c_str(), e.message().c_str());
+        return false;
+    }
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min<unsigned int>(threads, std::max<size_t>(files.size(), 1));
+
+    // Workers claim the next unclaimed file, so a slow program only holds
+    // up its own worker while the others keep draining the list
+    std::atomic<size_t> next_file(0);
+    std::atomic<size_t> failed(0);
+    std::atomic<size_t> lines(0);
+    auto worker = [&]() {
+        for (size_t i = next_file++; i < files.size(); i = next_file++) {
+            const std::string &path = files[i].path;
+            auto source = llvm::MemoryBuffer::getFile(path);
+            if (!source) {
+                printf("Could not open %s: %s\n", path.c_str(), source.getError().message().c_str());
+                ++failed;
+                continue;
+            }
+            llvm::StringRef text = (*source)->getBuffer();
+            lines += std::count(text.begin(), text.end(), '\n');
+
+            llvm::SmallString<128> out_path(out_dir);
+            llvm::sys::path::append(out_path, files[i].out);
+            out_path += _output_extension(options.emit);
+            std::error_code e = llvm::sys::fs::create_directories(llvm::sys::path::parent_path(out_path));
+            if (e) {
+                printf("Could not create %s: %s\n", llvm::sys::path::parent_path(out_path).str().c_str(),
+                       e.message().c_str());
+                ++failed;
+                continue;
+            }
+
+            if (!compileToFile((*source)->getMemBufferRef(), options, out_path.str().str(), cache)) {
+                printf("%s: compilation failed\n", path.c_str());
+                ++failed;
+            }
+        }
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> pool;
+    for (unsigned int t = 0; t < threads; ++t) pool.emplace_back(worker);
+    for (auto &t : pool) t.join();
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    fprintf(stderr, "%zu files (%zu failed), %zu lines in %.3f s on %u threads: "
+                    "%.1f files/s, %.0f lines/s\n",
+            files.size(), failed.load(), lines.load(), secs, threads,
+            files.size() / secs, lines / secs);
+    return failed == 0;
+}
@@ -0,0 +1,21 @@
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include <string>
+#include <vector>
+
+#include "compiler.h"
+
+//
+// Compiles many programs on a pool of worker threads. Inputs are .bas files
+// or directories (searched for .bas files). The output of a file given
+// directly is written to out_dir under its stem, that of a file found in a
+// directory under its path below that directory. Inputs that would share an
+// output fail the batch before anything is compiled. Throughput is printed
+// when done.
+//
+bool compileBatch(const std::vector<std::string> &inputs, const std::string &out_dir,
+                  const CompileOptions &options, unsigned int threads,
+                  CompileCache *cache = nullptr);
+
+#endif  // BATCH_H_
@@ -0,0 +1,33 @@
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "generator.h"
+
+//
+// Writes a synthetic BASIC program to stdout
+//
+int main(int argc, char **argv) {
+    ProgramShape shape = ProgramShape::Mixed;
+    size_t lines = 1000;
+    unsigned int seed = 1;
+    int iterations = 10;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.compare(0, 8, "--shape=") == 0 && parseProgramShape(arg.substr(8), shape)) {
+            continue;
+        } else if (arg.compare(0, 8, "--lines=") == 0) {
+            lines = std::stoul(arg.substr(8));
+        } else if (arg.compare(0, 7, "--seed=") == 0) {
+            seed = std::stoul(arg.substr(7));
+        } else if (arg.compare(0, 13, "--iterations=") == 0) {
+            iterations = std::stoi(arg.substr(13));
+        } else {
+            std::cout << "Usage: basicgen [--shape=let|loops|prints|labels|mixed] [--lines=N]\n"
+                      << "                [--seed=N] [--iterations=N]\n";
+            return 1;
+        }
+    }
+    std::cout << generateProgram(shape, lines, seed, iterations);
+    return 0;
+}
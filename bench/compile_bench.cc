@@ -0,0 +1,120 @@
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+
+#include "../codegen.h"
+#include "../lexer.h"
+#include "../parser.h"
+#include "../passes.h"
+#include "generator.h"
+#include "harness.h"
+
+//
+// Measures each compiler phase on its own, in source lines per second.
+// Every phase's input is prepared outside of the timed region.
+//
+static double _lex(const std::string &source) {
+    BASICLexer lexer;
+    double start = benchNow();
+    if (!lexer.readFromBuffer(llvm::MemoryBufferRef(source, "bench"))) return -1;
+    return benchNow() - start;
+}
+
+static double _parse(const TokenList &tokens) {
+    llvm::LLVMContext ctx;
+    BASICParser parser(ctx);
+    double start = benchNow();
+    if (!parser.parseFromTokenList(tokens)) return -1;
+    return benchNow() - start;
+}
+
+static double _irgen(const TokenList &tokens) {
+    llvm::LLVMContext ctx;
+    BASICParser parser(ctx);
+    if (!parser.parseFromTokenList(tokens)) return -1;
+    double start = benchNow();
+    if (!parser.generateModule()) return -1;
+    return benchNow() - start;
+}
+
+static double _optimize(const llvm::Module &mod, int opt_level, llvm::TargetMachine *tm) {
+    auto copy = llvm::CloneModule(mod);
+    double start = benchNow();
+    if (!optimizeModule(copy.get(), opt_level, tm)) return -1;
+    return benchNow() - start;
+}
+
+static double _emit(const llvm::Module &mod, OutputKind kind, llvm::TargetMachine *tm) {
+    auto copy = llvm::CloneModule(mod);
+    llvm::SmallVector<char, 0> out;
+    double start = benchNow();
+    if (!emitToBuffer(copy.get(), tm, kind, out)) return -1;
+    return benchNow() - start;
+}
+
+static void _bench_program(ProgramShape shape, size_t lines, double min_seconds) {
+    std::string source = generateProgram(shape, lines);
+    std::string suffix = std::string("/") + programShapeName(shape) + "/" + std::to_string(lines);
+
+    BASICLexer lexer;
+    if (!lexer.readFromBuffer(llvm::MemoryBufferRef(source, "bench"))) exit(1);
+    const TokenList &tokens = lexer.getTokens();
+
+    llvm::LLVMContext ctx;
+    BASICParser parser(ctx);
+    if (!parser.parseFromTokenList(tokens)) exit(1);
+    std::unique_ptr<llvm::Module> mod = parser.generateModule();
+    if (!mod) exit(1);
+    auto tm = createTargetMachine("generic", "", 2);
+    if (!tm) exit(1);
+    // Emission is measured on optimized IR, as it runs in the real pipeline
+    auto optimized = llvm::CloneModule(*mod);
+    optimizeModule(optimized.get(), 2, tm.get());
+
+    printBenchResult(runBenchmark("lex" + suffix, lines, min_seconds,
+                                  [&] {return _lex(source);}));
+    printBenchResult(runBenchmark("parse" + suffix, lines, min_seconds,
+                                  [&] {return _parse(tokens);}));
+    printBenchResult(runBenchmark("irgen" + suffix, lines, min_seconds,
+                                  [&] {return _irgen(tokens);}));
+    printBenchResult(runBenchmark("optimize_O2" + suffix, lines, min_seconds,
+                                  [&] {return _optimize(*mod, 2, tm.get());}));
+    printBenchResult(runBenchmark("emit_bc" + suffix, lines, min_seconds,
+                                  [&] {return _emit(*optimized, OutputKind::Bitcode, tm.get());}));
+    printBenchResult(runBenchmark("emit_obj" + suffix, lines, min_seconds,
+                                  [&] {return _emit(*optimized, OutputKind::Object, tm.get());}));
+}
+
+int main(int argc, char **argv) {
+    double min_seconds = 0.5;
+    std::vector<size_t> sizes = {1000, 10000};
+    std::vector<ProgramShape> shapes = {ProgramShape::LetChain, ProgramShape::Loops,
+                                        ProgramShape::Prints, ProgramShape::Labels};
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        ProgramShape shape;
+        if (arg.compare(0, 14, "--min-seconds=") == 0) {
+            min_seconds = std::stod(arg.substr(14));
+        } else if (arg.compare(0, 8, "--lines=") == 0) {
+            sizes = {std::stoul(arg.substr(8))};
+        } else if (arg.compare(0, 8, "--shape=") == 0 && parseProgramShape(arg.substr(8), shape)) {
+            shapes = {shape};
+        } else {
+            printf("Usage: compile_bench [--shape=SHAPE] [--lines=N] [--min-seconds=S]\n");
+            return 1;
+        }
+    }
+
+    initializeNativeTarget();
+    printBenchHeader("Lines");
+    for (ProgramShape shape : shapes) {
+        for (size_t lines : sizes) _bench_program(shape, lines, min_seconds);
+    }
+    return 0;
+}
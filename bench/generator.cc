@@ -0,0 +1,141 @@
+#include <algorithm>
+#include <random>
+#include <sstream>
+#include <vector>
+
+#include "generator.h"
+
+static const char *kShapeNames[] = {"let", "loops", "prints", "labels", "mixed"};
+
+bool parseProgramShape(const std::string &name, ProgramShape &shape) {
+    for (int i = 0; i < 5; ++i) {
+        if (name == kShapeNames[i]) {
+            shape = static_cast<ProgramShape>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *programShapeName(ProgramShape shape) {
+    return kShapeNames[static_cast<int>(shape)];
+}
+
+namespace {
+
+//
+// Programs are built from units (a LET, a whole loop, a PRINT, a jump).
+// Forward jumps name a unit rather than a line, so they never land inside a
+// loop body, and are resolved to labels once the program is complete.
+//
+class Generator {
+  public:
+    Generator(unsigned int seed, int iterations) : _rng(seed), _iterations(iterations) {}
+
+    size_t lines() {return _lines.size();}
+
+    void letLine() {
+        static const char ops[] = "+-*/";
+        _begin_unit();
+        char op = ops[_pick(4)];
+        std::ostringstream line;
+        line << "LET " << _var() << " = " << _var() << " " << op << " ";
+        // Only ever divide by a non-zero constant
+        if (op == '/' || _pick(2)) {
+            line << 1 + _pick(97);
+        } else {
+            line << _var();
+        }
+        _add(line.str());
+    }
+
+    // Four lines: a counted loop over the next counter variable
+    void loop() {
+        _begin_unit();
+        char counter = 'A' + _loops++ % 26;
+        char acc = 'A' + (counter - 'A' + 13) % 26;
+        _add(std::string("LET ") + counter + " = 0");
+        int body = _next_label();
+        _add(std::string("LET ") + acc + " = " + acc + " + " + counter);
+        _add(std::string("LET ") + counter + " = " + counter + " + 1");
+        _add(std::string("IF ") + counter + " < " + std::to_string(_iterations) +
+             " THEN GOTO " + std::to_string(body));
+    }
+
+    void printLine() {
+        _begin_unit();
+        std::string instr = _pick(2) ? "PRINT" : "PRINTLN";
+        if (_pick(2)) {
+            _add(instr + " " + _var());
+        } else {
+            _add(instr + " \"message " + std::to_string(_pick(16)) + "\"");
+        }
+    }
+
+    // Jumps a few units forward so that control always reaches the end
+    void forwardJump() {
+        static const char *cmps[] = {"=", "<", ">", "<>", "<=", ">="};
+        _begin_unit();
+        std::ostringstream line;
+        line << "IF " << _var() << " " << cmps[_pick(6)] << " " << _pick(50) << " THEN GOTO ";
+        _jumps.push_back({_lines.size(), _unit_lines.size() + _pick(8)});
+        _add(line.str());
+    }
+
+    std::string take() {
+        // Jumps past the last unit land on a final line
+        _begin_unit();
+        _add("LET Z = Z + 1");
+        for (const Jump &jump : _jumps) {
+            size_t unit = std::min(jump.unit, _unit_lines.size() - 1);
+            _lines[jump.line] += std::to_string(_label_of(_unit_lines[unit]));
+        }
+        std::ostringstream out;
+        for (size_t i = 0; i < _lines.size(); ++i) {
+            out << _label_of(i) << " " << _lines[i] << "\n";
+        }
+        return out.str();
+    }
+
+  private:
+    struct Jump {
+        size_t line;
+        size_t unit;
+    };
+
+    std::mt19937 _rng;
+    int _iterations;
+    int _loops = 0;
+    std::vector<std::string> _lines;
+    std::vector<size_t> _unit_lines;
+    std::vector<Jump> _jumps;
+
+    unsigned int _pick(unsigned int n) {return _rng() % n;}
+    char _var() {return 'A' + _pick(26);}
+    int _label_of(size_t line) {return 10 * static_cast<int>(line + 1);}
+    int _next_label() {return _label_of(_lines.size());}
+    void _begin_unit() {_unit_lines.push_back(_lines.size());}
+    void _add(const std::string &line) {_lines.push_back(line);}
+};
+
+}  // namespace
+
+std::string generateProgram(ProgramShape shape, size_t lines, unsigned int seed,
+                            int iterations) {
+    Generator gen(seed, iterations);
+    size_t units = 0;
+    while (gen.lines() < lines) {
+        ProgramShape unit_shape = shape;
+        if (shape == ProgramShape::Mixed) {
+            unit_shape = static_cast<ProgramShape>(units++ % 4);
+        }
+        switch (unit_shape) {
+            case ProgramShape::LetChain: gen.letLine(); break;
+            case ProgramShape::Loops: gen.loop(); break;
+            case ProgramShape::Prints: gen.printLine(); break;
+            case ProgramShape::Labels: gen.forwardJump(); break;
+            case ProgramShape::Mixed: break;
+        }
+    }
+    return gen.take();
+}
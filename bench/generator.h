@@ -0,0 +1,30 @@
+#ifndef BENCH_GENERATOR_H_
+#define BENCH_GENERATOR_H_
+
+#include <cstddef>
+#include <string>
+
+//
+// Synthetic BASIC programs for benchmarking the compiler and the code it
+// generates. Every shape terminates and never divides by zero.
+//
+enum class ProgramShape {
+    // Straight-line LET chains over all 26 variables
+    LetChain,
+    // Short counted IF/GOTO loops, iterations sets the trip count
+    Loops,
+    // PRINT and PRINTLN of literals and variables
+    Prints,
+    // Many distinct labels with forward IF jumps between them
+    Labels,
+    // All of the above interleaved
+    Mixed,
+};
+
+bool parseProgramShape(const std::string &name, ProgramShape &shape);
+const char *programShapeName(ProgramShape shape);
+
+std::string generateProgram(ProgramShape shape, size_t lines, unsigned int seed = 1,
+                            int iterations = 10);
+
+#endif  // BENCH_GENERATOR_H_
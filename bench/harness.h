@@ -0,0 +1,53 @@
+#ifndef BENCH_HARNESS_H_
+#define BENCH_HARNESS_H_
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+//
+// A small Google-Benchmark-style runner. The body returns the seconds it
+// measured itself so that per-iteration setup stays out of the timing. It
+// is repeated until min_seconds of measured time have passed.
+//
+struct BenchResult {
+    std::string name;
+    size_t iterations = 0;
+    double seconds = 0;
+    // Work per iteration, reported as a rate
+    double items = 0;
+};
+
+inline double benchNow() {
+    return std::chrono::duration<double>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+template <typename Body>
+BenchResult runBenchmark(const std::string &name, double items, double min_seconds, Body body) {
+    BenchResult result;
+    result.name = name;
+    result.items = items;
+    while (result.seconds < min_seconds || result.iterations == 0) {
+        double secs = body();
+        if (secs < 0) break;
+        result.seconds += secs;
+        ++result.iterations;
+    }
+    return result;
+}
+
+inline void printBenchHeader(const char *items_name) {
+    printf("%-36s %10s %14s %16s\n", "Benchmark", "Iterations", "Time/iter", items_name);
+    printf("%s\n", std::string(79, '-').c_str());
+}
+
+inline void printBenchResult(const BenchResult &result) {
+    double per_iter = result.iterations ? result.seconds / result.iterations : 0;
+    double rate = per_iter > 0 ? result.items / per_iter : 0;
+    printf("%-36s %10zu %11.3f ms %14.0f/s\n", result.name.c_str(), result.iterations,
+           per_iter * 1000, rate);
+    fflush(stdout);
+}
+
+#endif  // BENCH_HARNESS_H_
@@ -0,0 +1,160 @@
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include "../compiler.h"
+#include "../jit.h"
+#include "generator.h"
+#include "harness.h"
+
+//
+// Measures the speed of generated code. Each kernel is JIT compiled once
+// per optimization level and repeated calls to main() are timed, with the
+// program's own output sent to /dev/null.
+//
+struct Kernel {
+    std::string name;
+    std::string source;
+    // Loop iterations or lines executed per run, reported as a rate
+    double items;
+};
+
+static std::vector<Kernel> _kernels() {
+    std::vector<Kernel> kernels;
+    kernels.push_back({"nested_loops",
+                       "10 LET I = 0\n"
+                       "20 LET J = 0\n"
+                       "30 LET S = S + J\n"
+                       "40 LET S = S * 3\n"
+                       "50 LET S = S / 2\n"
+                       "60 LET J = J + 1\n"
+                       "70 IF J < 1000 THEN GOTO 30\n"
+                       "80 LET I = I + 1\n"
+                       "90 IF I < 10000 THEN GOTO 20\n"
+                       "100 PRINTLN S\n",
+                       1e7});
+    // The same nest written with FOR/NEXT
+    kernels.push_back({"for_loops",
+                       "10 FOR I = 1 TO 10000\n"
+                       "20 FOR J = 0 TO 999\n"
+                       "30 LET S = S + J\n"
+                       "40 LET S = S * 3\n"
+                       "50 LET S = S / 2\n"
+                       "60 NEXT J\n"
+                       "70 NEXT I\n"
+                       "80 PRINTLN S\n",
+                       1e7});
+    // Array kernels, DIM zeroes the arrays again on every run. The sum
+    // changes the array each round so it cannot be hoisted.
+    kernels.push_back({"array_sum",
+                       "10 DIM A(100000)\n"
+                       "20 FOR I = 0 TO 99999\n"
+                       "30 LET A(I) = I\n"
+                       "40 NEXT I\n"
+                       "50 LET S = 0\n"
+                       "60 FOR R = 1 TO 100\n"
+                       "70 FOR I = 0 TO 99999\n"
+                       "80 LET S = S + A(I)\n"
+                       "90 NEXT I\n"
+                       "95 LET A(R) = S\n"
+                       "100 NEXT R\n"
+                       "110 PRINTLN S\n",
+                       1e7});
+    kernels.push_back({"saxpy",
+                       "10 DIM X(100000)\n"
+                       "20 DIM Y(100000)\n"
+                       "30 FOR I = 0 TO 99999\n"
+                       "40 LET X(I) = I\n"
+                       "50 NEXT I\n"
+                       "60 LET A = 3\n"
+                       "70 FOR R = 1 TO 100\n"
+                       "80 FOR I = 0 TO 99999\n"
+                       "90 LET T = X(I) * A\n"
+                       "100 LET Y(I) = Y(I) + T\n"
+                       "110 NEXT I\n"
+                       "120 NEXT R\n"
+                       "130 PRINTLN Y(99999)\n",
+                       1e7});
+    // Two call sites share one subroutine, so RETURN has two places to go
+    kernels.push_back({"gosub_calls",
+                       "10 FOR I = 1 TO 1000000\n"
+                       "20 GOSUB 100\n"
+                       "30 LET T = T + S\n"
+                       "40 GOSUB 100\n"
+                       "50 NEXT I\n"
+                       "60 PRINTLN T\n"
+                       "70 IF 0 = 0 THEN GOTO 200\n"
+                       "100 LET S = S + I\n"
+                       "110 LET S = S / 2\n"
+                       "120 RETURN\n"
+                       "200 PRINTLN S\n",
+                       2e6});
+    kernels.push_back({"print_loop",
+                       "10 LET I = 0\n"
+                       "20 PRINTLN I\n"
+                       "30 LET I = I + 1\n"
+                       "40 IF I < 1000000 THEN GOTO 20\n",
+                       1e6});
+    // Generated loop nests, 64 loops of 100000 iterations each
+    std::string loops = generateProgram(ProgramShape::Loops, 256, 1, 100000);
+    loops += "10000 PRINTLN A\n";
+    kernels.push_back({"generated_loops", loops, 64 * 1e5});
+    return kernels;
+}
+
+static bool _compile_kernel(const Kernel &kernel, int opt_level, BASICJIT &jit) {
+    CompileOptions options;
+    options.opt_level = opt_level;
+    options.cpu = "native";
+    CompiledModule compiled;
+    if (!compileModule(llvm::MemoryBufferRef(kernel.source, kernel.name), options, compiled)) {
+        return false;
+    }
+    if (!jit.addModule(std::move(compiled.mod), std::move(compiled.ctx))) return false;
+    return jit.lookupMain();
+}
+
+// Variables live in main's frame and kernels DIM their arrays, so every call
+// starts from a clean state
+static double _run_kernel(BASICJIT &jit) {
+    fflush(stdout);
+    int saved = dup(1);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, 1);
+    double start = benchNow();
+    jit.run();
+    double secs = benchNow() - start;
+    dup2(saved, 1);
+    close(null_fd);
+    close(saved);
+    return secs;
+}
+
+int main(int argc, char **argv) {
+    double min_seconds = 1;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.compare(0, 14, "--min-seconds=") == 0) {
+            min_seconds = std::stod(arg.substr(14));
+        } else {
+            printf("Usage: run_bench [--min-seconds=S]\n");
+            return 1;
+        }
+    }
+
+    printBenchHeader("Items");
+    for (const Kernel &kernel : _kernels()) {
+        for (int opt_level : {0, 2}) {
+            std::string name = kernel.name + "/O" + std::to_string(opt_level);
+            BASICJIT jit;
+            if (!_compile_kernel(kernel, opt_level, jit)) return 1;
+            printBenchResult(runBenchmark(name, kernel.items, min_seconds,
+                                          [&] {return _run_kernel(jit);}));
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,180 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Program.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "../server.h"
+#include "generator.h"
+#include "harness.h"
+
+//
+// Load generator for the compile server. Each client thread sends its
+// requests back to back and the latency of every request is recorded. The
+// server runs in this process unless --connect names a running
+// `basiccompiler --serve`; --oneshot=COMPILER instead starts COMPILER once
+// per request, the cost the server exists to avoid.
+//
+struct LoadOptions {
+    unsigned int clients = 4;
+    size_t requests = 50;
+    size_t lines = 200;
+    ProgramShape shape = ProgramShape::Mixed;
+    unsigned int server_threads = 0;
+    std::string connect;
+    std::string oneshot;
+    CompileOptions compile;
+};
+
+// Distinct programs so that no request is a repeat of the one before
+static const unsigned int kPrograms = 16;
+
+static bool _write_file(const std::string &path, const std::string &text) {
+    std::error_code e;
+    llvm::raw_fd_ostream out(path, e);
+    if (e) return false;
+    out << text;
+    return true;
+}
+
+static const char *_emit_flag(OutputKind kind) {
+    switch (kind) {
+        case OutputKind::Bitcode: return "--emit=bc";
+        case OutputKind::Assembly: return "--emit=asm";
+        default: return "--emit=obj";
+    }
+}
+
+// Runs one client, returning false on the first failed request
+static bool _client(const LoadOptions &load, const std::string &socket_path,
+                    const std::vector<std::string> &programs, unsigned int client,
+                    std::vector<double> &latencies) {
+    std::string prefix = "/tmp/serve_bench." + std::to_string(getpid()) + "." + std::to_string(client);
+    std::vector<std::string> in_paths;
+    if (!load.oneshot.empty()) {
+        for (size_t p = 0; p < programs.size(); ++p) {
+            in_paths.push_back(prefix + "." + std::to_string(p) + ".bas");
+            if (!_write_file(in_paths.back(), programs[p])) return false;
+        }
+    }
+    std::string out_path = prefix + ".out";
+    std::string opt_flag = "-O" + std::to_string(load.compile.opt_level);
+
+    bool ok = true;
+    for (size_t r = 0; r < load.requests && ok; ++r) {
+        size_t p = (client + r) % programs.size();
+        double start = benchNow();
+        if (load.oneshot.empty()) {
+            llvm::SmallVector<char, 0> out;
+            std::string error;
+            ok = compileRemote(socket_path, programs[p], load.compile, out, error);
+            if (!ok) printf("Request failed: %s\n", error.c_str());
+        } else {
+            llvm::StringRef args[] = {load.oneshot, opt_flag, _emit_flag(load.compile.emit),
+                                      in_paths[p], out_path};
+            ok = llvm::sys::ExecuteAndWait(load.oneshot, args) == 0;
+            if (!ok) printf("%s failed\n", load.oneshot.c_str());
+        }
+        latencies.push_back(benchNow() - start);
+    }
+    for (auto &path : in_paths) llvm::sys::fs::remove(path);
+    llvm::sys::fs::remove(out_path);
+    return ok;
+}
+
+// Nearest-rank percentile of sorted latencies
+static double _percentile(const std::vector<double> &sorted, double p) {
+    size_t rank = static_cast<size_t>(std::ceil(p * sorted.size()));
+    return sorted[std::min(sorted.size(), std::max<size_t>(rank, 1)) - 1];
+}
+
+static bool _run(const LoadOptions &load) {
+    std::vector<std::string> programs;
+    for (unsigned int seed = 1; seed <= kPrograms; ++seed) {
+        programs.push_back(generateProgram(load.shape, load.lines, seed));
+    }
+
+    std::unique_ptr<CompileServer> server;
+    std::string socket_path = load.connect;
+    if (load.oneshot.empty() && socket_path.empty()) {
+        socket_path = "/tmp/serve_bench." + std::to_string(getpid()) + ".sock";
+        server.reset(new CompileServer(socket_path, load.server_threads ? load.server_threads
+                                                                        : load.clients));
+        if (!server->start()) return false;
+    }
+
+    std::vector<std::vector<double>> latencies(load.clients);
+    std::vector<char> ok(load.clients);
+    double start = benchNow();
+    std::vector<std::thread> pool;
+    for (unsigned int c = 0; c < load.clients; ++c) {
+        pool.emplace_back([&, c]() {
+            ok[c] = _client(load, socket_path, programs, c, latencies[c]);
+        });
+    }
+    for (auto &t : pool) t.join();
+    double secs = benchNow() - start;
+    if (server) server->stop();
+    if (std::count(ok.begin(), ok.end(), 0) != 0) return false;
+
+    std::vector<double> all;
+    for (auto &l : latencies) all.insert(all.end(), l.begin(), l.end());
+    std::sort(all.begin(), all.end());
+
+    std::string name = std::string(load.oneshot.empty() ? "server" : "oneshot") + "/" +
+                       programShapeName(load.shape) + "/" + std::to_string(load.lines) +
+                       "/clients:" + std::to_string(load.clients);
+    printf("%-32s %8s %9s %9s %9s %9s %11s\n", "Benchmark", "Requests", "p50", "p90", "p99", "max",
+           "Requests/s");
+    printf("%s\n", std::string(93, '-').c_str());
+    printf("%-32s %8zu %6.2f ms %6.2f ms %6.2f ms %6.2f ms %11.1f\n", name.c_str(), all.size(),
+           _percentile(all, 0.5) * 1000, _percentile(all, 0.9) * 1000,
+           _percentile(all, 0.99) * 1000, all.back() * 1000, all.size() / secs);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    LoadOptions load;
+    load.compile.opt_level = 2;
+    load.compile.emit = OutputKind::Object;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        ProgramShape shape;
+        if (arg.compare(0, 10, "--clients=") == 0) {
+            load.clients = std::max(1ul, std::stoul(arg.substr(10)));
+        } else if (arg.compare(0, 11, "--requests=") == 0) {
+            load.requests = std::max(1ul, std::stoul(arg.substr(11)));
+        } else if (arg.compare(0, 8, "--lines=") == 0) {
+            load.lines = std::stoul(arg.substr(8));
+        } else if (arg.compare(0, 8, "--shape=") == 0 && parseProgramShape(arg.substr(8), shape)) {
+            load.shape = shape;
+        } else if (arg.compare(0, 2, "-j") == 0 && arg.size() > 2) {
+            load.server_threads = std::stoul(arg.substr(2));
+        } else if (arg.size() == 3 && arg[0] == '-' && arg[1] == 'O' &&
+                   arg[2] >= '0' && arg[2] <= '3') {
+            load.compile.opt_level = arg[2] - '0';
+        } else if (arg == "--emit=bc") {
+            load.compile.emit = OutputKind::Bitcode;
+        } else if (arg == "--emit=obj") {
+            load.compile.emit = OutputKind::Object;
+        } else if (arg.compare(0, 10, "--connect=") == 0) {
+            load.connect = arg.substr(10);
+        } else if (arg.compare(0, 10, "--oneshot=") == 0) {
+            load.oneshot = arg.substr(10);
+        } else {
+            printf("Usage: serve_bench [--clients=N] [--requests=N] [--shape=SHAPE] [--lines=N]\n"
+                   "                   [-O0..3] [--emit=bc|obj] [-jN | --connect=SOCKET |\n"
+                   "                   --oneshot=COMPILER]\n");
+            return 1;
+        }
+    }
+    return _run(load) ? 0 : 1;
+}
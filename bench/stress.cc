@@ -0,0 +1,119 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include "../compiler.h"
+#include "generator.h"
+#include "harness.h"
+
+//
+// Checks that the library is reentrant. Every program of a corpus of all
+// shapes is first compiled on one thread. Then --threads threads each compile
+// the whole corpus --rounds times, starting at different programs so that
+// the same program is compiled on several threads at once, and every output
+// must match the single-threaded one byte for byte.
+//
+struct StressOptions {
+    unsigned int threads = 8;
+    unsigned int rounds = 4;
+    unsigned int seeds = 4;
+    size_t lines = 200;
+    CompileOptions compile;
+};
+
+static const ProgramShape kShapes[] = {
+    ProgramShape::LetChain, ProgramShape::Loops, ProgramShape::Prints,
+    ProgramShape::Labels, ProgramShape::Mixed,
+};
+
+static bool _compile(const std::string &source, const CompileOptions &options,
+                     llvm::SmallVectorImpl<char> &out) {
+    return compileToBuffer(llvm::MemoryBufferRef(source, "stress"), options, out);
+}
+
+static bool _run(const StressOptions &stress) {
+    std::vector<std::string> names;
+    std::vector<std::string> programs;
+    for (ProgramShape shape : kShapes) {
+        for (unsigned int seed = 1; seed <= stress.seeds; ++seed) {
+            names.push_back(std::string(programShapeName(shape)) + "/" + std::to_string(seed));
+            programs.push_back(generateProgram(shape, stress.lines, seed));
+        }
+    }
+
+    std::vector<llvm::SmallVector<char, 0>> expected(programs.size());
+    for (size_t p = 0; p < programs.size(); ++p) {
+        if (!_compile(programs[p], stress.compile, expected[p])) {
+            printf("%s: compilation failed\n", names[p].c_str());
+            return false;
+        }
+    }
+
+    std::atomic<size_t> compiles(0);
+    std::atomic<size_t> failures(0);
+    std::atomic<size_t> mismatches(0);
+    double start = benchNow();
+    std::vector<std::thread> pool;
+    for (unsigned int t = 0; t < stress.threads; ++t) {
+        pool.emplace_back([&, t]() {
+            for (size_t i = 0; i < stress.rounds * programs.size(); ++i) {
+                size_t p = (t + i) % programs.size();
+                llvm::SmallVector<char, 0> out;
+                ++compiles;
+                if (!_compile(programs[p], stress.compile, out)) {
+                    printf("%s: compilation failed on thread %u\n", names[p].c_str(), t);
+                    ++failures;
+                } else if (llvm::StringRef(out.data(), out.size()) !=
+                           llvm::StringRef(expected[p].data(), expected[p].size())) {
+                    printf("%s: output on thread %u differs from the single-threaded one\n",
+                           names[p].c_str(), t);
+                    ++mismatches;
+                }
+            }
+        });
+    }
+    for (auto &t : pool) t.join();
+    double secs = benchNow() - start;
+
+    printf("%zu compiles of %zu programs on %u threads in %.3f s: %zu failed, %zu mismatched\n",
+           compiles.load(), programs.size(), stress.threads, secs, failures.load(),
+           mismatches.load());
+    return failures == 0 && mismatches == 0;
+}
+
+int main(int argc, char **argv) {
+    StressOptions stress;
+    stress.compile.opt_level = 2;
+    stress.compile.emit = OutputKind::Object;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.compare(0, 10, "--threads=") == 0) {
+            stress.threads = std::max(1ul, std::stoul(arg.substr(10)));
+        } else if (arg.compare(0, 9, "--rounds=") == 0) {
+            stress.rounds = std::max(1ul, std::stoul(arg.substr(9)));
+        } else if (arg.compare(0, 8, "--seeds=") == 0) {
+            stress.seeds = std::max(1ul, std::stoul(arg.substr(8)));
+        } else if (arg.compare(0, 8, "--lines=") == 0) {
+            stress.lines = std::stoul(arg.substr(8));
+        } else if (arg.size() == 3 && arg[0] == '-' && arg[1] == 'O' &&
+                   arg[2] >= '0' && arg[2] <= '3') {
+            stress.compile.opt_level = arg[2] - '0';
+        } else if (arg == "--emit=bc") {
+            stress.compile.emit = OutputKind::Bitcode;
+        } else if (arg == "--emit=asm") {
+            stress.compile.emit = OutputKind::Assembly;
+        } else if (arg == "--emit=obj") {
+            stress.compile.emit = OutputKind::Object;
+        } else {
+            printf("Usage: stress [--threads=N] [--rounds=N] [--seeds=N] [--lines=N] [-O0..3]\n"
+                   "              [--emit=bc|asm|obj]\n");
+            return 1;
+        }
+    }
+    return _run(stress) ? 0 : 1;
+}
@@ -0,0 +1,45 @@
+#include "bytecode.h"
+
+void Bytecode::beginLine(int label) {
+    line_pcs.push_back(ops.size());
+    line_labels.push_back(label);
+    _scratch_used = 0;
+}
+
+uint32_t Bytecode::operand(const Token &tok) {
+    if (tok.kind == TokenKind::VarIntValue) return tok.getVar() - 'A';
+    if (tok.isElement()) {
+        uint32_t index = operand(tok.indexToken());
+        uint32_t reg = scratch();
+        emit(Opcode::Load, reg, tok.array - 'A', index);
+        return reg;
+    }
+    auto it = _constants.find(tok.getInt());
+    if (it != _constants.end()) return it->second;
+    uint32_t reg = registers.size();
+    registers.push_back(tok.getInt());
+    _constants[tok.getInt()] = reg;
+    return reg;
+}
+
+uint32_t Bytecode::scratch() {
+    return scratch_base + _scratch_used++;
+}
+
+uint32_t Bytecode::string(llvm::StringRef str) {
+    strings.push_back(str);
+    return strings.size() - 1;
+}
+
+void Bytecode::emit(Opcode opcode, uint32_t dst, uint32_t a, uint32_t b, uint32_t target) {
+    ops.push_back(BytecodeOp{opcode, static_cast<uint16_t>(dst), a, b, target});
+    op_lines.push_back(line_pcs.size() - 1);
+}
+
+void Bytecode::finish() {
+    for (BytecodeOp &op : ops) {
+        if ((op.opcode >= Opcode::IfEq && op.opcode <= Opcode::Next) || op.opcode == Opcode::Gosub) {
+            op.target = line_pcs[op.target];
+        }
+    }
+}
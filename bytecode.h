@@ -0,0 +1,115 @@
+#ifndef BYTECODE_H_
+#define BYTECODE_H_
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include <llvm/ADT/StringRef.h>
+
+#include "tokens.h"
+
+//
+// Register bytecode for the interpreter. Registers 0-25 are the variables
+// A-Z, followed by the GOSUB depth, one per FOR loop for its limit and a
+// few scratch registers that array elements are loaded into; the rest hold
+// the program's constants, so every operand is a register index. The order of
+// the arithmetic and comparison opcodes follows TokenKind.
+//
+enum class Opcode : uint8_t {
+    // dst = a
+    Mov,
+    // dst = a <op> b
+    Add,
+    Sub,
+    Mul,
+    Div,
+    // Jump to target if a <cmp> b
+    IfEq,
+    IfLt,
+    IfGt,
+    IfNe,
+    IfLte,
+    IfGte,
+    // dst += a, wrapping, then jump to target unless that overflowed or went
+    // past the limit b (above it if a > 0, below it otherwise)
+    Next,
+    // dst = array a at index b, array dst at index a = b, zero array dst.
+    // Arrays are numbered 0-25 by letter.
+    Load,
+    Store,
+    Clear,
+    // Push line a on the return stack with depth register dst and jump to
+    // target, pop a line and continue after it
+    Gosub,
+    Return,
+    // Print register a, string a or a newline
+    PrintInt,
+    PrintStr,
+    Newline,
+    End,
+};
+
+struct BytecodeOp {
+    Opcode opcode;
+    uint16_t dst;
+    uint32_t a;
+    uint32_t b;
+    // A line index while lowering, a pc once finish() has run
+    uint32_t target;
+};
+
+class Bytecode {
+  public:
+    static const uint32_t kNumVars = 26;
+    // Enough for lines without expressions, longer expressions ask for more
+    // through Instruction::scratchNeeded
+    static const uint32_t kNumScratch = 3;
+
+    std::vector<BytecodeOp> ops;
+    // Initial register file: zeroed variables followed by the constants
+    std::vector<int32_t> registers;
+    std::vector<llvm::StringRef> strings;
+    // First pc and label of each line, the last entry is the end of the program
+    std::vector<uint32_t> line_pcs;
+    std::vector<int> line_labels;
+    // Line that each op was lowered from
+    std::vector<uint32_t> op_lines;
+    // Size and offset in the interpreter's array buffer of each array, as
+    // in ArrayTable
+    uint32_t array_sizes[26] = {};
+    uint64_t array_offsets[26] = {};
+    uint64_t array_words = 0;
+    // GOSUB depth register and the return stack's offset in the buffer
+    uint32_t stack_slot = kNumVars;
+    uint64_t stack_offset = 0;
+    // First scratch register
+    uint32_t scratch_base = kNumVars;
+
+    Bytecode() : registers(kNumVars, 0) {}
+
+    // Used by Instruction::addToBytecode
+    void beginLine(int label);
+    // Register holding tok's value, array elements are loaded first
+    uint32_t operand(const Token &tok);
+    // A scratch register not used yet on this line
+    uint32_t scratch();
+    uint32_t string(llvm::StringRef str);
+    void emit(Opcode opcode, uint32_t dst = 0, uint32_t a = 0, uint32_t b = 0, uint32_t target = 0);
+    // Turns jump targets from line indices into pcs
+    void finish();
+
+    static Opcode arithmetic(TokenKind op) {
+        return static_cast<Opcode>(static_cast<int>(Opcode::Add) +
+                                   static_cast<int>(op) - static_cast<int>(TokenKind::Plus));
+    }
+    static Opcode compare(TokenKind cmp) {
+        return static_cast<Opcode>(static_cast<int>(Opcode::IfEq) +
+                                   static_cast<int>(cmp) - static_cast<int>(TokenKind::Eq));
+    }
+
+  private:
+    std::unordered_map<int32_t, uint32_t> _constants;
+    uint32_t _scratch_used = 0;
+};
+
+#endif  // BYTECODE_H_
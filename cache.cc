@@ -0,0 +1,191 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <vector>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/Process.h>
+#include <llvm/Support/SHA1.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "cache.h"
+
+// Bump whenever code generation changes so stale outputs are not reused
+static const char *kCacheVersion = "basic-cache-9";
+static const size_t kKeyLength = 40;
+
+CompileCache::CompileCache(const std::string &dir, uint64_t max_bytes)
+  : _dir(dir), _max_bytes(max_bytes), _size(0), _hits(0), _misses(0), _evictions(0) {}
+
+bool CompileCache::open() {
+    if (std::error_code e = llvm::sys::fs::create_directories(_dir)) {
+        printf("Could not create cache directory %s: %s\n", _dir.c_str(), e.message().c_str());
+        return false;
+    }
+    _size = _scan(nullptr);
+    return true;
+}
+
+std::string CompileCache::_path(llvm::StringRef name) {
+    llvm::SmallString<128> path(_dir);
+    llvm::sys::path::append(path, name);
+    return path.str().str();
+}
+
+std::string targetKey(const CompileOptions &options) {
+    std::string cpu = options.cpu;
+    // The meaning of "native" depends on the machine, so key on what it expands to
+    if (cpu == "native") {
+        cpu = llvm::sys::getHostCPUName().str();
+        llvm::StringMap<bool> host_features;
+        if (llvm::sys::getHostCPUFeatures(host_features)) {
+            std::vector<std::string> sorted;
+            for (auto &it : host_features) {
+                sorted.push_back((it.second ? "+" : "-") + it.first().str());
+            }
+            std::sort(sorted.begin(), sorted.end());
+            for (auto &feature : sorted) cpu += "," + feature;
+        }
+    }
+    return cpu + '\0' + options.features;
+}
+
+std::string CompileCache::key(llvm::StringRef source, const CompileOptions &options) {
+    std::string header;
+    llvm::raw_string_ostream os(header);
+    os << kCacheVersion << '\0' << LLVM_VERSION_STRING << '\0'
+       << options.opt_level << '\0' << static_cast<int>(options.emit) << '\0'
+       << targetKey(options) << '\0' << options.codegen_threads << '\0'
+       << options.profile_generate << '\0' << !options.incremental_dir.empty() << '\0';
+    os.flush();
+
+    llvm::SHA1 hash;
+    hash.update(header);
+    hash.update(source);
+    // Branch weights come from the profile's contents, not its name
+    if (!options.profile_use.empty()) {
+        auto profile = llvm::MemoryBuffer::getFile(options.profile_use);
+        if (profile) hash.update((*profile)->getBuffer());
+    }
+    return llvm::toHex(hash.result(), true);
+}
+
+// copy_file keeps the mode of the file copied to, executables need theirs
+static bool _copy_permissions(const llvm::Twine &from, const llvm::Twine &to) {
+    llvm::ErrorOr<llvm::sys::fs::perms> perms = llvm::sys::fs::getPermissions(from);
+    return perms && !llvm::sys::fs::setPermissions(to, *perms);
+}
+
+bool CompileCache::fetch(const std::string &key, const std::string &out_path) {
+    std::string entry = _path(key);
+    int fd;
+    if (llvm::sys::fs::openFileForRead(entry, fd)) {
+        ++_misses;
+        return false;
+    }
+    // The modification time is the LRU clock
+    llvm::sys::fs::setLastAccessAndModificationTime(fd, std::chrono::system_clock::now());
+    llvm::sys::Process::SafelyCloseFileDescriptor(fd);
+    if (llvm::sys::fs::copy_file(entry, out_path) || !_copy_permissions(entry, out_path)) {
+        ++_misses;
+        return false;
+    }
+    ++_hits;
+    return true;
+}
+
+void CompileCache::store(const std::string &key, const std::string &out_path) {
+    // Copy under a unique name and rename into place so readers never see
+    // a partial entry
+    int fd;
+    llvm::SmallString<128> tmp_path;
+    if (llvm::sys::fs::createUniqueFile(_path("tmp-%%%%%%%%"), fd, tmp_path)) return;
+    llvm::sys::Process::SafelyCloseFileDescriptor(fd);
+    uint64_t size;
+    if (llvm::sys::fs::copy_file(out_path, tmp_path) ||
+        !_copy_permissions(out_path, tmp_path) ||
+        llvm::sys::fs::file_size(tmp_path, size) ||
+        llvm::sys::fs::rename(tmp_path, _path(key))) {
+        llvm::sys::fs::remove(tmp_path);
+        return;
+    }
+    if ((_size += size) > _max_bytes) _evict();
+}
+
+void CompileCache::_locked(const std::function<void()> &fn) {
+    std::lock_guard<std::mutex> guard(_lock);
+    int fd;
+    if (llvm::sys::fs::openFileForWrite(_path("lock"), fd, llvm::sys::fs::CD_OpenAlways)) {
+        fn();
+        return;
+    }
+    bool have_lock = !llvm::sys::fs::lockFile(fd);
+    fn();
+    if (have_lock) llvm::sys::fs::unlockFile(fd);
+    llvm::sys::Process::SafelyCloseFileDescriptor(fd);
+}
+
+uint64_t CompileCache::_scan(std::vector<std::pair<int64_t, std::string>> *entries) {
+    uint64_t total = 0;
+    std::error_code e;
+    for (llvm::sys::fs::directory_iterator it(_dir, e), end; it != end && !e; it.increment(e)) {
+        if (llvm::sys::path::filename(it->path()).size() != kKeyLength) continue;
+        llvm::sys::fs::file_status status;
+        if (llvm::sys::fs::status(it->path(), status)) continue;
+        total += status.getSize();
+        if (entries != nullptr) {
+            entries->emplace_back(
+                status.getLastModificationTime().time_since_epoch().count(), it->path());
+        }
+    }
+    return total;
+}
+
+void CompileCache::_evict() {
+    _locked([this]() {
+        // Other processes may have stored or evicted since we last looked
+        std::vector<std::pair<int64_t, std::string>> entries;
+        uint64_t total = _scan(&entries);
+        std::sort(entries.begin(), entries.end());
+        // Evict down to 90% so that the next few stores don't rescan
+        uint64_t target = _max_bytes - _max_bytes / 10;
+        for (auto &entry : entries) {
+            if (total <= target) break;
+            uint64_t size;
+            if (llvm::sys::fs::file_size(entry.second, size)) continue;
+            if (llvm::sys::fs::remove(entry.second)) continue;
+            total -= size;
+            ++_evictions;
+        }
+        _size = total;
+    });
+}
+
+void CompileCache::reportStats() {
+    unsigned long long hits = 0, misses = 0, evictions = 0;
+    _locked([&]() {
+        std::string stats_path = _path("stats");
+        auto old_stats = llvm::MemoryBuffer::getFile(stats_path);
+        if (old_stats) {
+            sscanf((*old_stats)->getBufferStart(), "hits %llu misses %llu evictions %llu",
+                   &hits, &misses, &evictions);
+        }
+        hits += _hits;
+        misses += _misses;
+        evictions += _evictions;
+        std::error_code e;
+        llvm::raw_fd_ostream out(stats_path, e);
+        if (!e) out << "hits " << hits << "\nmisses " << misses << "\nevictions " << evictions << "\n";
+    });
+    fprintf(stderr, "cache: %llu hits, %llu misses, %llu evictions "
+                    "(all time: %llu hits, %llu misses, %llu evictions, %.1f MB used)\n",
+            static_cast<unsigned long long>(_hits), static_cast<unsigned long long>(_misses),
+            static_cast<unsigned long long>(_evictions), hits, misses, evictions,
+            _size / (1024.0 * 1024.0));
+}
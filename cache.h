@@ -0,0 +1,52 @@
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <llvm/ADT/StringRef.h>
+
+#include "compiler.h"
+
+//
+// On-disk cache of compiler outputs, content addressed by a hash of the
+// source, the options that affect code generation and the LLVM version.
+// The directory is bounded to max_bytes by evicting the least recently
+// used entries. It can be shared by concurrent threads and processes.
+//
+class CompileCache {
+  public:
+    CompileCache(const std::string &dir, uint64_t max_bytes);
+
+    bool open();
+    std::string key(llvm::StringRef source, const CompileOptions &options);
+    // Copies the cached output for key to out_path, false on a miss
+    bool fetch(const std::string &key, const std::string &out_path);
+    void store(const std::string &key, const std::string &out_path);
+    // Adds this run's hits and misses to the directory's totals and prints both
+    void reportStats();
+
+  private:
+    std::string _dir;
+    uint64_t _max_bytes;
+    std::atomic<uint64_t> _size;
+    std::atomic<uint64_t> _hits;
+    std::atomic<uint64_t> _misses;
+    std::atomic<uint64_t> _evictions;
+    std::mutex _lock;
+
+    std::string _path(llvm::StringRef name);
+    // Serialises fn against other threads and processes using the cache
+    void _locked(const std::function<void()> &fn);
+    uint64_t _scan(std::vector<std::pair<int64_t, std::string>> *entries);
+    void _evict();
+};
+
+// The target options in a form fit for cache keys, "native" is expanded to
+// the host's CPU and features
+std::string targetKey(const CompileOptions &options);
+
+#endif  // CACHE_H_
@@ -0,0 +1,248 @@
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/Program.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/Target/TargetOptions.h>
+#include <llvm/Transforms/Utils/SplitModule.h>
+
+#if LLVM_VERSION_MAJOR >= 14
+#include <llvm/MC/TargetRegistry.h>
+#else
+#include <llvm/Support/TargetRegistry.h>
+#endif
+#if LLVM_VERSION_MAJOR >= 4
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#else
+#include <llvm/Bitcode/ReaderWriter.h>
+#endif
+
+#include "codegen.h"
+#include "passes.h"
+
+#if LLVM_VERSION_MAJOR >= 18
+static const llvm::CodeGenFileType kAsmFile = llvm::CodeGenFileType::AssemblyFile;
+static const llvm::CodeGenFileType kObjFile = llvm::CodeGenFileType::ObjectFile;
+#else
+static const llvm::CodeGenFileType kAsmFile = llvm::CGFT_AssemblyFile;
+static const llvm::CodeGenFileType kObjFile = llvm::CGFT_ObjectFile;
+#endif
+
+void initializeNativeTarget() {
+    static std::once_flag once;
+    std::call_once(once, []() {
+        llvm::InitializeNativeTarget();
+        llvm::InitializeNativeTargetAsmPrinter();
+    });
+}
+
+std::unique_ptr<llvm::TargetMachine> createTargetMachine(const std::string &cpu,
+                                                         const std::string &features,
+                                                         int opt_level) {
+    initializeNativeTarget();
+
+    std::string triple = llvm::sys::getProcessTriple();
+    std::string err;
+    const llvm::Target *target = llvm::TargetRegistry::lookupTarget(triple, err);
+    if (target == nullptr) {
+        std::cout << "Could not find target " << triple << ": " << err << "\n";
+        return nullptr;
+    }
+
+    std::string cpu_name = cpu;
+    std::string feature_str;
+    if (cpu == "native") {
+        cpu_name = llvm::sys::getHostCPUName().str();
+        llvm::StringMap<bool> host_features;
+        if (llvm::sys::getHostCPUFeatures(host_features)) {
+            for (auto &it : host_features) {
+                if (!feature_str.empty()) feature_str += ",";
+                feature_str += (it.second ? "+" : "-") + it.first().str();
+            }
+        }
+    }
+    if (!features.empty()) {
+        if (!feature_str.empty()) feature_str += ",";
+        feature_str += features;
+    }
+
+    llvm::CodeGenOpt::Level level = llvm::CodeGenOpt::None;
+    if (opt_level == 1) level = llvm::CodeGenOpt::Less;
+    if (opt_level == 2) level = llvm::CodeGenOpt::Default;
+    if (opt_level >= 3) level = llvm::CodeGenOpt::Aggressive;
+
+    // PIC so that objects can be linked into the system's default PIE
+    return std::unique_ptr<llvm::TargetMachine>(target->createTargetMachine(
+        triple, cpu_name, feature_str, llvm::TargetOptions(),
+        llvm::Reloc::PIC_, llvm::None, level));
+}
+
+static bool _emit_native(llvm::Module *mod, llvm::TargetMachine *tm,
+                         llvm::CodeGenFileType type, llvm::raw_pwrite_stream &out) {
+    llvm::legacy::PassManager pm;
+    if (tm->addPassesToEmitFile(pm, out, nullptr, type)) {
+        std::cout << "Target cannot emit this file type\n";
+        return false;
+    }
+    pm.run(*mod);
+    return true;
+}
+
+// The print runtime, $BASIC_RUNTIME_LIB or libbasicrt.a next to the compiler
+static std::string _runtime_library() {
+    if (const char *env = std::getenv("BASIC_RUNTIME_LIB")) return env;
+    static int anchor;
+    llvm::SmallString<128> path(llvm::sys::fs::getMainExecutable(nullptr, &anchor));
+    llvm::sys::path::remove_filename(path);
+    llvm::sys::path::append(path, "libbasicrt.a");
+    return path.str().str();
+}
+
+bool linkObjects(const std::vector<std::string> &obj_paths, const std::string &out_path,
+                 bool relocatable) {
+    auto cc = llvm::sys::findProgramByName("cc");
+    if (!cc) {
+        std::cout << "Could not find cc to link " << out_path << "\n";
+        return false;
+    }
+    std::string runtime = _runtime_library();
+    if (!relocatable && !llvm::sys::fs::exists(runtime)) {
+        std::cout << "Could not find the BASIC runtime " << runtime << "\n";
+        return false;
+    }
+    std::vector<llvm::StringRef> args = {*cc};
+    if (relocatable) args.insert(args.end(), {"-r", "-nostdlib"});
+    args.insert(args.end(), obj_paths.begin(), obj_paths.end());
+    if (!relocatable) args.push_back(runtime);
+    args.insert(args.end(), {"-o", out_path});
+    std::string err;
+    if (llvm::sys::ExecuteAndWait(*cc, args, llvm::None, {}, 0, 0, &err) != 0) {
+        std::cout << "Linking " << out_path << " failed " << err << "\n";
+        return false;
+    }
+    return true;
+}
+
+bool emitToStream(llvm::Module *mod, llvm::TargetMachine *tm, OutputKind kind,
+                  llvm::raw_pwrite_stream &out) {
+    switch (kind) {
+        case OutputKind::Bitcode:
+#if LLVM_VERSION_MAJOR >= 7
+            llvm::WriteBitcodeToFile(*mod, out);
+#else
+            llvm::WriteBitcodeToFile(mod, out);
+#endif
+            return true;
+        case OutputKind::Assembly: return _emit_native(mod, tm, kAsmFile, out);
+        case OutputKind::Object: return _emit_native(mod, tm, kObjFile, out);
+        case OutputKind::Executable: break;
+    }
+    std::cout << "Executables can only be written to a file\n";
+    return false;
+}
+
+bool emitToBuffer(llvm::Module *mod, llvm::TargetMachine *tm, OutputKind kind,
+                  llvm::SmallVectorImpl<char> &out) {
+    llvm::raw_svector_ostream stream(out);
+    return emitToStream(mod, tm, kind, stream);
+}
+
+static bool _emit_to_path(llvm::Module *mod, llvm::TargetMachine *tm, OutputKind kind,
+                          const std::string &path) {
+#if LLVM_VERSION_MAJOR > 3 || (LLVM_VERSION_MAJOR == 3 && LLVM_VERSION_MINOR >= 6)
+    std::error_code e;
+#else
+    std::string e;
+#endif
+#if LLVM_VERSION_MAJOR >= 13
+    llvm::raw_fd_ostream out(path, e, llvm::sys::fs::OpenFlags::OF_None);
+#else
+    llvm::raw_fd_ostream out(path, e, llvm::sys::fs::OpenFlags::F_None);
+#endif
+    if (e) {
+        std::cout << "Could not open " << path << ": " << e.message() << "\n";
+        return false;
+    }
+    return emitToStream(mod, tm, kind, out);
+}
+
+bool emitFile(llvm::Module *mod, llvm::TargetMachine *tm, OutputKind kind,
+              const std::string &path) {
+    if (kind != OutputKind::Executable) return _emit_to_path(mod, tm, kind, path);
+
+    llvm::SmallString<128> obj_path;
+    if (llvm::sys::fs::createTemporaryFile("basic", "o", obj_path)) {
+        std::cout << "Could not create temporary object file\n";
+        return false;
+    }
+    bool ok = _emit_to_path(mod, tm, OutputKind::Object, obj_path.str().str()) &&
+              linkObjects({obj_path.str().str()}, path, false);
+    llvm::sys::fs::remove(obj_path);
+    return ok;
+}
+
+bool compilePartition(llvm::StringRef bitcode, const std::string &cpu, const std::string &features,
+                      int opt_level, const std::string &obj_path) {
+    llvm::LLVMContext ctx;
+    auto part = llvm::parseBitcodeFile(llvm::MemoryBufferRef(bitcode, "partition"), ctx);
+    if (!part) {
+        std::cout << "Could not read partition: " << llvm::toString(part.takeError()) << "\n";
+        return false;
+    }
+    std::unique_ptr<llvm::TargetMachine> tm = createTargetMachine(cpu, features, opt_level);
+    if (tm == nullptr || !optimizeModule(part->get(), opt_level, tm.get())) return false;
+    return _emit_to_path(part->get(), tm.get(), OutputKind::Object, obj_path);
+}
+
+bool emitFileParallel(llvm::Module *mod, const std::string &cpu, const std::string &features,
+                      int opt_level, unsigned int threads, OutputKind kind,
+                      const std::string &path) {
+    if (kind != OutputKind::Object && kind != OutputKind::Executable) {
+        std::cout << "Only objects and executables are compiled in parallel\n";
+        return false;
+    }
+    // A context must not be shared between threads, so the partitions are
+    // handed over as bitcode
+    std::vector<llvm::SmallString<0>> partitions;
+    llvm::SplitModule(*mod, threads, [&](std::unique_ptr<llvm::Module> part) {
+        partitions.emplace_back();
+        llvm::raw_svector_ostream out(partitions.back());
+        emitToStream(part.get(), nullptr, OutputKind::Bitcode, out);
+    });
+
+    std::vector<std::string> obj_paths(partitions.size());
+    std::atomic<size_t> next_partition(0);
+    std::atomic<size_t> failed(0);
+    auto worker = [&]() {
+        for (size_t i = next_partition++; i < partitions.size(); i = next_partition++) {
+            llvm::SmallString<128> obj_path;
+            if (llvm::sys::fs::createTemporaryFile("basic", "o", obj_path)) {
+                std::cout << "Could not create temporary object file\n";
+                ++failed;
+                continue;
+            }
+            obj_paths[i] = obj_path.str().str();
+            if (!compilePartition(partitions[i], cpu, features, opt_level, obj_paths[i])) ++failed;
+        }
+    };
+    std::vector<std::thread> pool;
+    for (unsigned int t = 0; t < threads; ++t) pool.emplace_back(worker);
+    for (auto &t : pool) t.join();
+
+    bool ok = failed == 0 && linkObjects(obj_paths, path, kind == OutputKind::Object);
+    for (auto &obj_path : obj_paths) {
+        if (!obj_path.empty()) llvm::sys::fs::remove(obj_path);
+    }
+    return ok;
+}
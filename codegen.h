@@ -0,0 +1,49 @@
+#ifndef CODEGEN_H_
+#define CODEGEN_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Target/TargetMachine.h>
+
+enum class OutputKind { Bitcode, Assembly, Object, Executable };
+
+// Registers the host target with LLVM, safe to call from any thread
+void initializeNativeTarget();
+
+// Creates a TargetMachine for the host triple. A cpu of "native" selects the
+// host CPU and all of its features; features uses the -mattr syntax (+avx2,-sse4a).
+std::unique_ptr<llvm::TargetMachine> createTargetMachine(const std::string &cpu,
+                                                         const std::string &features,
+                                                         int opt_level);
+
+// Writes mod to path. Executables are linked against libbasicrt.a and libc
+// with the system cc.
+bool emitFile(llvm::Module *mod, llvm::TargetMachine *tm, OutputKind kind,
+              const std::string &path);
+// In-memory emission, Executable is not supported
+bool emitToStream(llvm::Module *mod, llvm::TargetMachine *tm, OutputKind kind,
+                  llvm::raw_pwrite_stream &out);
+bool emitToBuffer(llvm::Module *mod, llvm::TargetMachine *tm, OutputKind kind,
+                  llvm::SmallVectorImpl<char> &out);
+// Splits an unoptimized mod into up to threads partitions along its
+// functions, then optimizes each partition at opt_level and compiles it on
+// its own thread with a TargetMachine from createTargetMachine. The objects
+// are combined with a relocatable link (Object) or linked into the
+// executable (Executable); no other kind is supported.
+bool emitFileParallel(llvm::Module *mod, const std::string &cpu, const std::string &features,
+                      int opt_level, unsigned int threads, OutputKind kind,
+                      const std::string &path);
+// Reads a module from bitcode into a context of its own, optimizes it and
+// writes it to obj_path as an object, so any thread may call it
+bool compilePartition(llvm::StringRef bitcode, const std::string &cpu, const std::string &features,
+                      int opt_level, const std::string &obj_path);
+// Links objects into path with the system cc. A relocatable link combines
+// them into one object, otherwise they become an executable with the runtime.
+bool linkObjects(const std::vector<std::string> &obj_paths, const std::string &path,
+                 bool relocatable);
+
+#endif  // CODEGEN_H_
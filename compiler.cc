@@ -0,0 +1,136 @@
+#include <algorithm>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+
+#include "cache.h"
+#include "codegen.h"
+#include "compiler.h"
+#include "incremental.h"
+#include "lexer.h"
+#include "parser.h"
+#include "passes.h"
+#include "profile.h"
+
+// Several regions per thread even out the partitions' sizes
+static const unsigned int kRegionsPerThread = 4;
+
+// The parser pulls its lines from the lexer, so the parse's time includes
+// lexing. Only the lexer's wall time is measured, its CPU time is the same
+// share of the parse's.
+static void _split_lex(const PhaseTime &parse, double lex_wall, CompileStats *stats) {
+    double share = parse.wall > 0 ? std::min(1.0, lex_wall / parse.wall) : 0;
+    stats->lex.wall += lex_wall;
+    stats->lex.cpu += parse.cpu * share;
+    stats->parse.wall += parse.wall - lex_wall;
+    stats->parse.cpu += parse.cpu * (1 - share);
+}
+
+// regions is passed to BASICParser::setRegions, stable to setStableRegions
+static bool _compile_module(llvm::MemoryBufferRef source, const CompileOptions &options,
+                            unsigned int regions, bool stable, CompiledModule &result,
+                            CompileStats *stats) {
+    // The parser pulls tokens one line at a time, no token list is built
+    BASICLexer lexer;
+    lexer.openBuffer(source);
+
+    Profile profile;
+    if (!options.profile_use.empty() && !readProfile(options.profile_use, &profile)) return false;
+
+    std::unique_ptr<llvm::LLVMContext> ctx(new llvm::LLVMContext());
+    std::unique_ptr<llvm::Module> mod;
+    {
+        BASICParser parser(*ctx);
+        parser.setLineOptimization(options.opt_level > 0);
+        parser.setRegions(regions);
+        parser.setStableRegions(stable);
+        parser.setProfileOutput(options.profile_generate);
+        if (!options.profile_use.empty()) parser.setProfile(&profile);
+        PhaseTime parse;
+        double lex_wall = 0;
+        if (stats != nullptr) lexer.setLexWall(&lex_wall);
+        {
+            PhaseTimer timer(stats ? &parse : nullptr);
+            if (!parser.parseFromLexer(lexer)) return false;
+        }
+        if (stats != nullptr) _split_lex(parse, lex_wall, stats);
+        {
+            PhaseTimer timer(stats ? &stats->irgen : nullptr);
+            mod = parser.generateModule();
+            if (mod == nullptr) return false;
+        }
+        if (stats != nullptr) {
+            stats->tokens = lexer.tokenCount();
+            stats->instructions = parser.instructionCount();
+            stats->basic_blocks = 0;
+            for (auto &fn : *mod) stats->basic_blocks += fn.size();
+        }
+        result.split = parser.regionCount() > 1;
+    }
+
+    result.mod = std::move(mod);
+    result.ctx = std::move(ctx);
+    if (!optimizeCompiledModule(options, result, stats)) return false;
+    if (stats != nullptr) stats->peak_rss_kb = peakRSSKilobytes();
+    return true;
+}
+
+bool compileModule(llvm::MemoryBufferRef source, const CompileOptions &options,
+                   CompiledModule &result, CompileStats *stats) {
+    return _compile_module(source, options, 1, false, result, stats);
+}
+
+bool optimizeCompiledModule(const CompileOptions &options, CompiledModule &result,
+                            CompileStats *stats) {
+    std::unique_ptr<llvm::TargetMachine> tm = createTargetMachine(
+        options.cpu, options.features, options.opt_level);
+    if (tm == nullptr) return false;
+    result.mod->setDataLayout(tm->createDataLayout());
+    result.mod->setTargetTriple(tm->getTargetTriple().str());
+    if (!result.split) {
+        PhaseTimer timer(stats ? &stats->optimize : nullptr);
+        if (!optimizeModule(result.mod.get(), options.opt_level, tm.get(),
+                            stats ? &stats->pass_wall : nullptr)) return false;
+    }
+    result.tm = std::move(tm);
+    return true;
+}
+
+bool compileToBuffer(llvm::MemoryBufferRef source, const CompileOptions &options,
+                     llvm::SmallVectorImpl<char> &out, CompileStats *stats) {
+    CompiledModule result;
+    if (!compileModule(source, options, result, stats)) return false;
+    PhaseTimer timer(stats ? &stats->codegen : nullptr);
+    return emitToBuffer(result.mod.get(), result.tm.get(), options.emit, out);
+}
+
+bool compileToFile(llvm::MemoryBufferRef source, const CompileOptions &options,
+                   const std::string &out_path, CompileCache *cache,
+                   CompileStats *stats) {
+    std::string key;
+    if (cache != nullptr) {
+        key = cache->key(source.getBuffer(), options);
+        if (cache->fetch(key, out_path)) return true;
+    }
+    bool native = options.emit == OutputKind::Object || options.emit == OutputKind::Executable;
+    bool incremental = native && !options.incremental_dir.empty();
+    bool parallel = native && options.codegen_threads > 1;
+    CompiledModule result;
+    if (!_compile_module(source, options, parallel ? kRegionsPerThread * options.codegen_threads : 1,
+                         incremental, result, stats)) return false;
+    {
+        PhaseTimer timer(stats ? &stats->codegen : nullptr);
+        bool ok;
+        if (!result.split) {
+            ok = emitFile(result.mod.get(), result.tm.get(), options.emit, out_path);
+        } else if (incremental) {
+            ok = emitFileIncremental(result.mod.get(), options, out_path);
+        } else {
+            ok = emitFileParallel(result.mod.get(), options.cpu, options.features, options.opt_level,
+                                  options.codegen_threads, options.emit, out_path);
+        }
+        if (!ok) return false;
+    }
+    if (stats != nullptr) stats->peak_rss_kb = peakRSSKilobytes();
+    if (cache != nullptr) cache->store(key, out_path);
+    return true;
+}
@@ -0,0 +1,67 @@
+#ifndef COMPILER_H_
+#define COMPILER_H_
+
+#include <memory>
+#include <string>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include "codegen.h"
+#include "stats.h"
+
+class CompileCache;
+
+//
+// Library entry points. Every call builds its own LLVMContext, lexer,
+// parser and TargetMachine, so any number of threads may compile
+// different programs concurrently.
+//
+struct CompileOptions {
+    int opt_level = 0;
+    OutputKind emit = OutputKind::Bitcode;
+    std::string cpu = "generic";
+    std::string features;
+    // compileToFile splits large programs into regions (see RegionTable)
+    // that are optimized and compiled to objects on this many threads,
+    // counted as codegen time. Only object and executable output is split.
+    unsigned int codegen_threads = 1;
+    // Instrumented build: the program writes how often each block was
+    // entered and each IF jumped to this file when it ends
+    std::string profile_generate;
+    // Profile from an instrumented run, turned into branch weights
+    std::string profile_use;
+    // compileToFile keeps the objects of the program's parts here and only
+    // recompiles those that changed since the last build in it, see
+    // incremental.h. Only object and executable output is incremental.
+    std::string incremental_dir;
+};
+
+// An optimized module together with the context that owns it
+struct CompiledModule {
+    std::unique_ptr<llvm::LLVMContext> ctx;
+    std::unique_ptr<llvm::Module> mod;
+    std::unique_ptr<llvm::TargetMachine> tm;
+    // main was split into regions and mod is left unoptimized for
+    // emitFileParallel
+    bool split = false;
+};
+
+// Each entry point fills in stats (phase times, sizes, LLVM pass times)
+// when it is given one
+bool compileModule(llvm::MemoryBufferRef source, const CompileOptions &options,
+                   CompiledModule &result, CompileStats *stats = nullptr);
+// The second half of compileModule: creates the TargetMachine for result's
+// module and runs the optimizer over it
+bool optimizeCompiledModule(const CompileOptions &options, CompiledModule &result,
+                            CompileStats *stats = nullptr);
+// Compiles straight to bitcode, assembly or object bytes
+bool compileToBuffer(llvm::MemoryBufferRef source, const CompileOptions &options,
+                     llvm::SmallVectorImpl<char> &out, CompileStats *stats = nullptr);
+// Compiles source to out_path, reusing and filling cache when one is given
+bool compileToFile(llvm::MemoryBufferRef source, const CompileOptions &options,
+                   const std::string &out_path, CompileCache *cache = nullptr,
+                   CompileStats *stats = nullptr);
+
+#endif  // COMPILER_H_
@@ -0,0 +1,202 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <iostream>
+#include <set>
+#include <thread>
+#include <vector>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/Process.h>
+#include <llvm/Support/SHA1.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+
+#include "cache.h"
+#include "codegen.h"
+#include "incremental.h"
+
+// Part hashes cover the IR, bump whenever the optimizer or code generator
+// changes what they make of it
+static const char *kIncrementalVersion = "basic-incremental-1";
+static const char *kManifestHeader = "BASIC incremental 1";
+static const size_t kKeyLength = 40;
+
+struct Part {
+    std::string name;
+    llvm::SmallString<0> bitcode;
+    std::string key;
+};
+
+static std::string _path(const std::string &dir, llvm::StringRef name) {
+    llvm::SmallString<128> path(dir);
+    llvm::sys::path::append(path, name);
+    return path.str().str();
+}
+
+// Parts reach the variables and functions of other parts by name
+static void _externalize(llvm::Module &mod) {
+    for (llvm::GlobalVariable &global : mod.globals()) {
+        if (global.isConstant() || !global.hasLocalLinkage()) continue;
+        global.setLinkage(llvm::GlobalValue::ExternalLinkage);
+        global.setVisibility(llvm::GlobalValue::HiddenVisibility);
+    }
+    for (llvm::Function &fn : mod) {
+        if (!fn.hasLocalLinkage()) continue;
+        fn.setLinkage(llvm::GlobalValue::ExternalLinkage);
+        fn.setVisibility(llvm::GlobalValue::HiddenVisibility);
+    }
+}
+
+// The part of mod defining fn, or main and the variables when fn is null.
+// Constants are copied into every part using them and left unnamed, and
+// declarations nothing uses are dropped, so a part's IR only changes with
+// the code it holds.
+static std::unique_ptr<llvm::Module> _extract(const llvm::Module &mod, const llvm::Function *fn) {
+    llvm::ValueToValueMapTy vmap;
+    std::unique_ptr<llvm::Module> part = llvm::CloneModule(mod, vmap, [&](const llvm::GlobalValue *gv) {
+        if (llvm::isa<llvm::Function>(gv)) return fn != nullptr ? gv == fn : gv->getName() == "main";
+        return fn == nullptr || llvm::cast<llvm::GlobalVariable>(gv)->isConstant();
+    });
+    for (auto it = part->global_begin(); it != part->global_end();) {
+        llvm::GlobalVariable &global = *it++;
+        global.removeDeadConstantUsers();
+        if (!global.hasLocalLinkage()) {
+            if (global.isDeclaration() && global.use_empty()) global.eraseFromParent();
+        } else if (global.use_empty()) {
+            global.eraseFromParent();
+        } else {
+            global.setName("");
+        }
+    }
+    for (auto it = part->begin(); it != part->end();) {
+        llvm::Function &f = *it++;
+        f.removeDeadConstantUsers();
+        if (f.isDeclaration() && f.use_empty()) f.eraseFromParent();
+    }
+    std::string name = fn != nullptr ? fn->getName().str() : "main";
+    part->setModuleIdentifier(name);
+    part->setSourceFileName(name);
+    return part;
+}
+
+static Part _make_part(const llvm::Module &mod, const llvm::Function *fn, const std::string &header) {
+    std::unique_ptr<llvm::Module> module = _extract(mod, fn);
+    Part part;
+    part.name = module->getName().str();
+    llvm::raw_svector_ostream out(part.bitcode);
+    llvm::WriteBitcodeToFile(*module, out);
+    llvm::SHA1 hash;
+    hash.update(header);
+    hash.update(part.bitcode.str());
+    part.key = llvm::toHex(hash.result(), true);
+    return part;
+}
+
+// Compiles the parts that have no object yet on up to threads threads.
+// Objects are written under a unique name and renamed into place.
+static bool _compile_parts(const std::vector<Part> &parts, const std::vector<size_t> &missing,
+                           const CompileOptions &options) {
+    const std::string &dir = options.incremental_dir;
+    unsigned int threads = std::max<size_t>(
+        1, std::min<size_t>(options.codegen_threads, missing.size()));
+    std::atomic<size_t> next_part(0);
+    std::atomic<size_t> failed(0);
+    auto worker = [&]() {
+        for (size_t i = next_part++; i < missing.size(); i = next_part++) {
+            const Part &part = parts[missing[i]];
+            llvm::SmallString<128> tmp_path;
+            if (llvm::sys::fs::createUniqueFile(_path(dir, "tmp-%%%%%%%%.o"), tmp_path)) {
+                std::cout << "Could not create an object in " << dir << "\n";
+                ++failed;
+                continue;
+            }
+            if (!compilePartition(part.bitcode, options.cpu, options.features, options.opt_level,
+                                  tmp_path.str().str()) ||
+                llvm::sys::fs::rename(tmp_path, _path(dir, part.key + ".o"))) {
+                llvm::sys::fs::remove(tmp_path);
+                ++failed;
+            }
+        }
+    };
+    std::vector<std::thread> pool;
+    for (unsigned int t = 0; t < threads; ++t) pool.emplace_back(worker);
+    for (auto &t : pool) t.join();
+    return failed == 0;
+}
+
+// Records the parts of this build and removes the objects of earlier ones
+static void _write_manifest(const std::vector<Part> &parts, const std::string &dir) {
+    std::set<std::string> used;
+    std::error_code e;
+    llvm::raw_fd_ostream manifest(_path(dir, "manifest"), e);
+    if (!e) manifest << kManifestHeader << "\n";
+    for (const Part &part : parts) {
+        used.insert(part.key + ".o");
+        if (!e) manifest << part.name << " " << part.key << "\n";
+    }
+    std::vector<std::string> stale;
+    for (llvm::sys::fs::directory_iterator it(dir, e), end; it != end && !e; it.increment(e)) {
+        llvm::StringRef name = llvm::sys::path::filename(it->path());
+        if (name.size() == kKeyLength + 2 && name.endswith(".o") && !used.count(name.str()))
+            stale.push_back(it->path());
+    }
+    for (auto &path : stale) llvm::sys::fs::remove(path);
+}
+
+static bool _build(llvm::Module *mod, const CompileOptions &options, const std::string &path) {
+    const std::string &dir = options.incremental_dir;
+    std::string header;
+    llvm::raw_string_ostream os(header);
+    os << kIncrementalVersion << '\0' << LLVM_VERSION_STRING << '\0'
+       << options.opt_level << '\0' << targetKey(options) << '\0';
+    os.flush();
+
+    _externalize(*mod);
+    std::vector<Part> parts;
+    parts.push_back(_make_part(*mod, nullptr, header));
+    for (llvm::Function &fn : *mod) {
+        if (!fn.isDeclaration() && fn.getName() != "main") parts.push_back(_make_part(*mod, &fn, header));
+    }
+
+    std::vector<size_t> missing;
+    std::vector<std::string> obj_paths;
+    for (size_t i = 0; i < parts.size(); ++i) {
+        obj_paths.push_back(_path(dir, parts[i].key + ".o"));
+        if (!llvm::sys::fs::exists(obj_paths.back())) missing.push_back(i);
+    }
+    if (!_compile_parts(parts, missing, options)) return false;
+    if (!linkObjects(obj_paths, path, options.emit == OutputKind::Object)) return false;
+    _write_manifest(parts, dir);
+    fprintf(stderr, "incremental: %zu of %zu parts compiled\n", missing.size(), parts.size());
+    return true;
+}
+
+bool emitFileIncremental(llvm::Module *mod, const CompileOptions &options,
+                         const std::string &path) {
+    const std::string &dir = options.incremental_dir;
+    if (options.emit != OutputKind::Object && options.emit != OutputKind::Executable) {
+        std::cout << "Only objects and executables are built incrementally\n";
+        return false;
+    }
+    if (std::error_code e = llvm::sys::fs::create_directories(dir)) {
+        std::cout << "Could not create " << dir << ": " << e.message() << "\n";
+        return false;
+    }
+    // Held for the whole build, so that concurrent builds of the program
+    // do not remove each other's objects
+    int fd;
+    if (llvm::sys::fs::openFileForWrite(_path(dir, "lock"), fd, llvm::sys::fs::CD_OpenAlways)) {
+        std::cout << "Could not lock " << dir << "\n";
+        return false;
+    }
+    bool have_lock = !llvm::sys::fs::lockFile(fd);
+    bool ok = _build(mod, options, path);
+    if (have_lock) llvm::sys::fs::unlockFile(fd);
+    llvm::sys::Process::SafelyCloseFileDescriptor(fd);
+    return ok;
+}
@@ -0,0 +1,24 @@
+#ifndef INCREMENTAL_H_
+#define INCREMENTAL_H_
+
+#include <string>
+#include <llvm/IR/Module.h>
+
+#include "compiler.h"
+
+//
+// Incremental builds of one program, split into stable regions (see
+// BASICParser::setStableRegions). Each region function, and main with the
+// globals, becomes a part of its own. options.incremental_dir keeps an
+// object for every part of the last build, named by a hash of the part's
+// unoptimized IR and the options that affect code generation, plus a
+// manifest listing them. A rebuild still generates the IR of the whole
+// program, which is cheap next to optimizing it, but only optimizes and
+// compiles the parts whose hash is new, on options.codegen_threads threads,
+// before linking all objects again. Objects the build did not use are
+// removed, so the directory must not be shared between programs.
+//
+bool emitFileIncremental(llvm::Module *mod, const CompileOptions &options,
+                         const std::string &path);
+
+#endif  // INCREMENTAL_H_
@@ -0,0 +1,172 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+#include "interp.h"
+#include "runtime.h"
+
+// _interpret's result when the program ran to its end
+static const uint32_t kFinished = UINT32_MAX;
+
+BASICInterpreter::BASICInterpreter()
+  : _ctx(new llvm::LLVMContext()), _parser(new BASICParser(*_ctx)) {}
+
+bool BASICInterpreter::load(llvm::MemoryBufferRef source) {
+    BASICLexer lexer;
+    lexer.openBuffer(source);
+    if (!_parser->parseFromLexer(lexer)) return false;
+    return _parser->generateBytecode(&_code);
+}
+
+int BASICInterpreter::run(uint32_t hot_threshold, const CompileOptions &options) {
+    _regs = _code.registers;
+    _arrays.assign(_code.array_words, 0);
+    _hits.assign(_code.ops.size(), 0);
+    uint32_t pc = _interpret(hot_threshold);
+    if (pc == kFinished) {
+        basic_flush();
+        return 0;
+    }
+    return _tier_up(pc, options);
+}
+
+//
+// Executes bytecode until the End op, or until a backward jump becomes hot,
+// in which case the jump's target pc is returned. GCC and clang dispatch
+// through a table of label addresses, everything else through a switch.
+//
+uint32_t BASICInterpreter::_interpret(uint32_t hot_threshold) {
+    const BytecodeOp *ops = _code.ops.data();
+    const llvm::StringRef *strings = _code.strings.data();
+    int32_t *r = _regs.data();
+    uint32_t *hits = _hits.data();
+    const BytecodeOp *op = ops;
+    const uint32_t *sizes = _code.array_sizes;
+    int32_t *arrays[26];
+    for (int a = 0; a < 26; ++a) arrays[a] = _arrays.data() + _code.array_offsets[a];
+    const uint32_t *line_pcs = _code.line_pcs.data();
+    int32_t *stack = _arrays.data() + _code.stack_offset;
+
+#if defined(__GNUC__)
+    static const void *dispatch[] = {
+        &&op_Mov, &&op_Add, &&op_Sub, &&op_Mul, &&op_Div,
+        &&op_IfEq, &&op_IfLt, &&op_IfGt, &&op_IfNe, &&op_IfLte, &&op_IfGte, &&op_Next,
+        &&op_Load, &&op_Store, &&op_Clear, &&op_Gosub, &&op_Return,
+        &&op_PrintInt, &&op_PrintStr, &&op_Newline, &&op_End,
+    };
+#define CASE(name) op_##name
+#define DISPATCH() goto *dispatch[static_cast<int>(op->opcode)]
+#else
+#define CASE(name) case Opcode::name
+#define DISPATCH() goto dispatch
+#endif
+#define NEXT() do {++op; DISPATCH();} while (0)
+// Arithmetic wraps like the generated code, which C++ signed overflow does not
+#define WRAP(x, o, y) static_cast<int32_t>(static_cast<uint32_t>(x) o static_cast<uint32_t>(y))
+#define BRANCH_IF(cond) do { \
+        if (cond) { \
+            uint32_t pc = op - ops; \
+            if (op->target <= pc && hot_threshold != 0 && ++hits[pc] == hot_threshold) \
+                return op->target; \
+            op = ops + op->target; \
+            DISPATCH(); \
+        } \
+        NEXT(); \
+    } while (0)
+// Unsigned, so negative indices fail too
+#define CHECK_INDEX(array, index) do { \
+        if (static_cast<uint32_t>(index) >= sizes[array]) _index_error(op - ops, array, index); \
+    } while (0)
+
+#if defined(__GNUC__)
+    DISPATCH();
+#else
+dispatch:
+    switch (op->opcode) {
+#endif
+    CASE(Mov): r[op->dst] = r[op->a]; NEXT();
+    CASE(Add): r[op->dst] = WRAP(r[op->a], +, r[op->b]); NEXT();
+    CASE(Sub): r[op->dst] = WRAP(r[op->a], -, r[op->b]); NEXT();
+    CASE(Mul): r[op->dst] = WRAP(r[op->a], *, r[op->b]); NEXT();
+    CASE(Div):
+        if (r[op->b] == 0) _division_error(op - ops);
+        r[op->dst] = r[op->b] == -1 ? WRAP(0, -, r[op->a]) : r[op->a] / r[op->b];
+        NEXT();
+    CASE(IfEq): BRANCH_IF(r[op->a] == r[op->b]);
+    CASE(IfLt): BRANCH_IF(r[op->a] < r[op->b]);
+    CASE(IfGt): BRANCH_IF(r[op->a] > r[op->b]);
+    CASE(IfNe): BRANCH_IF(r[op->a] != r[op->b]);
+    CASE(IfLte): BRANCH_IF(r[op->a] <= r[op->b]);
+    CASE(IfGte): BRANCH_IF(r[op->a] >= r[op->b]);
+    CASE(Next): {
+        // Summed in 64 bits, an overflow lands past the limit
+        int64_t next = static_cast<int64_t>(r[op->dst]) + r[op->a];
+        r[op->dst] = WRAP(r[op->dst], +, r[op->a]);
+        BRANCH_IF(r[op->a] > 0 ? next <= r[op->b] : next >= r[op->b]);
+    }
+    CASE(Load):
+        CHECK_INDEX(op->a, r[op->b]);
+        r[op->dst] = arrays[op->a][r[op->b]];
+        NEXT();
+    CASE(Store):
+        CHECK_INDEX(op->dst, r[op->a]);
+        arrays[op->dst][r[op->a]] = r[op->b];
+        NEXT();
+    CASE(Clear): std::fill_n(arrays[op->dst], sizes[op->dst], 0); NEXT();
+    CASE(Gosub):
+        if (static_cast<uint32_t>(r[op->dst]) >= ReturnStack::kDepth) _call_error(op - ops);
+        stack[r[op->dst]++] = op->a;
+        op = ops + op->target;
+        DISPATCH();
+    CASE(Return):
+        if (r[op->dst] == 0) _call_error(op - ops);
+        op = ops + line_pcs[stack[--r[op->dst]] + 1];
+        DISPATCH();
+    CASE(PrintInt): basic_print_int(r[op->a]); NEXT();
+    CASE(PrintStr): basic_print_str(strings[op->a].data(), strings[op->a].size()); NEXT();
+    CASE(Newline): basic_print_newline(); NEXT();
+    CASE(End): return kFinished;
+#if !defined(__GNUC__)
+    }
+#endif
+#undef CASE
+#undef DISPATCH
+#undef NEXT
+#undef WRAP
+#undef BRANCH_IF
+#undef CHECK_INDEX
+    return kFinished;
+}
+
+void BASICInterpreter::_index_error(uint32_t pc, uint32_t array, int32_t index) {
+    basic_index_error(_code.line_labels[_code.op_lines[pc]], 'A' + array, index,
+                      _code.array_sizes[array]);
+}
+
+void BASICInterpreter::_division_error(uint32_t pc) {
+    basic_division_error(_code.line_labels[_code.op_lines[pc]]);
+}
+
+void BASICInterpreter::_call_error(uint32_t pc) {
+    int label = _code.line_labels[_code.op_lines[pc]];
+    if (_code.ops[pc].opcode == Opcode::Gosub) basic_stack_overflow(label, ReturnStack::kDepth);
+    basic_return_error(label);
+}
+
+int BASICInterpreter::_tier_up(uint32_t pc, const CompileOptions &options) {
+    auto start = std::chrono::steady_clock::now();
+    _tier_up_label = _code.line_labels[_code.op_lines[pc]];
+
+    CompiledModule compiled;
+    compiled.mod = _parser->generateResumeModule(_tier_up_label);
+    if (compiled.mod == nullptr) return 1;
+    compiled.ctx = std::move(_ctx);
+    CompileOptions native = options;
+    native.cpu = "native";
+    if (!optimizeCompiledModule(native, compiled)) return 1;
+    if (!_jit.addModule(std::move(compiled.mod), std::move(compiled.ctx))) return 1;
+    if (!_jit.lookupResume()) return 1;
+    _tier_up_secs = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+    return _jit.resume(_regs.data(), _arrays.data());
+}
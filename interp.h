@@ -0,0 +1,59 @@
+#ifndef INTERP_H_
+#define INTERP_H_
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include "bytecode.h"
+#include "compiler.h"
+#include "jit.h"
+#include "parser.h"
+
+//
+// Tiered execution. Programs start in a bytecode interpreter, which has
+// next to no startup cost. Every IF counts the backward jumps it takes, and
+// once one reaches the hot threshold the program is compiled with LLVM
+// and continues natively from that jump's target, with the interpreter's
+// variables carried over.
+//
+class BASICInterpreter {
+  public:
+    BASICInterpreter();
+
+    // Parses source and lowers it to bytecode
+    bool load(llvm::MemoryBufferRef source);
+    // Runs the program. hot_threshold is the number of backward jumps an IF
+    // takes before tiering up, 0 never leaves the interpreter. options
+    // controls how the native code is compiled.
+    int run(uint32_t hot_threshold, const CompileOptions &options);
+
+    // Label execution moved to native code at, -1 if it never did
+    int tierUpLabel() {return _tier_up_label;}
+    // Time spent compiling the native code
+    double tierUpSeconds() {return _tier_up_secs;}
+
+  private:
+    // Declared first so that the JIT, which takes over the context, goes last
+    BASICJIT _jit;
+    std::unique_ptr<llvm::LLVMContext> _ctx;
+    std::unique_ptr<BASICParser> _parser;
+    Bytecode _code;
+    std::vector<int32_t> _regs;
+    // Every array, at the offsets in _code
+    std::vector<int32_t> _arrays;
+    std::vector<uint32_t> _hits;
+    int _tier_up_label = -1;
+    double _tier_up_secs = 0;
+
+    uint32_t _interpret(uint32_t hot_threshold);
+    [[noreturn]] void _index_error(uint32_t pc, uint32_t array, int32_t index);
+    // A GOSUB past the stack depth or a RETURN with an empty stack
+    [[noreturn]] void _call_error(uint32_t pc);
+    [[noreturn]] void _division_error(uint32_t pc);
+    int _tier_up(uint32_t pc, const CompileOptions &options);
+};
+
+#endif  // INTERP_H_
@@ -0,0 +1,108 @@
+#include <iostream>
+#include <llvm/ExecutionEngine/Orc/Core.h>
+#include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
+#include <llvm/ExecutionEngine/Orc/Mangling.h>
+#include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
+#include <llvm/Support/Error.h>
+
+#include "codegen.h"
+#include "jit.h"
+#include "runtime.h"
+
+bool BASICJIT::addModule(std::unique_ptr<llvm::Module> mod,
+                         std::unique_ptr<llvm::LLVMContext> ctx) {
+    initializeNativeTarget();
+
+    auto jit = llvm::orc::LLJITBuilder().create();
+    if (!jit) {
+        std::cout << "Could not create JIT: " << llvm::toString(jit.takeError()) << "\n";
+        return false;
+    }
+    _jit = std::move(*jit);
+
+    auto host_syms = llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+        _jit->getDataLayout().getGlobalPrefix());
+    if (!host_syms) {
+        std::cout << "Could not load host symbols: " << llvm::toString(host_syms.takeError()) << "\n";
+        return false;
+    }
+    _jit->getMainJITDylib().addGenerator(std::move(*host_syms));
+    if (!_define_runtime()) return false;
+
+    llvm::Error err = _jit->addIRModule(
+        llvm::orc::ThreadSafeModule(std::move(mod), std::move(ctx)));
+    if (err) {
+        std::cout << "Could not add module to JIT: " << llvm::toString(std::move(err)) << "\n";
+        return false;
+    }
+    return true;
+}
+
+bool BASICJIT::_define_runtime() {
+    // The print runtime is linked into this binary, point the JIT straight at it
+    llvm::orc::MangleAndInterner mangle(_jit->getExecutionSession(), _jit->getDataLayout());
+    std::vector<std::pair<const char *, void *>> runtime = {
+        {"basic_print_int", reinterpret_cast<void *>(&basic_print_int)},
+        {"basic_print_str", reinterpret_cast<void *>(&basic_print_str)},
+        {"basic_print_newline", reinterpret_cast<void *>(&basic_print_newline)},
+        {"basic_flush", reinterpret_cast<void *>(&basic_flush)},
+        {"basic_index_error", reinterpret_cast<void *>(&basic_index_error)},
+        {"basic_stack_overflow", reinterpret_cast<void *>(&basic_stack_overflow)},
+        {"basic_return_error", reinterpret_cast<void *>(&basic_return_error)},
+        {"basic_division_error", reinterpret_cast<void *>(&basic_division_error)},
+        {"basic_profile_start", reinterpret_cast<void *>(&basic_profile_start)},
+        {"basic_profile_write", reinterpret_cast<void *>(&basic_profile_write)},
+    };
+    llvm::orc::SymbolMap symbols;
+    for (auto &it : runtime) {
+#if LLVM_VERSION_MAJOR >= 17
+        symbols[mangle(it.first)] = llvm::orc::ExecutorSymbolDef(
+            llvm::orc::ExecutorAddr::fromPtr(it.second), llvm::JITSymbolFlags::Exported);
+#else
+        symbols[mangle(it.first)] = llvm::JITEvaluatedSymbol(
+            llvm::pointerToJITTargetAddress(it.second), llvm::JITSymbolFlags::Exported);
+#endif
+    }
+    llvm::Error err = _jit->getMainJITDylib().define(llvm::orc::absoluteSymbols(symbols));
+    if (err) {
+        std::cout << "Could not define runtime symbols: " << llvm::toString(std::move(err)) << "\n";
+        return false;
+    }
+    return true;
+}
+
+bool BASICJIT::lookupMain() {
+    auto sym = _jit->lookup("main");
+    if (!sym) {
+        std::cout << "Could not find main: " << llvm::toString(sym.takeError()) << "\n";
+        return false;
+    }
+#if LLVM_VERSION_MAJOR >= 15
+    _main = sym->toPtr<int (*)()>();
+#else
+    _main = reinterpret_cast<int (*)()>(sym->getAddress());
+#endif
+    return true;
+}
+
+int BASICJIT::run() {
+    return _main();
+}
+
+bool BASICJIT::lookupResume() {
+    auto sym = _jit->lookup("basic_resume");
+    if (!sym) {
+        std::cout << "Could not find basic_resume: " << llvm::toString(sym.takeError()) << "\n";
+        return false;
+    }
+#if LLVM_VERSION_MAJOR >= 15
+    _resume = sym->toPtr<int (*)(int32_t *, int32_t *)>();
+#else
+    _resume = reinterpret_cast<int (*)(int32_t *, int32_t *)>(sym->getAddress());
+#endif
+    return true;
+}
+
+int BASICJIT::resume(int32_t *vars, int32_t *arrays) {
+    return _resume(vars, arrays);
+}
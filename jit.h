@@ -0,0 +1,33 @@
+#ifndef JIT_H_
+#define JIT_H_
+
+#include <cstdint>
+#include <memory>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+
+//
+// Runs a generated module in-process through an ORC LLJIT. The print
+// runtime and any other symbols are resolved from the host process.
+//
+class BASICJIT {
+  public:
+    bool addModule(std::unique_ptr<llvm::Module> mod,
+                   std::unique_ptr<llvm::LLVMContext> ctx);
+    // Compiles the module and looks up main, must be called before run()
+    bool lookupMain();
+    int run();
+    // For modules from BASICParser::generateResumeModule
+    bool lookupResume();
+    int resume(int32_t *vars, int32_t *arrays);
+
+  private:
+    std::unique_ptr<llvm::orc::LLJIT> _jit;
+    int (*_main)() = nullptr;
+    int (*_resume)(int32_t *, int32_t *) = nullptr;
+
+    bool _define_runtime();
+};
+
+#endif  // JIT_H_
@@ -1,103 +1,389 @@
+#include <chrono>
+#include <cstdint>
+#include <cstring>
 #include <istream>
-#include <sstream>
+#include <iterator>
 #include <string>
 #include <stdio.h>
+#include <llvm/Support/MemoryBuffer.h>
 
 #include "lexer.h"
 #include "tokens.h"
 
+bool BASICLexer::readFromFile(const std::string &path) {
+    auto buffer = llvm::MemoryBuffer::getFile(path);
+    if (!buffer) {
+        printf("Could not open %s: %s\n", path.c_str(), buffer.getError().message().c_str());
+        return false;
+    }
+    _buffer = std::move(*buffer);
+    return _scan_buffer();
+}
+
 bool BASICLexer::readFromStream(std::istream &in_stream) {
-    std::string line;
-    while (std::getline(in_stream, line)) {
-        std::stringstream ss(line);
-        if (!_push_int_or_var(ss)) return false;
-        if (!_push_instruction(ss)) return false;
-        _token_list.push_back(new EOLToken());
+    std::string text((std::istreambuf_iterator<char>(in_stream)),
+                     std::istreambuf_iterator<char>());
+    _buffer = llvm::MemoryBuffer::getMemBufferCopy(text);
+    return _scan_buffer();
+}
+
+bool BASICLexer::readFromBuffer(llvm::MemoryBufferRef source) {
+    _buffer = llvm::MemoryBuffer::getMemBuffer(source, false);
+    return _scan_buffer();
+}
+
+const TokenList &BASICLexer::getTokens() {
+    return _token_list;
+}
+
+bool BASICLexer::openFile(const std::string &path) {
+    _file.open(path, std::ios::binary);
+    if (!_file) {
+        printf("Could not open %s\n", path.c_str());
+        return false;
     }
+    openStream(_file);
     return true;
 }
 
-std::vector<Token *> BASICLexer::getTokens() {
-    return _token_list;
+void BASICLexer::openStream(std::istream &in_stream) {
+    _in = &in_stream;
+    _read_buf.reset(new char[kReadBufferSize]);
+    _next = _end = _read_buf.get();
+}
+
+void BASICLexer::openBuffer(llvm::MemoryBufferRef source) {
+    _in = nullptr;
+    _next = source.getBufferStart();
+    _end = source.getBufferEnd();
+}
+
+bool BASICLexer::nextLine() {
+    if (_lex_wall == nullptr) return _next_line();
+    auto start = std::chrono::steady_clock::now();
+    bool ok = _next_line();
+    *_lex_wall += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return ok;
+}
+
+bool BASICLexer::_next_line() {
+    _token_list.tokens.clear();
+    _token_list.strings.clear();
+    const char *eol = _next;
+    while (true) {
+        while (eol < _end && *eol != '\n') ++eol;
+        if (eol == _end && _in != nullptr) {
+            // Pulls in the rest of a partial line, or notices the end of input
+            size_t scanned = eol - _next;
+            if (!_refill()) return false;
+            eol = _next + scanned;
+            if (eol < _end) continue;
+        }
+        if (_next == _end) return false;
+        _cur = _next;
+        _eol = eol;
+        _next = eol < _end ? eol + 1 : eol;
+        eol = _next;
+        ++_line_no;
+
+        if (_at_eol()) continue;
+        if (!_scan_line()) {
+            _error = true;
+            return false;
+        }
+        _token_count += _token_list.tokens.size();
+        return true;
+    }
+}
+
+// Moves the unscanned tail to the front of the buffer and reads more after it
+bool BASICLexer::_refill() {
+    size_t kept = _end - _next;
+    if (kept == kReadBufferSize) {
+        printf("Line %d is longer than %zu bytes\n", _line_no + 1, kReadBufferSize);
+        _error = true;
+        return false;
+    }
+    char *buf = _read_buf.get();
+    memmove(buf, _next, kept);
+    _in->read(buf + kept, kReadBufferSize - kept);
+    _next = buf;
+    _end = buf + kept + _in->gcount();
+    if (_in->bad()) {
+        printf("Error reading line %d\n", _line_no + 1);
+        _error = true;
+        return false;
+    }
+    return true;
+}
+
+bool BASICLexer::_scan_buffer() {
+    const char *cur = _buffer->getBufferStart();
+    const char *end = _buffer->getBufferEnd();
+    _line_no = 0;
+    while (cur < end) {
+        const char *eol = cur;
+        while (eol < end && *eol != '\n') ++eol;
+        _cur = cur;
+        _eol = eol;
+        cur = eol + 1;
+        ++_line_no;
+
+        if (_at_eol()) continue;
+        if (!_scan_line()) return false;
+    }
+    return true;
+}
+
+bool BASICLexer::_scan_line() {
+    if (!_push_int_or_var()) return false;
+    if (!_push_instruction()) return false;
+    if (!_at_eol()) {
+        printf("Unexpected '%s' at end of line %d\n", _next_word().str().c_str(), _line_no);
+        return false;
+    }
+    _push(TokenKind::EOL);
+    return true;
+}
+
+void BASICLexer::_skip_space() {
+    while (_cur < _eol && (*_cur == ' ' || *_cur == '\t' || *_cur == '\r')) ++_cur;
+}
+
+llvm::StringRef BASICLexer::_next_word() {
+    _skip_space();
+    const char *start = _cur;
+    while (_cur < _eol && *_cur != ' ' && *_cur != '\t' && *_cur != '\r') ++_cur;
+    return llvm::StringRef(start, _cur - start);
+}
+
+bool BASICLexer::_at_eol() {
+    _skip_space();
+    return _cur == _eol;
+}
+
+void BASICLexer::_push(TokenKind kind, int val) {
+    _token_list.tokens.push_back(Token{kind, 0, val, _line_no});
 }
 
-bool BASICLexer::_push_instruction(std::stringstream &ss) {
-    std::string instr;
-    ss >> instr;
+bool BASICLexer::_push_instruction() {
+    llvm::StringRef instr = _next_word();
     if (instr == "LET") {
-        _token_list.push_back(new LETToken());
-        _push_LET(ss);
+        _push(TokenKind::LET);
+        return _push_LET();
     } else if (instr == "IF") {
-        _token_list.push_back(new IFToken());
-        _push_IF(ss);
+        _push(TokenKind::IF);
+        return _push_IF();
     } else if (instr == "PRINT") {
-        _token_list.push_back(new PRINTToken());
-        _push_const_str(ss);
+        _push(TokenKind::PRINT);
+        return _push_const_str();
     } else if (instr == "PRINTLN") {
-        _token_list.push_back(new PRINTLNToken());
-        _push_const_str(ss);
+        _push(TokenKind::PRINTLN);
+        return _push_const_str();
+    } else if (instr == "FOR") {
+        _push(TokenKind::FOR);
+        return _push_FOR();
+    } else if (instr == "NEXT") {
+        _push(TokenKind::NEXT);
+        return _push_var();
+    } else if (instr == "DIM") {
+        _push(TokenKind::DIM);
+        return _push_DIM();
+    } else if (instr == "GOSUB") {
+        _push(TokenKind::GOSUB);
+        return _push_int_or_var();
+    } else if (instr == "RETURN") {
+        _push(TokenKind::RETURN);
+        return true;
+    }
+    printf("Unknown instruction %s\n", instr.str().c_str());
+    return false;
+}
+
+bool BASICLexer::_push_LET() {
+    _skip_space();
+    if (_cur == _eol || *_cur < 'A' || *_cur > 'Z') {
+        printf("LET instr must be in the form 'LET X = <expression>'\n");
+        return false;
+    }
+    char var = *_cur++;
+    if (_peek('(')) {
+        if (!_push_element(var)) return false;
     } else {
-        printf("Unknown instruction %s\n", instr.c_str());
+        _push(TokenKind::VarIntValue, var);
+    }
+    _skip_space();
+    if (_cur == _eol || *_cur != '=') {
+        printf("LET instr must be in the form 'LET X = <expression>'\n");
         return false;
     }
+    ++_cur;
+    return _push_expr();
+}
+
+bool BASICLexer::_push_IF() {
+    if (!_push_expr()) return false;
+    if (!_push_cmp()) return false;
+    if (!_push_expr()) return false;
+    llvm::StringRef then = _next_word();
+    llvm::StringRef gto = _next_word();
+    if (then != "THEN" || gto != "GOTO") {
+        printf("IF must follow format of IF <cond> THEN GOTO L\n");
+        return false;
+    }
+    if (!_push_int_or_var()) return false;
     return true;
 }
 
-bool BASICLexer::_push_LET(std::stringstream &ss) {
-    std::string unused;
-    char lhs;
-    ss >> lhs >> unused;
-    _token_list.push_back(new VarIntValueToken(lhs));
-    if (unused != "=") {
-        printf("LET instr must be in the form 'LET X = <expression>'\n");
+bool BASICLexer::_push_FOR() {
+    const char *usage = "FOR must follow format of FOR V = <start> TO <limit> [STEP <step>]\n";
+    _skip_space();
+    if (_cur == _eol || *_cur < 'A' || *_cur > 'Z') {
+        printf("%s", usage);
+        return false;
+    }
+    _push(TokenKind::VarIntValue, *_cur++);
+    _skip_space();
+    if (_cur == _eol || *_cur != '=') {
+        printf("%s", usage);
         return false;
     }
-    if (!_push_int_or_var(ss)) return false;
-    if (ss.peek() == EOF) return true;
-    if (!_push_op(ss)) return false;
-    if (!_push_int_or_var(ss)) return false;
+    ++_cur;
+    if (!_push_int_or_var()) return false;
+    if (_next_word() != "TO") {
+        printf("%s", usage);
+        return false;
+    }
+    if (!_push_int_or_var()) return false;
+    if (_at_eol()) return true;
+    if (_next_word() != "STEP") {
+        printf("%s", usage);
+        return false;
+    }
+    return _push_int_or_var();
+}
+
+bool BASICLexer::_push_DIM() {
+    _skip_space();
+    if (_cur < _eol && *_cur >= 'A' && *_cur <= 'Z') {
+        char array = *_cur++;
+        if (_peek('(') && _push_element(array) &&
+            _token_list.tokens.back().kind == TokenKind::ConstElementValue) {
+            return true;
+        }
+    }
+    printf("DIM must follow format of DIM A(<size>) on line %d\n", _line_no);
+    return false;
+}
+
+bool BASICLexer::_push_var() {
+    _skip_space();
+    if (_cur == _eol || *_cur < 'A' || *_cur > 'Z') {
+        printf("Expected a variable on line %d\n", _line_no);
+        return false;
+    }
+    _push(TokenKind::VarIntValue, *_cur++);
     return true;
 }
 
-bool BASICLexer::_push_IF(std::stringstream &ss) {
-    if (!_push_int_or_var(ss)) return false;
-    if (!_push_cmp(ss)) return false;
-    if (!_push_int_or_var(ss)) return false;
-    std::string then, gto;
-    ss >> then >> gto;
-    if (then != "THEN" || gto != "GOTO") {
-        printf("IF must follow format of IF <cond> THEN GOTO L\n");
+bool BASICLexer::_push_int_or_var() {
+    _skip_space();
+    const char *p = _cur;
+    bool negative = false;
+    if (p < _eol && (*p == '-' || *p == '+')) negative = *p++ == '-';
+    if (p < _eol && *p >= '0' && *p <= '9') {
+        // Magnitudes up to 2^31 fit a token once negated
+        int64_t max = negative ? -static_cast<int64_t>(INT32_MIN) : INT32_MAX;
+        int64_t val = 0;
+        while (p < _eol && *p >= '0' && *p <= '9') {
+            val = val * 10 + (*p++ - '0');
+            if (val > max) {
+                printf("Number out of range on line %d\n", _line_no);
+                return false;
+            }
+        }
+        _cur = p;
+        _push(TokenKind::ConstIntValue, static_cast<int32_t>(negative ? -val : val));
+        return true;
+    }
+    if (_cur < _eol && *_cur >= 'A' && *_cur <= 'Z') {
+        char var = *_cur++;
+        if (_peek('(')) return _push_element(var);
+        _push(TokenKind::VarIntValue, var);
+        return true;
+    }
+    printf("Expected a number or variable on line %d\n", _line_no);
+    return false;
+}
+
+// Scans "(<index>)" after the array letter, the index is a number or a variable
+bool BASICLexer::_push_element(char array) {
+    ++_cur;
+    if (!_push_int_or_var()) return false;
+    Token &elem = _token_list.tokens.back();
+    if (elem.isElement() || !_peek(')')) {
+        printf("Array index must be a number or variable in parentheses on line %d\n", _line_no);
         return false;
     }
-    if (!_push_int_or_var(ss)) return false;
+    ++_cur;
+    elem.kind = elem.kind == TokenKind::ConstIntValue ? TokenKind::ConstElementValue
+                                                      : TokenKind::VarElementValue;
+    elem.array = array;
     return true;
 }
 
-bool BASICLexer::_push_int_or_var(std::stringstream &ss) {
-    int i_rhs1;
-    ss >> i_rhs1;
-    if (!ss.fail()) {
-        _token_list.push_back(new ConstIntValueToken(i_rhs1));
-    } else {
-        ss.clear();
-        char c_rhs1;
-        ss >> c_rhs1;
-        _token_list.push_back(new VarIntValueToken(c_rhs1));
+// Skips spaces and tells whether the next character is c
+bool BASICLexer::_peek(char c) {
+    _skip_space();
+    return _cur < _eol && *_cur == c;
+}
+
+// Scans operands joined by + - * /, each one preceded by any number of
+// unary minuses and opening parentheses. A minus directly before a digit
+// belongs to the number. The parser builds the tree, see _parse_expr.
+bool BASICLexer::_push_expr() {
+    int depth = 0;
+    while (true) {
+        while (true) {
+            _skip_space();
+            if (_cur < _eol && *_cur == '(') {
+                _push(TokenKind::LParen);
+                ++depth;
+            } else if (_cur + 1 < _eol && *_cur == '-' && (_cur[1] < '0' || _cur[1] > '9')) {
+                _push(TokenKind::Minus);
+            } else {
+                break;
+            }
+            ++_cur;
+        }
+        if (!_push_int_or_var()) return false;
+        while (depth > 0 && _peek(')')) {
+            _push(TokenKind::RParen);
+            --depth;
+            ++_cur;
+        }
+        _skip_space();
+        if (_cur == _eol || (*_cur != '+' && *_cur != '-' && *_cur != '*' && *_cur != '/')) break;
+        if (!_push_op()) return false;
+    }
+    if (depth > 0) {
+        printf("Missing ')' on line %d\n", _line_no);
+        return false;
     }
     return true;
 }
 
-bool BASICLexer::_push_op(std::stringstream &ss) {
-    char op;
-    ss >> op;
+bool BASICLexer::_push_op() {
+    _skip_space();
+    char op = _cur < _eol ? *_cur++ : '\0';
     if (op == '+') {
-        _token_list.push_back(new PlusToken());
+        _push(TokenKind::Plus);
     } else if (op == '-') {
-        _token_list.push_back(new MinusToken());
+        _push(TokenKind::Minus);
     } else if (op == '*') {
-        _token_list.push_back(new MulToken());
+        _push(TokenKind::Mul);
     } else if (op == '/') {
-        _token_list.push_back(new DivToken());
+        _push(TokenKind::Div);
     } else {
         printf("Unknown op: %c\n", op);
         return false;
@@ -105,39 +391,54 @@ bool BASICLexer::_push_op(std::stringstream &ss) {
     return true;
 }
 
-bool BASICLexer::_push_cmp(std::stringstream &ss) {
-    std::string op;
-    ss >> op;
+bool BASICLexer::_push_cmp() {
+    _skip_space();
+    const char *start = _cur;
+    while (_cur < _eol && (*_cur == '<' || *_cur == '>' || *_cur == '=')) ++_cur;
+    llvm::StringRef op(start, _cur - start);
     if (op == "=") {
-        _token_list.push_back(new EqToken());
+        _push(TokenKind::Eq);
     } else if (op == ">") {
-        _token_list.push_back(new GtToken());
+        _push(TokenKind::Gt);
     } else if (op == "<") {
-        _token_list.push_back(new LtToken());
+        _push(TokenKind::Lt);
     } else if (op == "<>") {
-        _token_list.push_back(new NeToken());
+        _push(TokenKind::Ne);
     } else if (op == "<=") {
-        _token_list.push_back(new LteToken());
+        _push(TokenKind::Lte);
     } else if (op == ">=") {
-        _token_list.push_back(new GteToken());
+        _push(TokenKind::Gte);
     } else {
-        printf("Unknown operation: %s\n", op.c_str());
+        printf("Unknown operation: %s\n", op.str().c_str());
         return false;
     }
     return true;
 }
 
-bool BASICLexer::_push_const_str(std::stringstream &ss) {
-    std::string temp;
-    ss >> temp;
-    if (temp[0] != '"') {
-        _token_list.push_back(new VarIntValueToken(temp[0]));
-    } else {
-        std::string const_str;
-        std::getline(ss, const_str);
-        const_str = temp + const_str;
-        _token_list.push_back(
-            new StringValueToken(const_str.substr(1, const_str.length() - 2)));
+bool BASICLexer::_push_const_str() {
+    _skip_space();
+    if (_cur == _eol) {
+        printf("PRINT expects a variable or a string on line %d\n", _line_no);
+        return false;
+    }
+    if (*_cur != '"') {
+        if (*_cur < 'A' || *_cur > 'Z') {
+            printf("PRINT expects a variable or a string on line %d\n", _line_no);
+            return false;
+        }
+        char var = *_cur++;
+        if (_peek('(')) return _push_element(var);
+        _push(TokenKind::VarIntValue, var);
+        return true;
+    }
+    const char *start = ++_cur;
+    while (_cur < _eol && *_cur != '"') ++_cur;
+    if (_cur == _eol) {
+        printf("Unterminated string on line %d\n", _line_no);
+        return false;
     }
+    _push(TokenKind::StringValue, static_cast<int>(_token_list.strings.size()));
+    _token_list.strings.push_back(llvm::StringRef(start, _cur - start));
+    ++_cur;
     return true;
 }
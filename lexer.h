@@ -1,32 +1,92 @@
 #ifndef LEXER_H_
 #define LEXER_H_
 
+#include <fstream>
 #include <istream>
-#include <sstream>
+#include <memory>
+#include <string>
 #include <vector>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/MemoryBuffer.h>
 
 #include "tokens.h"
 
+//
+// The lexer either scans a whole source into one token list (read*) or
+// hands out one line of tokens at a time (open* then nextLine). In the
+// streaming mode files and streams are read through a fixed-size buffer,
+// so memory use does not grow with the size of the program.
+//
 class BASICLexer {
   public:
-    // ~BASICLexer() {
-    //     for (auto it : _token_list) delete it;
-    // }
+    // Longest source line the streaming mode accepts
+    static const size_t kReadBufferSize = 64 * 1024;
 
+    // Maps the file into memory and scans it in place
+    bool readFromFile(const std::string &path);
     bool readFromStream(std::istream &in_stream);
-    std::vector<Token *> getTokens();
+    // Scans source in place, it must outlive the token list
+    bool readFromBuffer(llvm::MemoryBufferRef source);
+    const TokenList &getTokens();
+
+    bool openFile(const std::string &path);
+    void openStream(std::istream &in_stream);
+    // source must outlive the lexer
+    void openBuffer(llvm::MemoryBufferRef source);
+    // Scans the next non-blank line into getLine(). Returns false at the end
+    // of the input or on an error, hadError() tells the two apart.
+    bool nextLine();
+    // Tokens of the current line, strings are only valid until nextLine()
+    const TokenList &getLine() {return _token_list;}
+    bool hadError() {return _error;}
+    // Tokens scanned so far in the streaming mode
+    size_t tokenCount() {return _token_count;}
+    // Adds the wall time spent in nextLine to *wall, if not null. Only a
+    // cheap clock is read, CPU time per line would cost more than the line.
+    void setLexWall(double *wall) {_lex_wall = wall;}
 
   private:
-    std::vector<Token *> _token_list;
+    TokenList _token_list;
+    // Source text, string tokens point into it
+    std::unique_ptr<llvm::MemoryBuffer> _buffer;
+    // Streaming input, null when the whole source is already in memory
+    std::istream *_in = nullptr;
+    std::ifstream _file;
+    std::unique_ptr<char[]> _read_buf;
+    // Unscanned part of the source that is in memory
+    const char *_next = nullptr;
+    const char *_end = nullptr;
+    bool _error = false;
+    size_t _token_count = 0;
+    double *_lex_wall = nullptr;
+    // Scanner position within the current line
+    const char *_cur;
+    const char *_eol;
+    int _line_no = 0;
+
+    bool _next_line();
+    bool _scan_buffer();
+    bool _scan_line();
+    bool _refill();
+    void _skip_space();
+    llvm::StringRef _next_word();
+    bool _at_eol();
+    void _push(TokenKind kind, int val = 0);
 
-    bool _push_instruction(std::stringstream &rest);
-    bool _push_LET(std::stringstream &rest);
-    bool _push_IF(std::stringstream &rest);
+    bool _push_instruction();
+    bool _push_LET();
+    bool _push_IF();
+    bool _push_FOR();
+    bool _push_DIM();
+    bool _push_var();
 
-    bool _push_const_str(std::stringstream &rest);
-    bool _push_op(std::stringstream &rest);
-    bool _push_cmp(std::stringstream &rest);
-    bool _push_int_or_var(std::stringstream &rest);
+    bool _push_const_str();
+    bool _push_expr();
+    bool _push_op();
+    bool _push_cmp();
+    bool _push_int_or_var();
+    bool _push_element(char array);
+    bool _peek(char c);
 };
 
 #endif  // LEXER_H_
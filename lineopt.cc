@@ -0,0 +1,195 @@
+#include <vector>
+
+#include "lineopt.h"
+#include "parser.h"
+
+KnownVars::KnownVars(State initial) {
+    for (int i = 0; i < 26; ++i) {
+        state[i] = initial;
+        value[i] = 0;
+    }
+}
+
+void KnownVars::set(char var, int32_t val) {
+    state[var - 'A'] = Const;
+    value[var - 'A'] = val;
+}
+
+void KnownVars::clobber(char var) {
+    state[var - 'A'] = Varying;
+}
+
+bool KnownVars::meet(const KnownVars &other) {
+    bool changed = false;
+    for (int i = 0; i < 26; ++i) {
+        if (other.state[i] == Unknown || state[i] == Varying) continue;
+        if (state[i] == Unknown) {
+            state[i] = other.state[i];
+            value[i] = other.value[i];
+            changed = true;
+        } else if (other.state[i] == Varying || other.value[i] != value[i]) {
+            state[i] = Varying;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+namespace {
+
+//
+// Lines [start, end) of the sorted program form one block. Index n (the
+// number of lines) is the end block.
+//
+class LineOptimizer {
+  public:
+    LineOptimizer(LabelTable *labels) : _labels(labels), _n(labels->size()) {
+        for (size_t i = 0; i < _n; ++i) {
+            if (_labels->blocks[i] != nullptr) _starts.push_back(i);
+        }
+        _starts.push_back(_n);
+        _block_end.assign(_n + 1, _n);
+        for (size_t b = 0; b + 1 < _starts.size(); ++b) _block_end[_starts[b]] = _starts[b + 1];
+    }
+
+    size_t run() {
+        _propagate();
+        _rewrite();
+        _remove_dead_stores();
+        return _removed;
+    }
+
+  private:
+    LabelTable *_labels;
+    size_t _n;
+    std::vector<size_t> _starts;
+    std::vector<size_t> _block_end;
+    std::vector<KnownVars> _in;
+    std::vector<bool> _executable;
+    // Successor blocks of each executable block once branches are folded
+    std::vector<std::vector<size_t>> _succs;
+    size_t _removed = 0;
+
+    // Successors of the block whose last line is last, given what is known
+    // at its end: the jump target if it can be taken, the next line if the
+    // jump can be skipped. A RETURN continues after its GOSUB lines.
+    void _edges(size_t last, const KnownVars &known, std::vector<size_t> *out) {
+        out->clear();
+        Instruction *instr = _labels->instrs[last];
+        const llvm::ArrayRef<int> *sites = instr != nullptr ? instr->returnSites() : nullptr;
+        if (sites != nullptr) {
+            for (int site : *sites) out->push_back(site + 1);
+            return;
+        }
+        int target = instr != nullptr ? instr->jumpIndex() : -1;
+        int taken = target >= 0 ? instr->evaluate(known) : 0;
+        if (taken != 1) out->push_back(last + 1);
+        if (taken != 0) out->push_back(target);
+    }
+
+    // Sparse conditional constant propagation: blocks are only visited once
+    // an edge into them can execute. Variables start at zero.
+    void _propagate() {
+        _in.assign(_n + 1, KnownVars());
+        _executable.assign(_n + 1, false);
+        _in[0] = KnownVars(KnownVars::Const);
+        _executable[0] = true;
+        std::vector<size_t> worklist = {0};
+        std::vector<size_t> edges;
+        while (!worklist.empty()) {
+            size_t b = worklist.back();
+            worklist.pop_back();
+            if (b == _n) continue;
+            KnownVars known = _in[b];
+            for (size_t i = b; i < _block_end[b]; ++i) _labels->instrs[i]->transfer(&known);
+            _edges(_block_end[b] - 1, known, &edges);
+            for (size_t s : edges) {
+                bool changed = _in[s].meet(known);
+                if (!_executable[s] || changed) {
+                    _executable[s] = true;
+                    worklist.push_back(s);
+                }
+            }
+        }
+    }
+
+    // Applies the constants to each line and drops lines that cannot run
+    void _rewrite() {
+        _succs.assign(_n + 1, std::vector<size_t>());
+        for (size_t b : _starts) {
+            if (b == _n) break;
+            if (!_executable[b]) {
+                for (size_t i = b; i < _block_end[b]; ++i) _remove(i);
+                continue;
+            }
+            KnownVars known = _in[b];
+            for (size_t i = b; i < _block_end[b]; ++i) {
+                Instruction *instr = _labels->instrs[i];
+                if (i + 1 == _block_end[b]) _edges(i, known, &_succs[b]);
+                // rewrite needs the values from before the line
+                bool keep = instr->rewrite(known);
+                instr->transfer(&known);
+                if (!keep) _remove(i);
+            }
+        }
+    }
+
+    // A LET is dead when every path from it overwrites the variable or ends
+    // the program before reading it, and it cannot fail at run time
+    void _remove_dead_stores() {
+        std::vector<uint32_t> live_in(_n + 1, 0);
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (size_t k = _starts.size(); k-- > 0;) {
+                size_t b = _starts[k];
+                if (b == _n || !_executable[b]) continue;
+                uint32_t live = _live_out(b, live_in);
+                for (size_t i = _block_end[b]; i-- > b;) live = _transfer_live(i, live, false);
+                if (live != live_in[b]) {
+                    live_in[b] = live;
+                    changed = true;
+                }
+            }
+        }
+        for (size_t b : _starts) {
+            if (b == _n || !_executable[b]) continue;
+            uint32_t live = _live_out(b, live_in);
+            for (size_t i = _block_end[b]; i-- > b;) live = _transfer_live(i, live, true);
+        }
+    }
+
+    uint32_t _live_out(size_t b, const std::vector<uint32_t> &live_in) {
+        uint32_t live = 0;
+        for (size_t s : _succs[b]) live |= live_in[s];
+        return live;
+    }
+
+    uint32_t _transfer_live(size_t i, uint32_t live, bool remove) {
+        Instruction *instr = _labels->instrs[i];
+        if (instr == nullptr) return live;
+        int var = instr->writes();
+        if (var >= 0) {
+            uint32_t bit = 1u << (var - 'A');
+            // FOR and NEXT assign their variable but also jump, they stay
+            if (remove && (live & bit) == 0 && instr->jumpIndex() < 0 && !instr->mayTrap()) {
+                _remove(i);
+                return live;
+            }
+            live &= ~bit;
+        }
+        return live | instr->reads();
+    }
+
+    void _remove(size_t i) {
+        if (_labels->instrs[i] == nullptr) return;
+        _labels->instrs[i] = nullptr;
+        ++_removed;
+    }
+};
+
+}  // namespace
+
+size_t optimizeLines(LabelTable *labels) {
+    return LineOptimizer(labels).run();
+}
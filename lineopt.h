@@ -0,0 +1,35 @@
+#ifndef LINEOPT_H_
+#define LINEOPT_H_
+
+#include <cstddef>
+#include <cstdint>
+
+struct LabelTable;
+
+//
+// What the front-end optimizer knows about each variable at one point in
+// the program. Unknown means no path reaching the point has been seen yet.
+//
+struct KnownVars {
+    enum State : uint8_t { Unknown, Const, Varying };
+    State state[26];
+    int32_t value[26];
+
+    explicit KnownVars(State initial = Unknown);
+    bool isConst(char var) const {return state[var - 'A'] == Const;}
+    int32_t get(char var) const {return value[var - 'A'];}
+    void set(char var, int32_t val);
+    void clobber(char var);
+    // Merges in the values along another path, true if anything changed
+    bool meet(const KnownVars &other);
+};
+
+//
+// Front-end optimization of a sorted program whose blocks exist: constant
+// propagation and folding (including IF conditions), dead store and
+// unreachable line elimination. Removed lines become null in labels->instrs.
+// Returns the number of lines removed.
+//
+size_t optimizeLines(LabelTable *labels);
+
+#endif  // LINEOPT_H_
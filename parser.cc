@@ -1,334 +1,1633 @@
+#include <algorithm>
+#include <iterator>
 #include <vector>
 #include <iostream>
+#include <type_traits>
+#include <llvm/IR/MDBuilder.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Intrinsics.h>
+#include <llvm/IR/ValueSymbolTable.h>
+#include <llvm/ProfileData/InstrProf.h>
+#include <llvm/ProfileData/ProfileCommon.h>
+#include <llvm/Transforms/Utils/Local.h>
+#include "bytecode.h"
+#include "lineopt.h"
 #include "tokens.h"
 #include "parser.h"
 
-BASICParser::BASICParser() {
+BASICParser::BASICParser(llvm::LLVMContext &ctx) : _global_ctx(ctx) {
     _mod.reset(new llvm::Module("BASIC", _global_ctx));
     _builder.reset(new llvm::IRBuilder<>(_global_ctx));
+    std::fill(std::begin(_array_uses), std::end(_array_uses), -1);
 }
 
-bool BASICParser::parseFromTokenList(const std::vector<Token *> &tk_lst) {
+bool BASICParser::parseFromTokenList(const TokenList &tk_lst) {
     unsigned int curr_pos = 0;
-    while (curr_pos < tk_lst.size()) {
-        int label = static_cast<ConstIntValueToken *>(tk_lst[curr_pos])->getVal();
-        ++curr_pos;
-        std::string next_token = tk_lst[curr_pos]->getName();
-        if (next_token == "LETToken") {
-            if (!_make_let(tk_lst, curr_pos, label)) return false;
-        } else if (next_token == "IFToken") {
-            if (!_make_if(tk_lst, curr_pos, label)) return false;
-        } else if (next_token == "PRINTToken") {
-            if (!_make_print(tk_lst, curr_pos, label)) return false;
-        } else if (next_token == "PRINTLNToken") {
-            if (!_make_println(tk_lst, curr_pos, label)) return false;
-        } else {
-            std::cout << "Invalid token '" << next_token << "' expecting instruction\n";
-            return false;
-        }
-        if (tk_lst[curr_pos]->getName() != "EOLToken") {
-            std::cout << "Trailing tokens at end of line (label: " << label << ")\n";
+    while (curr_pos < tk_lst.tokens.size()) {
+        if (!_parse_line(tk_lst, curr_pos)) return false;
+    }
+    return true;
+}
+
+bool BASICParser::parseFromLexer(BASICLexer &lexer) {
+    while (lexer.nextLine()) {
+        unsigned int curr_pos = 0;
+        if (!_parse_line(lexer.getLine(), curr_pos)) return false;
+    }
+    return !lexer.hadError();
+}
+
+bool BASICParser::_parse_line(const TokenList &tk_lst, unsigned int &curr_pos) {
+    const std::vector<Token> &tokens = tk_lst.tokens;
+    if (tokens[curr_pos].kind != TokenKind::ConstIntValue) {
+        std::cout << "Expecting a line label (line: " << tokens[curr_pos].line << ")\n";
+        return false;
+    }
+    int label = tokens[curr_pos].getInt();
+    ++curr_pos;
+    unsigned int first = curr_pos;
+    TokenKind next_token = tokens[curr_pos].kind;
+    if (next_token == TokenKind::LET) {
+        if (!_make_let(tk_lst, curr_pos, label)) return false;
+    } else if (next_token == TokenKind::IF) {
+        if (!_make_if(tk_lst, curr_pos, label)) return false;
+    } else if (next_token == TokenKind::PRINT) {
+        if (!_make_print(tk_lst, curr_pos, label)) return false;
+    } else if (next_token == TokenKind::PRINTLN) {
+        if (!_make_println(tk_lst, curr_pos, label)) return false;
+    } else if (next_token == TokenKind::FOR) {
+        if (!_make_for(tk_lst, curr_pos, label)) return false;
+    } else if (next_token == TokenKind::NEXT) {
+        if (!_make_next(tk_lst, curr_pos, label)) return false;
+    } else if (next_token == TokenKind::DIM) {
+        if (!_make_dim(tk_lst, curr_pos, label)) return false;
+    } else if (next_token == TokenKind::GOSUB) {
+        if (!_make_gosub(tk_lst, curr_pos, label)) return false;
+    } else if (next_token == TokenKind::RETURN) {
+        if (!_make_return(tk_lst, curr_pos, label)) return false;
+    } else {
+        std::cout << "Invalid token '" << tokenKindName(next_token) << "' expecting instruction\n";
+        return false;
+    }
+    if (tokens[curr_pos].kind != TokenKind::EOL) {
+        std::cout << "Trailing tokens at end of line (label: " << label << ")\n";
+        return false;
+    }
+    for (unsigned int i = first; i < curr_pos; ++i) {
+        if (tokens[i].isElement() && _array_uses[tokens[i].array - 'A'] < 0)
+            _array_uses[tokens[i].array - 'A'] = label;
+    }
+    ++curr_pos;
+    return true;
+}
+
+bool BASICParser::generateBytecode(Bytecode *code) {
+    if (!_sort_lines()) return false;
+    for (auto label : _jump_landings) {
+        if (_labels.indexOf(label) < 0) {
+            std::cout << "Jump to unknown label " << label << "\n";
             return false;
         }
-        ++curr_pos;
     }
+    // The GOSUB depth and FOR limits live in the registers after the
+    // variables, like in main's alloca, followed by the scratch registers
+    // the longest expression needs
+    unsigned int scratch = Bytecode::kNumScratch;
+    for (Instruction *instr : _labels.instrs) scratch = std::max(scratch, instr->scratchNeeded());
+    if (_slot_count() + scratch > UINT16_MAX) {
+        std::cout << "Too many FOR loops or too long expressions for the interpreter\n";
+        return false;
+    }
+    code->stack_slot = _stack.slot;
+    code->scratch_base = _slot_count();
+    code->registers.resize(code->scratch_base + scratch, 0);
+    std::copy(std::begin(_arrays.sizes), std::end(_arrays.sizes), code->array_sizes);
+    std::copy(std::begin(_arrays.offsets), std::end(_arrays.offsets), code->array_offsets);
+    code->stack_offset = _arrays.total;
+    code->array_words = _arrays.total + (_call_lines.empty() ? 0 : ReturnStack::kDepth);
+    for (size_t i = 0; i < _labels.size(); ++i) {
+        code->beginLine(_labels.labels[i]);
+        if (!_labels.instrs[i]->addToBytecode(code)) return false;
+    }
+    code->beginLine(-1);
+    code->emit(Opcode::End);
+    code->finish();
     return true;
 }
 
-llvm::Module *BASICParser::generateModule() {
+std::unique_ptr<llvm::Module> BASICParser::generateResumeModule(int label) {
+    _resume_label = label;
+    return generateModule();
+}
+
+std::unique_ptr<llvm::Module> BASICParser::generateModule() {
+    if (!_sort_lines()) return nullptr;
     if (!_create_functions()) return nullptr;
     if (!_create_blocks()) return nullptr;
+    _create_arrays();
+    _create_stack();
     if (!_create_vars()) return nullptr;
+    _create_profile();
+    // Constant propagation assumes the program starts with zeroed variables
+    bool optimize = _optimize_lines && _resume_label < 0;
+    if (optimize) optimizeLines(&_labels);
+
+    // Where the value of a FOR variable is known inside its body, its range
+    // is set while the body is emitted
+    std::vector<FORInstruction *> body_start(_labels.size() + 1, nullptr);
+    std::vector<FORInstruction *> body_end(_labels.size() + 1, nullptr);
+    for (FORInstruction *loop : _loops) {
+        int64_t lo, hi;
+        if (loop->nextIndex() < 0 || !loop->bodyRange(&lo, &hi)) continue;
+        body_start[loop->index() + 1] = loop;
+        body_end[loop->nextIndex()] = loop;
+    }
 
-    bool after_jump = false;
-    for (auto it : _instrs) {
-        if (_blocks.find(it.first) != _blocks.end()) {
-            if (_jump_landings.find(it.first) != _jump_landings.end() and !after_jump)
-                _builder->CreateBr(_blocks[it.first]);
-            _builder->SetInsertPoint(_blocks[it.first]);
+    // Falls through into each new block unless the last line already jumped.
+    // Lines removed by the optimizer are null.
+    for (size_t i = 0; i < _labels.size(); ++i) {
+        if (body_start[i] != nullptr) {
+            int64_t lo, hi;
+            body_start[i]->bodyRange(&lo, &hi);
+            _arrays.setRange(body_start[i]->var(), lo, hi);
         }
-        if (!it.second->addToBuilder(_builder.get(), _mod.get())) return nullptr;
-        after_jump = _jump_fallthrough.find(it.first) != _jump_fallthrough.end();
+        if (body_end[i] != nullptr) _arrays.setRange(body_end[i]->var(), 1, 0);
+        if (_labels.blocks[i] != nullptr) {
+            if (_builder->GetInsertBlock()->getTerminator() == nullptr)
+                _builder->CreateBr(_labels.target(_builder.get(), i));
+            _builder->SetInsertPoint(_labels.blocks[i]);
+            _exprs.clear();
+            if (_profile.counters != nullptr) _profile.count(_builder.get(), i, 0);
+        }
+        if (_labels.instrs[i] == nullptr) continue;
+        if (!_labels.instrs[i]->addToBuilder(_builder.get(), _mod.get())) return nullptr;
     }
 
-    if (!after_jump) _builder->CreateBr(_blocks.rbegin()->second);
-    _builder->SetInsertPoint(_blocks.rbegin()->second);
+    llvm::BasicBlock *end_block = _labels.blocks.back();
+    if (_builder->GetInsertBlock()->getTerminator() == nullptr)
+        _builder->CreateBr(_labels.target(_builder.get(), _labels.size()));
+    _builder->SetInsertPoint(end_block);
+    _builder->CreateCall(_mod->getFunction("basic_flush"));
+    if (_profile.counters != nullptr) _builder->CreateCall(_mod->getFunction("basic_profile_write"));
     _builder->CreateRet(
         llvm::ConstantInt::get(
             llvm::Type::getInt32Ty(_global_ctx),
             0));
-    return _mod.get();
+    _enter_regions();
+    // Blocks that only held unreachable lines are left empty, drop them
+    if (optimize) {
+        for (llvm::Function &fn : *_mod) {
+            if (!fn.isDeclaration()) llvm::removeUnreachableBlocks(fn);
+        }
+    }
+    _arrays.clearRanges();
+    _exprs.clear();
+    return std::move(_mod);
 }
 
 bool BASICParser::_create_functions() {
-    // printf
-    std::vector<llvm::Type *> printf_args = {llvm::Type::getInt8PtrTy(_global_ctx)};
-    llvm::FunctionType *printf_type = llvm::FunctionType::get(
-        llvm::Type::getInt32Ty(_global_ctx),
-        printf_args,
-        true);
-    _printf = llvm::Function::Create(
-        printf_type,
-        llvm::Function::ExternalLinkage,
-        "printf",
-        _mod.get());
-    _printf->setCallingConv(llvm::CallingConv::C);
-    _printf->addAttribute(1, llvm::Attribute::NoCapture);
-    // main
+    // Print runtime, see runtime.h
+    llvm::Type *void_type = llvm::Type::getVoidTy(_global_ctx);
+    llvm::Type *int_type = llvm::Type::getInt32Ty(_global_ctx);
+    llvm::Type *str_type = llvm::Type::getInt8PtrTy(_global_ctx);
+    llvm::Type *labels_type = llvm::Type::getInt32PtrTy(_global_ctx);
+    llvm::Type *counts_type = llvm::Type::getInt64PtrTy(_global_ctx);
+    std::vector<std::pair<const char *, llvm::FunctionType *>> runtime = {
+        {"basic_print_int", llvm::FunctionType::get(void_type, {int_type}, false)},
+        {"basic_print_str", llvm::FunctionType::get(void_type, {str_type, int_type}, false)},
+        {"basic_print_newline", llvm::FunctionType::get(void_type, false)},
+        {"basic_flush", llvm::FunctionType::get(void_type, false)},
+        {"basic_index_error", llvm::FunctionType::get(
+            void_type, {int_type, int_type, int_type, int_type}, false)},
+        {"basic_stack_overflow", llvm::FunctionType::get(void_type, {int_type, int_type}, false)},
+        {"basic_return_error", llvm::FunctionType::get(void_type, {int_type}, false)},
+        {"basic_division_error", llvm::FunctionType::get(void_type, {int_type}, false)},
+        {"basic_profile_start", llvm::FunctionType::get(
+            void_type, {str_type, labels_type, counts_type, int_type}, false)},
+        {"basic_profile_write", llvm::FunctionType::get(void_type, false)},
+    };
+    for (auto &it : runtime) {
+        llvm::Function *fn = llvm::Function::Create(
+            it.second,
+            llvm::Function::ExternalLinkage,
+            it.first,
+            _mod.get());
+        fn->setCallingConv(llvm::CallingConv::C);
+        fn->setDoesNotThrow();
+        if (llvm::StringRef(it.first) == "basic_print_str") {
+            fn->addParamAttr(0, llvm::Attribute::NoCapture);
+            fn->addParamAttr(0, llvm::Attribute::ReadOnly);
+        }
+        // Runtime errors
+        if (llvm::StringRef(it.first).endswith("_error") ||
+            llvm::StringRef(it.first) == "basic_stack_overflow") {
+            fn->setDoesNotReturn();
+            fn->addFnAttr(llvm::Attribute::Cold);
+        }
+    }
+    // main, or basic_resume(i32 *vars, i32 *arrays) when resuming
+    std::vector<llvm::Type *> main_params;
+    if (_resume_label >= 0) main_params.assign(2, llvm::Type::getInt32PtrTy(_global_ctx));
     llvm::FunctionType *main_type = llvm::FunctionType::get(
         llvm::Type::getInt32Ty(_global_ctx),
-        std::vector<llvm::Type *>(),
+        main_params,
         false);
     _main = llvm::Function::Create(
         main_type,
         llvm::Function::ExternalLinkage,
-        "main",
+        _resume_label >= 0 ? "basic_resume" : "main",
         _mod.get());
     _main->setCallingConv(llvm::CallingConv::C);
     return true;
 }
 
+int LabelTable::indexOf(int label) const {
+    auto it = std::lower_bound(labels.begin(), labels.end(), label);
+    if (it == labels.end() || *it != label) return -1;
+    return it - labels.begin();
+}
+
+llvm::BasicBlock *LabelTable::target(llvm::IRBuilder<> *builder, int index) {
+    llvm::BasicBlock *block = blocks[index];
+    llvm::Function *fn = builder->GetInsertBlock()->getParent();
+    if (block->getParent() == fn) return block;
+    // Leaves the region, main gets its variables back and continues at the line
+    llvm::BasicBlock *&exit = regions->exits[{fn, index}];
+    if (exit == nullptr) {
+        exit = llvm::BasicBlock::Create(fn->getContext(), "exit." + block->getName(), fn);
+        llvm::IRBuilder<> exit_builder(exit);
+        regions->copyVars(&exit_builder, fn, true);
+        exit_builder.CreateRet(builder->getInt32(key(index)));
+        enter(index);
+    }
+    return exit;
+}
+
+void LabelTable::enter(int index) {
+    // main's dispatch switch falls through to the end block
+    if (static_cast<size_t>(index) == size()) return;
+    regions->entries[index] = true;
+}
+
+int LabelTable::key(int index) const {
+    if (regions == nullptr) return index;
+    return static_cast<size_t>(index) == size() ? -1 : labels[index];
+}
+
+void RegionTable::copyVars(llvm::IRBuilder<> *builder, llvm::Function *fn, bool to_main) const {
+    auto vars = llvm::cast<llvm::AllocaInst>(fn->getValueSymbolTable()->lookup("vars"));
+    llvm::Type *type = vars->getAllocatedType();
+    unsigned int limits = type->getArrayNumElements() - shared;
+    llvm::Value *own[] = {vars, builder->CreateConstInBoundsGEP2_32(type, vars, 0, shared)};
+    unsigned int sizes[] = {shared, limits};
+    for (int part = 0; part < 2; ++part) {
+        if (sizes[part] == 0) continue;
+        llvm::Value *main_part = fn->getArg(part);
+        llvm::Value *dst = to_main ? main_part : own[part];
+        llvm::Value *src = to_main ? own[part] : main_part;
+        builder->CreateMemCpy(dst, llvm::Align(4), src, llvm::Align(4), sizes[part] * 4);
+    }
+}
+
+bool BASICParser::_sort_lines() {
+    // Already done when generateResumeModule follows generateBytecode
+    if (!_labels.labels.empty()) return true;
+    // Programs are almost always written in label order, so only sort when needed
+    auto by_label = [](Instruction *a, Instruction *b) {return a->label < b->label;};
+    if (!std::is_sorted(_instrs.begin(), _instrs.end(), by_label))
+        std::stable_sort(_instrs.begin(), _instrs.end(), by_label);
+    // A repeated label replaces the earlier line
+    for (size_t i = 0; i < _instrs.size(); ++i) {
+        if (i + 1 < _instrs.size() && _instrs[i + 1]->label == _instrs[i]->label) continue;
+        _labels.labels.push_back(_instrs[i]->label);
+        _labels.instrs.push_back(_instrs[i]);
+    }
+    _instrs.clear();
+    if (!_resolve_loops() || !_resolve_calls() || !_layout_arrays()) return false;
+    _find_counted_loops();
+    return true;
+}
+
+bool BASICParser::_resolve_loops() {
+    std::vector<FORInstruction *> open;
+    for (size_t i = 0; i < _labels.size(); ++i) {
+        if (!_labels.instrs[i]->resolveLoops(&open, i)) return false;
+    }
+    if (!open.empty()) {
+        std::cout << "FOR without NEXT (label: " << _labels.labels[open.back()->index()] << ")\n";
+        return false;
+    }
+    return true;
+}
+
+// A loop is counted when it is only entered through its FOR and nothing but
+// its NEXT assigns the loop variable. A subroutine called from the body
+// could assign anything.
+void BASICParser::_find_counted_loops() {
+    std::vector<int> landings(_jump_landings);
+    std::sort(landings.begin(), landings.end());
+    for (FORInstruction *loop : _loops) {
+        // Replaced by a later line with the same label
+        if (loop->nextIndex() < 0) continue;
+        auto call = std::upper_bound(_call_lines.begin(), _call_lines.end(), loop->index());
+        bool counted = call == _call_lines.end() || *call > loop->nextIndex();
+        for (int i = loop->index() + 1; i <= loop->nextIndex() && counted; ++i) {
+            counted = std::binary_search(landings.begin(), landings.end(), _labels.labels[i]) == false &&
+                      (i == loop->nextIndex() || _labels.instrs[i]->writes() != loop->var());
+        }
+        if (counted) loop->setSingleEntry();
+    }
+}
+
+//
+// Finds the GOSUB lines each RETURN can return to. Between a GOSUB and the
+// RETURN that pops it, nested calls are balanced, so that RETURN is
+// reachable from the GOSUB's target when every nested GOSUB is taken to
+// continue with its next line. Each target is searched once that way,
+// stopping at RETURN lines.
+//
+bool BASICParser::_resolve_calls() {
+    size_t n = _labels.size();
+    // Target index and GOSUB index of each call, targets that do not exist
+    // are reported with the other jumps
+    std::vector<std::pair<int, int>> calls;
+    std::vector<bool> is_call(n, false);
+    for (GOSUBInstruction *call : _calls) {
+        int index = _labels.indexOf(call->label);
+        // Replaced by a later line with the same label
+        if (_labels.instrs[index] != call) continue;
+        _call_lines.push_back(index);
+        is_call[index] = true;
+        if (call->jumpIndex() >= 0) calls.push_back({call->jumpIndex(), index});
+    }
+    std::sort(_call_lines.begin(), _call_lines.end());
+    std::sort(calls.begin(), calls.end());
+
+    std::vector<std::vector<int>> sites(n);
+    std::vector<int> seen(n, -1);
+    std::vector<int> work;
+    for (size_t c = 0; c < calls.size();) {
+        int target = calls[c].first;
+        size_t end = c;
+        while (end < calls.size() && calls[end].first == target) ++end;
+        work.assign(1, target);
+        while (!work.empty()) {
+            int i = work.back();
+            work.pop_back();
+            if (i == static_cast<int>(n) || seen[i] == target) continue;
+            seen[i] = target;
+            Instruction *instr = _labels.instrs[i];
+            if (instr->returnSites() != nullptr) {
+                for (size_t k = c; k < end; ++k) sites[i].push_back(calls[k].second);
+                continue;
+            }
+            if (!is_call[i] && instr->jumpIndex() >= 0) work.push_back(instr->jumpIndex());
+            work.push_back(i + 1);
+        }
+        c = end;
+    }
+    for (RETURNInstruction *ret : _returns) {
+        int index = _labels.indexOf(ret->label);
+        if (_labels.instrs[index] != ret) continue;
+        std::vector<int> &found = sites[index];
+        std::sort(found.begin(), found.end());
+        int *copy = _arena.Allocate<int>(found.size());
+        std::copy(found.begin(), found.end(), copy);
+        ret->setSites(llvm::ArrayRef<int>(copy, found.size()));
+    }
+    return true;
+}
+
+bool BASICParser::_layout_arrays() {
+    for (int a = 0; a < 26; ++a) {
+        if (_array_uses[a] >= 0 && _arrays.sizes[a] == 0) {
+            std::cout << "Array " << static_cast<char>('A' + a) << " is used without DIM (label: "
+                      << _array_uses[a] << ")\n";
+            return false;
+        }
+        _arrays.offsets[a] = _arrays.total;
+        _arrays.total += _arrays.sizes[a];
+    }
+    return true;
+}
+
 bool BASICParser::_create_blocks() {
-    // Get all the labels that the blocks should be attached to
-    std::set<int> bb_labels;
-    bb_labels.insert(_instrs.begin()->first);
-    for (auto label : _jump_landings) bb_labels.insert(label);
-    for (auto fallthrough_it : _jump_fallthrough) {
-        auto instr_it = _instrs.find(fallthrough_it);
-        ++instr_it;
-        if (instr_it != _instrs.end()) {
-            bb_labels.insert(instr_it->first);
+    // Mark the lines that blocks should be attached to
+    size_t n = _labels.size();
+    std::vector<bool> starts_block(n + 1, false);
+    starts_block[0] = true;
+    for (auto label : _jump_landings) {
+        int index = _labels.indexOf(label);
+        if (index < 0) {
+            std::cout << "Jump to unknown label " << label << "\n";
+            return false;
         }
+        starts_block[index] = true;
+    }
+    for (auto label : _jump_fallthrough) {
+        starts_block[_labels.indexOf(label) + 1] = true;
     }
     // End block, needed for programs ending in IF
-    bb_labels.insert(_instrs.rbegin()->first + 1);
-    // Generate a block for each label
-    for (auto label : bb_labels) {
-        _blocks[label] = llvm::BasicBlock::Create(
-            _global_ctx, std::to_string(label), _main, 0);
+    starts_block[n] = true;
+
+    // Generate a block for each marked line, then walk backwards to find
+    // the block each line falls through to
+    _labels.blocks.assign(n + 1, nullptr);
+    _labels.successors.assign(n, 0);
+    for (size_t i = 0; i <= n; ++i) {
+        if (!starts_block[i]) continue;
+        std::string name = i < n ? std::to_string(_labels.labels[i]) : "end";
+        _labels.blocks[i] = llvm::BasicBlock::Create(_global_ctx, name, _main, 0);
     }
-    _builder->SetInsertPoint(_blocks[_instrs.begin()->first]);
+    int next_block = n;
+    for (size_t i = n; i-- > 0;) {
+        _labels.successors[i] = next_block;
+        if (_labels.blocks[i] != nullptr) next_block = i;
+    }
+    std::vector<bool> region_starts = _region_starts(starts_block);
+    if (!region_starts.empty()) _create_regions(region_starts);
     return true;
 }
 
+// Spreads labels, which are mostly multiples of 10, over the upper bits
+static uint32_t _label_hash(int label) {
+    return (static_cast<uint32_t>(label) * 2654435761u) >> 16;
+}
+
+// Cuts the program into _region_count regions of about the same number of
+// lines, or returns nothing if it is too short to be worth splitting. A FOR
+// loop's header and latch must end up in one function, so regions only
+// start at blocks outside every FOR body. Stable regions start at the
+// first such block at least stable_lines after the last start whose label
+// hashes to a multiple of stable_spacing, so where they start depends on
+// the nearby labels rather than on the number of lines before them.
+std::vector<bool> BASICParser::_region_starts(const std::vector<bool> &starts_block) {
+    const size_t min_lines = 256;
+    const size_t stable_lines = 192;
+    const uint32_t stable_spacing = 8;
+    size_t n = _labels.size();
+    std::vector<bool> region_starts;
+    size_t count = _stable_regions ? n / stable_lines : std::min<size_t>(_region_count, n / min_lines);
+    if (count < 2) return region_starts;
+    // Bodies open after their FOR line and close after their NEXT
+    std::vector<int> opened(n + 1, 0);
+    for (FORInstruction *loop : _loops) {
+        if (loop->nextIndex() < 0) continue;
+        ++opened[loop->index() + 1];
+        --opened[loop->nextIndex() + 1];
+    }
+    region_starts.assign(n, false);
+    region_starts[0] = true;
+    size_t length = _stable_regions ? stable_lines : n / count;
+    size_t last = 0;
+    int open = 0;
+    for (size_t i = 0; i < n; ++i) {
+        open += opened[i];
+        if (!starts_block[i] || open != 0 || i - last < length) continue;
+        if (_stable_regions && _label_hash(_labels.labels[i]) % stable_spacing != 0) continue;
+        region_starts[i] = true;
+        last = i;
+    }
+    return region_starts;
+}
+
+// Moves each region's blocks into its own function and sets up the switch
+// in main that dispatches to them. The calls are filled in by _call_regions
+// once main's variables exist. Regions work on a copy of main's variables,
+// so that they can be promoted to registers like main's.
+void BASICParser::_create_regions(const std::vector<bool> &region_starts) {
+    size_t n = _labels.size();
+    _regions.region_of.assign(n, 0);
+    _regions.entries.assign(n, false);
+    _regions.shared = _stack.slot + 1;
+    _labels.regions = &_regions;
+    std::vector<unsigned int> limits;
+    for (size_t i = 0; i < n; ++i) {
+        if (region_starts[i]) limits.push_back(0);
+        _regions.region_of[i] = limits.size() - 1;
+    }
+    // Loops replaced by a later line with the same label have no index
+    for (FORInstruction *loop : _loops) {
+        if (loop->index() < 0) continue;
+        loop->setSlot(_regions.shared + limits[_regions.region_of[loop->index()]]++);
+    }
+
+    llvm::Type *int_type = llvm::Type::getInt32Ty(_global_ctx);
+    llvm::Type *ptr_type = llvm::Type::getInt32PtrTy(_global_ctx);
+    llvm::FunctionType *region_type = llvm::FunctionType::get(
+        int_type, {ptr_type, ptr_type, int_type}, false);
+    llvm::BasicBlock *dispatch = llvm::BasicBlock::Create(_global_ctx, "dispatch", _main);
+    llvm::IRBuilder<> builder(dispatch);
+    _regions.next = builder.CreatePHI(int_type, 0, "next");
+    _regions.dispatch = builder.CreateSwitch(_regions.next, _labels.blocks.back());
+
+    unsigned int main_limits = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (region_starts[i]) {
+            unsigned int r = _regions.regions.size();
+            std::string name = "region." + std::to_string(_labels.labels[i]);
+            llvm::Function *fn = llvm::Function::Create(
+                region_type, llvm::Function::InternalLinkage, name, _mod.get());
+            fn->getArg(0)->setName("main.vars");
+            fn->getArg(1)->setName("main.limits");
+            for (unsigned int arg = 0; arg < 2; ++arg) {
+                fn->addParamAttr(arg, llvm::Attribute::NoAlias);
+                fn->addParamAttr(arg, llvm::Attribute::NoCapture);
+            }
+            fn->getArg(2)->setName("line");
+            llvm::BasicBlock *entry = llvm::BasicBlock::Create(_global_ctx, "entry", fn);
+            llvm::BasicBlock *none = llvm::BasicBlock::Create(_global_ctx, "entry.none", fn);
+            new llvm::UnreachableInst(_global_ctx, none);
+            llvm::IRBuilder<> entry_builder(entry);
+            entry_builder.CreateAlloca(
+                llvm::ArrayType::get(int_type, _regions.shared + limits[r]), nullptr, "vars");
+            _regions.copyVars(&entry_builder, fn, false);
+            llvm::SwitchInst *entries = entry_builder.CreateSwitch(fn->getArg(2), none);
+            llvm::BasicBlock *call = llvm::BasicBlock::Create(_global_ctx, "call." + name, _main);
+            _regions.regions.push_back({fn, entries, call, main_limits});
+            main_limits += limits[r];
+        }
+        if (_labels.blocks[i] != nullptr) {
+            _labels.blocks[i]->removeFromParent();
+            _labels.blocks[i]->insertInto(_regions.regions.back().fn);
+        }
+    }
+}
+
+// Instrumented programs register their counters before anything else runs.
+// A loaded profile only counts entries of blocks, which are spread over their
+// lines. It also gives the module a profile summary and main an entry count,
+// so that LLVM takes the branch weights as real counts when it tells hot
+// code from cold.
+void BASICParser::_create_profile() {
+    size_t n = _labels.size();
+    if (!_profile_path.empty()) {
+        llvm::ArrayType *counters_type = llvm::ArrayType::get(
+            llvm::Type::getInt64Ty(_global_ctx), 2 * n);
+        _profile.counters = new llvm::GlobalVariable(
+            *_mod, counters_type, false, llvm::GlobalValue::InternalLinkage,
+            llvm::ConstantAggregateZero::get(counters_type), "profile.counters");
+        llvm::Constant *labels = llvm::ConstantDataArray::get(_global_ctx, llvm::makeArrayRef(_labels.labels));
+        auto labels_global = new llvm::GlobalVariable(
+            *_mod, labels->getType(), true, llvm::GlobalValue::PrivateLinkage, labels, "profile.labels");
+        llvm::BasicBlock &entry = _main->getEntryBlock();
+        llvm::IRBuilder<> builder(&entry, entry.getFirstInsertionPt());
+        builder.CreateCall(_mod->getFunction("basic_profile_start"), {
+            builder.CreateGlobalStringPtr(_profile_path, "profile.path"),
+            builder.CreateConstInBoundsGEP2_32(labels->getType(), labels_global, 0, 0),
+            builder.CreateConstInBoundsGEP2_32(counters_type, _profile.counters, 0, 0),
+            builder.getInt32(n)});
+    }
+    if (_profile_in != nullptr) {
+        _profile.executed.assign(n, 0);
+        _profile.taken.assign(n, 0);
+        // main runs once, then come the blocks
+        std::vector<uint64_t> counts = {1};
+        uint64_t block_count = 0;
+        for (size_t i = 0; i < n; ++i) {
+            auto it = _profile_in->find(_labels.labels[i]);
+            bool found = it != _profile_in->end();
+            if (_labels.blocks[i] != nullptr) {
+                block_count = found ? it->second.entries : 0;
+                counts.push_back(block_count);
+            }
+            _profile.executed[i] = block_count;
+            if (found) _profile.taken[i] = it->second.taken;
+        }
+        llvm::InstrProfSummaryBuilder summary(llvm::ProfileSummaryBuilder::DefaultCutoffs);
+        summary.addRecord(llvm::InstrProfRecord(counts));
+        _mod->setProfileSummary(summary.getSummary()->getMD(_global_ctx),
+                                llvm::ProfileSummary::PSK_Instr);
+        _main->setEntryCount(1);
+    }
+    if (_profile.counters != nullptr || _profile_in != nullptr) _labels.profile = &_profile;
+}
+
+void ProfileTable::count(llvm::IRBuilder<> *builder, int index, int counter, llvm::Value *amount) {
+    llvm::Value *ptr = builder->CreateConstInBoundsGEP2_64(
+        counters->getValueType(), counters, 0, 2 * index + counter);
+    if (amount == nullptr) amount = builder->getInt64(1);
+    builder->CreateStore(builder->CreateAdd(builder->CreateLoad(builder->getInt64Ty(), ptr), amount), ptr);
+}
+
+// Weights are 32 bits, so large counts are scaled down together
+static llvm::MDNode *_weights(llvm::LLVMContext &ctx, uint64_t first, uint64_t second) {
+    if (first == 0 && second == 0) return nullptr;
+    uint64_t scale = std::max(first, second) / UINT32_MAX + 1;
+    return llvm::MDBuilder(ctx).createBranchWeights(first / scale, second / scale);
+}
+
+llvm::MDNode *ProfileTable::jumpWeights(llvm::LLVMContext &ctx, int index) const {
+    if (executed.empty()) return nullptr;
+    uint64_t jumped = std::min(taken[index], executed[index]);
+    return _weights(ctx, jumped, executed[index] - jumped);
+}
+
+llvm::MDNode *ProfileTable::loopWeights(llvm::LLVMContext &ctx, int index) const {
+    // Each run of the FOR line leaves the loop once, each pass through the
+    // body goes back into it
+    if (executed.empty()) return nullptr;
+    return _weights(ctx, executed[index + 1], executed[index]);
+}
+
+// Fills in main's call to each region, then jumps to the dispatch switch to
+// continue at line start
+void BASICParser::_call_regions(llvm::AllocaInst *vars, int start) {
+    llvm::Type *type = vars->getAllocatedType();
+    llvm::Value *first = _builder->CreateConstInBoundsGEP2_32(type, vars, 0, 0);
+    llvm::BasicBlock *dispatch = _regions.next->getParent();
+    _regions.next->addIncoming(_builder->getInt32(_labels.key(start)), _builder->GetInsertBlock());
+    _builder->CreateBr(dispatch);
+    _labels.enter(start);
+    for (RegionTable::Region &region : _regions.regions) {
+        _builder->SetInsertPoint(region.call);
+        llvm::Value *limits = _builder->CreateConstInBoundsGEP2_32(
+            type, vars, 0, _regions.shared + region.limits);
+        llvm::Value *next = _builder->CreateCall(region.fn, {first, limits, _regions.next});
+        _builder->CreateBr(dispatch);
+        _regions.next->addIncoming(next, region.call);
+    }
+}
+
+// Adds the lines continued at to the region switches in line order, so that
+// a region's code does not depend on the order in which other regions
+// jumped into it
+void BASICParser::_enter_regions() {
+    if (_labels.regions == nullptr) return;
+    llvm::IntegerType *int_type = llvm::Type::getInt32Ty(_global_ctx);
+    for (size_t i = 0; i < _labels.size(); ++i) {
+        if (!_regions.entries[i]) continue;
+        RegionTable::Region &region = _regions.regions[_regions.region_of[i]];
+        llvm::ConstantInt *value = llvm::ConstantInt::get(int_type, _labels.key(i));
+        region.entry->addCase(value, _labels.blocks[i]);
+        _regions.dispatch->addCase(value, region.call);
+    }
+}
+
+void BASICParser::_create_stack() {
+    if (_call_lines.empty()) return;
+    llvm::ArrayType *type = llvm::ArrayType::get(
+        llvm::Type::getInt32Ty(_global_ctx), ReturnStack::kDepth);
+    _stack.global = new llvm::GlobalVariable(
+        *_mod, type, false, llvm::GlobalValue::InternalLinkage,
+        llvm::ConstantAggregateZero::get(type), "gosub.stack");
+}
+
+void BASICParser::_create_arrays() {
+    // Cache line aligned so vectorized loops start on a boundary
+    for (int a = 0; a < 26; ++a) {
+        if (_arrays.sizes[a] == 0) continue;
+        llvm::ArrayType *type = llvm::ArrayType::get(
+            llvm::Type::getInt32Ty(_global_ctx), _arrays.sizes[a]);
+        llvm::GlobalVariable *global = new llvm::GlobalVariable(
+            *_mod, type, false, llvm::GlobalValue::InternalLinkage,
+            llvm::ConstantAggregateZero::get(type), std::string("array.") + static_cast<char>('A' + a));
+        global->setAlignment(llvm::Align(64));
+        _arrays.globals[a] = global;
+    }
+}
+
 bool BASICParser::_create_vars() {
+    // Nothing outside main can see the variables, so they live in an alloca
+    // in a dedicated entry block where SROA/mem2reg can promote them.
+    // The GOSUB depth follows the 26 variables, then the FOR limits
     llvm::ArrayType *arr_type = llvm::ArrayType::get(
         llvm::Type::getInt32Ty(_global_ctx),
-        26);
-    llvm::ConstantAggregateZero *arr_default = llvm::ConstantAggregateZero::get(arr_type);
-    llvm::GlobalVariable *g_vars = new llvm::GlobalVariable(
-        *_mod,
-        arr_type,
-        false,
-        llvm::GlobalValue::ExternalLinkage,
-        0,
-        "vars");
-    g_vars->setInitializer(arr_default);
-    return true;
-}
-
-bool BASICParser::_make_let(const std::vector<Token *> &tk_lst, unsigned int &curr_pos, int label) {
-    if (tk_lst[curr_pos + 3]->getName() == "EOLToken") {
-        _instrs[label] = new LETInstruction(
-            label,
-            static_cast<VarIntValueToken *>(tk_lst[curr_pos + 1]),
-            static_cast<IntValueToken *>(tk_lst[curr_pos + 2])); 
-        curr_pos += 3;
+        _slot_count());
+    llvm::BasicBlock *entry = llvm::BasicBlock::Create(
+        _global_ctx, "entry", _main, &_main->front());
+    _builder->SetInsertPoint(entry);
+    llvm::AllocaInst *vars = _builder->CreateAlloca(arr_type, nullptr, "vars");
+    if (_resume_label < 0) {
+        _builder->CreateStore(llvm::ConstantAggregateZero::get(arr_type), vars);
+        if (_labels.regions != nullptr) _call_regions(vars, 0);
+        return true;
+    }
+    // Resuming: copy the caller's variables and limits in and continue at the label
+    int index = _labels.indexOf(_resume_label);
+    if (index < 0 || _labels.blocks[index] == nullptr) {
+        std::cout << "Cannot resume at label " << _resume_label << "\n";
+        return false;
+    }
+    llvm::Value *state = _builder->CreateBitCast(_main->getArg(0), arr_type->getPointerTo());
+    _builder->CreateStore(_builder->CreateLoad(arr_type, state), vars);
+    for (int a = 0; a < 26; ++a) {
+        if (_arrays.globals[a] == nullptr) continue;
+        llvm::Value *src = _builder->CreateConstGEP1_64(
+            llvm::Type::getInt32Ty(_global_ctx), _main->getArg(1), _arrays.offsets[a]);
+        _builder->CreateMemCpy(_arrays.globals[a], llvm::Align(64), src, llvm::Align(4),
+                               static_cast<uint64_t>(_arrays.sizes[a]) * 4);
+    }
+    if (_stack.global != nullptr) {
+        llvm::Value *src = _builder->CreateConstGEP1_64(
+            llvm::Type::getInt32Ty(_global_ctx), _main->getArg(1), _arrays.total);
+        _builder->CreateMemCpy(_stack.global, llvm::MaybeAlign(), src, llvm::Align(4),
+                               ReturnStack::kDepth * 4);
+    }
+    if (_labels.regions != nullptr) {
+        _call_regions(vars, index);
     } else {
-        _instrs[label] = new LETInstruction(
-            label,
-            static_cast<VarIntValueToken *>(tk_lst[curr_pos + 1]),
-            static_cast<IntValueToken *>(tk_lst[curr_pos + 2]),
-            static_cast<OpToken *>(tk_lst[curr_pos + 3]),
-            static_cast<IntValueToken *>(tk_lst[curr_pos + 4]));
-        curr_pos += 5;
+        _builder->CreateBr(_labels.blocks[index]);
+    }
+    return true;
+}
+
+// * and / bind tighter than + and -, all of them are left associative
+static int _precedence(TokenKind op) {
+    return op == TokenKind::Mul || op == TokenKind::Div ? 2 : 1;
+}
+
+// Precedence climbing: parses operands joined by operators that bind at
+// least as tight as min_precedence
+Expr *BASICParser::_parse_expr(const std::vector<Token> &tokens, unsigned int &curr_pos, int label,
+                               int min_precedence) {
+    Expr *lhs = _parse_operand(tokens, curr_pos, label);
+    while (lhs != nullptr && tokens[curr_pos].isOp() &&
+           _precedence(tokens[curr_pos].kind) >= min_precedence) {
+        const Token &op = tokens[curr_pos++];
+        Expr *rhs = _parse_expr(tokens, curr_pos, label, _precedence(op.kind) + 1);
+        if (rhs == nullptr) return nullptr;
+        lhs = _new_expr(op, lhs, rhs);
     }
+    return lhs;
+}
+
+Expr *BASICParser::_new_expr(const Token &tok, Expr *lhs, Expr *rhs) {
+    if (_expr_next == _expr_end) {
+        const size_t chunk = 256;
+        _expr_next = _arena.Allocate<Expr>(chunk);
+        _expr_end = _expr_next + chunk;
+    }
+    *_expr_next = Expr{tok, lhs, rhs};
+    return _expr_next++;
+}
+
+// A value, a parenthesized expression or a negated operand
+Expr *BASICParser::_parse_operand(const std::vector<Token> &tokens, unsigned int &curr_pos,
+                                  int label) {
+    const Token &tok = tokens[curr_pos++];
+    if (tok.isIntValue()) return _new_expr(tok, nullptr, nullptr);
+    if (tok.kind == TokenKind::Minus) {
+        Expr *operand = _parse_operand(tokens, curr_pos, label);
+        return operand == nullptr ? nullptr : _new_expr(tok, operand, nullptr);
+    }
+    if (tok.kind == TokenKind::LParen) {
+        Expr *inner = _parse_expr(tokens, curr_pos, label);
+        if (inner == nullptr) return nullptr;
+        if (tokens[curr_pos].kind == TokenKind::RParen) {
+            ++curr_pos;
+            return inner;
+        }
+    }
+    std::cout << "Malformed expression (label: " << label << ")\n";
+    return nullptr;
+}
+
+bool BASICParser::_make_let(const TokenList &tk_lst, unsigned int &curr_pos, int label) {
+    const Token &dst = tk_lst.tokens[curr_pos + 1];
+    curr_pos += 2;
+    Expr *value = _parse_expr(tk_lst.tokens, curr_pos, label);
+    if (value == nullptr) return false;
+    _instrs.push_back(new (_arena) LETInstruction(&_arrays, &_exprs, label, dst, value));
     return true;
 }
 
-bool BASICParser::_make_if(const std::vector<Token *> &tk_lst, unsigned int &curr_pos, int label) {
-    ConstIntValueToken *landing_label = static_cast<ConstIntValueToken *>(tk_lst[curr_pos + 4]);
-    _jump_landings.insert(landing_label->getVal());
-    _jump_fallthrough.insert(label);
-    _instrs[label] = new IFInstruction(
-        &_blocks,
+bool BASICParser::_make_if(const TokenList &tk_lst, unsigned int &curr_pos, int label) {
+    const std::vector<Token> &tokens = tk_lst.tokens;
+    ++curr_pos;
+    Expr *lhs = _parse_expr(tokens, curr_pos, label);
+    if (lhs == nullptr) return false;
+    const Token &cmp = tokens[curr_pos++];
+    Expr *rhs = _parse_expr(tokens, curr_pos, label);
+    if (rhs == nullptr) return false;
+    const Token &landing_label = tokens[curr_pos];
+    if (landing_label.kind != TokenKind::ConstIntValue) {
+        std::cout << "GOTO target must be a line label (label: " << label << ")\n";
+        return false;
+    }
+    _jump_landings.push_back(landing_label.getInt());
+    _jump_fallthrough.push_back(label);
+    _instrs.push_back(new (_arena) IFInstruction(
+        &_labels,
+        &_arrays,
+        &_exprs,
         label,
-        static_cast<IntValueToken *>(tk_lst[curr_pos + 1]),
-        static_cast<CmpToken *>(tk_lst[curr_pos + 2]),
-        static_cast<IntValueToken *>(tk_lst[curr_pos + 3]),
-        landing_label);
-    curr_pos += 5;
+        lhs,
+        cmp,
+        rhs,
+        landing_label.getInt()));
+    curr_pos += 1;
     return true;
 }
 
-bool BASICParser::_make_print(const std::vector<Token *> &tk_lst, unsigned int &curr_pos, int label) {
-    if (tk_lst[curr_pos + 1]->getName() == "StringValueToken") {
-        _instrs[label] = new PRINTInstruction(
-            label,
-            static_cast<StringValueToken *>(tk_lst[curr_pos + 1]));
+// The pool owns a copy of each literal, so the source may go away
+llvm::StringRef BASICParser::_intern(llvm::StringRef str) {
+    return _strings.insert({str, nullptr}).first->getKey();
+}
+
+bool BASICParser::_make_print(const TokenList &tk_lst, unsigned int &curr_pos, int label) {
+    const Token &arg = tk_lst.tokens[curr_pos + 1];
+    if (arg.kind == TokenKind::StringValue) {
+        _instrs.push_back(new (_arena) PRINTInstruction(label, _intern(tk_lst.strings[arg.getStr()]), &_strings));
     } else {
-        _instrs[label] = new PRINTInstruction(
-            label,
-            static_cast<VarIntValueToken *>(tk_lst[curr_pos + 1]));
+        _instrs.push_back(new (_arena) PRINTInstruction(&_arrays, &_exprs, label, arg));
     }
     curr_pos += 2;
     return true;
 }
 
-bool BASICParser::_make_println(const std::vector<Token *> &tk_lst, unsigned int &curr_pos, int label) {
-    if (tk_lst[curr_pos + 1]->getName() == "StringValueToken") {
-        _instrs[label] = new PRINTLNInstruction(
-            label,
-            static_cast<StringValueToken *>(tk_lst[curr_pos + 1]));
+bool BASICParser::_make_println(const TokenList &tk_lst, unsigned int &curr_pos, int label) {
+    const Token &arg = tk_lst.tokens[curr_pos + 1];
+    if (arg.kind == TokenKind::StringValue) {
+        _instrs.push_back(new (_arena) PRINTLNInstruction(label, _intern(tk_lst.strings[arg.getStr()]), &_strings));
     } else {
-        _instrs[label] = new PRINTLNInstruction(
-            label,
-            static_cast<VarIntValueToken *>(tk_lst[curr_pos + 1]));
+        _instrs.push_back(new (_arena) PRINTLNInstruction(&_arrays, &_exprs, label, arg));
+    }
+    curr_pos += 2;
+    return true;
+}
+
+bool BASICParser::_make_for(const TokenList &tk_lst, unsigned int &curr_pos, int label) {
+    const std::vector<Token> &tokens = tk_lst.tokens;
+    Token step{TokenKind::ConstIntValue, 0, 1, tokens[curr_pos].line};
+    unsigned int end = curr_pos + 4;
+    if (tokens[end].kind != TokenKind::EOL) {
+        step = tokens[end];
+        if (step.kind != TokenKind::ConstIntValue || step.getInt() == 0) {
+            std::cout << "STEP must be a non-zero constant (label: " << label << ")\n";
+            return false;
+        }
+        ++end;
+    }
+    FORInstruction *loop = new (_arena) FORInstruction(
+        &_labels,
+        &_arrays,
+        label,
+        tokens[curr_pos + 1].getVar(),
+        tokens[curr_pos + 2],
+        tokens[curr_pos + 3],
+        step,
+        _stack.slot + 1 + _loops.size());
+    _loops.push_back(loop);
+    _instrs.push_back(loop);
+    // The loop body and the code after NEXT start new blocks
+    _jump_fallthrough.push_back(label);
+    curr_pos = end;
+    return true;
+}
+
+bool BASICParser::_make_next(const TokenList &tk_lst, unsigned int &curr_pos, int label) {
+    _instrs.push_back(new (_arena) NEXTInstruction(label, tk_lst.tokens[curr_pos + 1].getVar()));
+    _jump_fallthrough.push_back(label);
+    curr_pos += 2;
+    return true;
+}
+
+bool BASICParser::_make_dim(const TokenList &tk_lst, unsigned int &curr_pos, int label) {
+    const Token &elem = tk_lst.tokens[curr_pos + 1];
+    uint32_t &size = _arrays.sizes[elem.array - 'A'];
+    if (elem.getInt() < 1 || elem.getInt() > ArrayTable::kMaxSize) {
+        std::cout << "DIM size must be between 1 and " << ArrayTable::kMaxSize
+                  << " (label: " << label << ")\n";
+        return false;
+    }
+    if (size != 0 && size != static_cast<uint32_t>(elem.getInt())) {
+        std::cout << "Array " << elem.array << " is already declared with size " << size
+                  << " (label: " << label << ")\n";
+        return false;
+    }
+    size = elem.getInt();
+    _instrs.push_back(new (_arena) DIMInstruction(&_arrays, &_exprs, label, elem.array));
+    curr_pos += 2;
+    return true;
+}
+
+bool BASICParser::_make_gosub(const TokenList &tk_lst, unsigned int &curr_pos, int label) {
+    const Token &target = tk_lst.tokens[curr_pos + 1];
+    if (target.kind != TokenKind::ConstIntValue) {
+        std::cout << "GOSUB target must be a line label (label: " << label << ")\n";
+        return false;
     }
+    _jump_landings.push_back(target.getInt());
+    _jump_fallthrough.push_back(label);
+    GOSUBInstruction *call = new (_arena) GOSUBInstruction(&_labels, &_stack, label, target.getInt());
+    _calls.push_back(call);
+    _instrs.push_back(call);
     curr_pos += 2;
     return true;
 }
 
+bool BASICParser::_make_return(const TokenList &tk_lst, unsigned int &curr_pos, int label) {
+    RETURNInstruction *ret = new (_arena) RETURNInstruction(&_labels, &_stack, label);
+    _returns.push_back(ret);
+    _instrs.push_back(ret);
+    _jump_fallthrough.push_back(label);
+    curr_pos += 1;
+    return true;
+}
+
+void ArrayTable::setRange(char var, int64_t low, int64_t high) {
+    lo[var - 'A'] = low;
+    hi[var - 'A'] = high;
+}
+
+void ArrayTable::clearRanges() {
+    for (int i = 0; i < 26; ++i) {
+        lo[i] = 1;
+        hi[i] = 0;
+    }
+}
+
+bool ArrayTable::inBounds(const Token &elem) const {
+    int64_t size = sizes[elem.array - 'A'];
+    if (elem.kind == TokenKind::ConstElementValue) return elem.getInt() >= 0 && elem.getInt() < size;
+    int var = elem.getVar() - 'A';
+    return lo[var] <= hi[var] && lo[var] >= 0 && hi[var] < size;
+}
+
+// Text of an expression and the variables and arrays it reads
+struct ExprKey {
+    std::string text;
+    uint32_t vars = 0;
+    uint32_t arrays = 0;
+};
+
+unsigned int Expr::size() const {
+    return 1 + (lhs != nullptr ? lhs->size() : 0) + (rhs != nullptr ? rhs->size() : 0);
+}
+
+llvm::Value *ExprCache::lookup(const ExprKey &key) const {
+    auto it = entries.find(key.text);
+    if (it == entries.end()) return nullptr;
+    const Entry &entry = it->second;
+    for (int i = 0; i < 26; ++i) {
+        if (((entry.vars >> i) & 1) != 0 && var_writes[i] > entry.stamp) return nullptr;
+        if (((entry.arrays >> i) & 1) != 0 && array_writes[i] > entry.stamp) return nullptr;
+    }
+    return entry.value;
+}
+
+void ExprCache::insert(const ExprKey &key, llvm::Value *value) {
+    entries[key.text] = Entry{value, ++now, key.vars, key.arrays};
+}
+
 //
 // Instruction definitions
 //
-Instruction::Instruction(int lbl) : label(lbl) {}
+static_assert(std::is_trivially_destructible<LETInstruction>::value &&
+              std::is_trivially_destructible<IFInstruction>::value &&
+              std::is_trivially_destructible<PRINTInstruction>::value &&
+              std::is_trivially_destructible<PRINTLNInstruction>::value &&
+              std::is_trivially_destructible<FORInstruction>::value &&
+              std::is_trivially_destructible<NEXTInstruction>::value &&
+              std::is_trivially_destructible<DIMInstruction>::value &&
+              std::is_trivially_destructible<GOSUBInstruction>::value &&
+              std::is_trivially_destructible<RETURNInstruction>::value,
+              "Instructions are arena allocated and never destroyed");
+Instruction::Instruction(int lbl, ArrayTable *arrays, ExprCache *exprs)
+  : label(lbl), _arrays(arrays), _exprs(exprs) {}
 llvm::Value *Instruction::_get_var_ptr(llvm::IRBuilder<> *builder, llvm::Module *mod, char var) {
+    return _get_slot_ptr(builder, mod, var - 'A');
+}
+llvm::Value *Instruction::_get_slot_ptr(llvm::IRBuilder<> *builder, llvm::Module *mod,
+                                        unsigned int slot) {
     llvm::Value *index = llvm::ConstantInt::get(
-        llvm::Type::getInt32Ty(mod->getContext()), var - 65);
+        llvm::Type::getInt32Ty(mod->getContext()), slot);
     llvm::Value *zero = llvm::ConstantInt::get(
         llvm::Type::getInt32Ty(mod->getContext()), 0);
-    auto vars = mod->getGlobalVariable("vars");
+    auto vars = llvm::cast<llvm::AllocaInst>(
+        builder->GetInsertBlock()->getParent()->getValueSymbolTable()->lookup("vars"));
     llvm::Value *elm_ptr = builder->CreateGEP(
+        vars->getAllocatedType(),
         vars,
-        std::vector<llvm::Value *>{index, zero});
+        std::vector<llvm::Value *>{zero, index});
     return elm_ptr;
 }
 llvm::Value *Instruction::_get_var(llvm::IRBuilder<> *builder, llvm::Module *mod, char var) {
-    return builder->CreateLoad(_get_var_ptr(builder, mod, var));
+    return builder->CreateLoad(
+        llvm::Type::getInt32Ty(mod->getContext()),
+        _get_var_ptr(builder, mod, var));
 }
 llvm::Value *Instruction::_set_var(llvm::IRBuilder<> *builder, llvm::Module *mod, char var, llvm::Value *val) {
     return builder->CreateStore(val, _get_var_ptr(builder, mod, var));
 }
-llvm::Value *Instruction::_token_to_value(llvm::IRBuilder<> *build, llvm::Module *mod, IntValueToken *tok) {
-    if (tok->getName() == "ConstIntValueToken") {
+llvm::Value *Instruction::_token_to_value(llvm::IRBuilder<> *build, llvm::Module *mod, const Token &tok) {
+    if (tok.kind == TokenKind::ConstIntValue) {
         return llvm::ConstantInt::get(
             llvm::Type::getInt32Ty(mod->getContext()),
-            static_cast<ConstIntValueToken *>(tok)->getVal());
+            tok.getInt());
+    }
+    ExprKey key;
+    if (_exprs != nullptr) {
+        _key(tok, &key);
+        if (llvm::Value *cached = _exprs->lookup(key)) return cached;
+    }
+    llvm::Value *val;
+    if (tok.isElement()) {
+        val = build->CreateLoad(
+            llvm::Type::getInt32Ty(mod->getContext()),
+            _element_ptr(build, mod, tok));
+    } else {
+        val = _get_var(build, mod, tok.getVar());
+    }
+    if (_exprs != nullptr) _exprs->insert(key, val);
+    return val;
+}
+void Instruction::_store_value(llvm::IRBuilder<> *builder, llvm::Module *mod, const Token &dst,
+                               llvm::Value *val) {
+    if (dst.isElement()) {
+        builder->CreateStore(val, _element_ptr(builder, mod, dst));
+        if (_exprs != nullptr) _exprs->assignArray(dst.array);
+    } else {
+        _set_var(builder, mod, dst.getVar(), val);
+        if (_exprs != nullptr) _exprs->assignVar(dst.getVar());
+    }
+    // Later reads in the block use the stored value
+    if (_exprs != nullptr) {
+        ExprKey key;
+        _key(dst, &key);
+        _exprs->insert(key, val);
+    }
+}
+llvm::Value *Instruction::_expr_to_value(llvm::IRBuilder<> *builder, llvm::Module *mod,
+                                         const Expr *expr) {
+    if (expr->isLeaf()) return _token_to_value(builder, mod, expr->tok);
+    ExprKey key;
+    if (_exprs != nullptr) {
+        _key(expr, &key);
+        if (llvm::Value *cached = _exprs->lookup(key)) return cached;
+    }
+    llvm::Value *lhs = _expr_to_value(builder, mod, expr->lhs);
+    llvm::Value *result = nullptr;
+    if (expr->rhs == nullptr) {
+        result = builder->CreateNeg(lhs);
+    } else {
+        llvm::Value *rhs = _expr_to_value(builder, mod, expr->rhs);
+        switch (expr->tok.kind) {
+            case TokenKind::Plus: result = builder->CreateAdd(lhs, rhs); break;
+            case TokenKind::Minus: result = builder->CreateSub(lhs, rhs); break;
+            case TokenKind::Mul: result = builder->CreateMul(lhs, rhs); break;
+            case TokenKind::Div: result = _divide(builder, mod, lhs, rhs); break;
+            default: break;
+        }
+    }
+    if (_exprs != nullptr) _exprs->insert(key, result);
+    return result;
+}
+llvm::Value *Instruction::_divide(llvm::IRBuilder<> *builder, llvm::Module *mod, llvm::Value *lhs,
+                                  llvm::Value *rhs) {
+    auto *divisor = llvm::dyn_cast<llvm::ConstantInt>(rhs);
+    if (divisor != nullptr && !divisor->isZero() && !divisor->isMinusOne()) {
+        return builder->CreateSDiv(lhs, rhs);
+    }
+    llvm::Type *int_type = rhs->getType();
+    _guard(builder, mod, builder->CreateICmpNE(rhs, llvm::ConstantInt::get(int_type, 0)), "div",
+           "basic_division_error", {llvm::ConstantInt::get(int_type, label)});
+    // Divides by 1 instead of -1 so that INT32_MIN / -1 cannot trap
+    llvm::Value *minus_one = builder->CreateICmpEQ(rhs, llvm::ConstantInt::getSigned(int_type, -1));
+    llvm::Value *safe = builder->CreateSelect(minus_one, llvm::ConstantInt::get(int_type, 1), rhs);
+    return builder->CreateSelect(minus_one, builder->CreateNeg(lhs), builder->CreateSDiv(lhs, safe));
+}
+uint32_t Instruction::_expr_to_register(Bytecode *code, const Expr *expr, int dst) {
+    if (expr->isLeaf()) return code->operand(expr->tok);
+    uint32_t lhs = _expr_to_register(code, expr->lhs);
+    uint32_t rhs;
+    if (expr->rhs == nullptr) {
+        // 0 - x
+        rhs = lhs;
+        lhs = code->operand(Token{TokenKind::ConstIntValue, 0, 0, expr->tok.line});
     } else {
-        return _get_var(
-            build,
-            mod,
-            static_cast<VarIntValueToken *>(tok)->getVal());
+        rhs = _expr_to_register(code, expr->rhs);
     }
+    uint32_t result = dst >= 0 ? dst : code->scratch();
+    code->emit(Bytecode::arithmetic(expr->tok.kind), result, lhs, rhs);
+    return result;
+}
+llvm::Value *Instruction::_element_ptr(llvm::IRBuilder<> *builder, llvm::Module *mod,
+                                       const Token &elem) {
+    llvm::LLVMContext &ctx = mod->getContext();
+    llvm::Type *int_type = llvm::Type::getInt32Ty(ctx);
+    llvm::GlobalVariable *array = _arrays->globals[elem.array - 'A'];
+    llvm::Value *index = _token_to_value(builder, mod, elem.indexToken());
+    if (!_arrays->inBounds(elem)) {
+        // Unsigned, so negative indices fail too
+        llvm::Value *size = llvm::ConstantInt::get(int_type, _arrays->sizes[elem.array - 'A']);
+        _guard(builder, mod, builder->CreateICmpULT(index, size), "index", "basic_index_error",
+               {llvm::ConstantInt::get(int_type, label), llvm::ConstantInt::get(int_type, elem.array),
+                index, size});
+    }
+    llvm::Value *zero = llvm::ConstantInt::get(int_type, 0);
+    return builder->CreateInBoundsGEP(array->getValueType(), array, {zero, index});
 }
 
-PRINTInstruction::PRINTInstruction(int label, StringValueToken *str)
-  : Instruction(label), _str(str) {}
-PRINTInstruction::PRINTInstruction(int label, VarIntValueToken *var)
-  : Instruction(label), _var(var) {}
+void Instruction::_guard(llvm::IRBuilder<> *builder, llvm::Module *mod, llvm::Value *ok,
+                         const std::string &name, const char *error,
+                         llvm::ArrayRef<llvm::Value *> args) {
+    llvm::LLVMContext &ctx = mod->getContext();
+    llvm::BasicBlock *block = builder->GetInsertBlock();
+    llvm::BasicBlock *ok_block = llvm::BasicBlock::Create(
+        ctx, name + ".ok", block->getParent(), block->getNextNode());
+    llvm::BasicBlock *fail = llvm::BasicBlock::Create(ctx, name + ".fail", block->getParent());
+    builder->CreateCondBr(ok, ok_block, fail);
+    llvm::IRBuilder<> fail_builder(fail);
+    fail_builder.CreateCall(mod->getFunction(error), args);
+    fail_builder.CreateUnreachable();
+    builder->SetInsertPoint(ok_block);
+}
+
+void Instruction::_print_str(llvm::IRBuilder<> *builder, llvm::Module *mod, llvm::StringRef str,
+                             StringPool *strings) {
+    if (str.empty()) return;
+    llvm::Constant *&str_ptr = (*strings)[str];
+    if (str_ptr == nullptr) str_ptr = builder->CreateGlobalStringPtr(str, "str");
+    llvm::Value *len = llvm::ConstantInt::get(
+        llvm::Type::getInt32Ty(mod->getContext()), str.size());
+    builder->CreateCall(mod->getFunction("basic_print_str"), {str_ptr, len});
+}
+void Instruction::_print_value(llvm::IRBuilder<> *builder, llvm::Module *mod, const Token &tok) {
+    builder->CreateCall(mod->getFunction("basic_print_int"), {_token_to_value(builder, mod, tok)});
+}
+bool Instruction::_known_value(const Token &tok, const KnownVars &known, int32_t *val) {
+    if (tok.kind == TokenKind::ConstIntValue) {
+        *val = tok.getInt();
+        return true;
+    }
+    // Array contents are never known
+    if (tok.kind != TokenKind::VarIntValue || !known.isConst(tok.getVar())) return false;
+    *val = known.get(tok.getVar());
+    return true;
+}
+void Instruction::_substitute(Token *tok, const KnownVars &known) {
+    int32_t val;
+    if (tok->kind == TokenKind::VarIntValue && _known_value(*tok, known, &val)) {
+        *tok = Token{TokenKind::ConstIntValue, 0, val, tok->line};
+    } else if (tok->kind == TokenKind::VarElementValue && _known_value(tok->indexToken(), known, &val)) {
+        *tok = Token{TokenKind::ConstElementValue, tok->array, val, tok->line};
+    }
+}
+uint32_t Instruction::_read_bit(const Token &tok) {
+    bool var = tok.kind == TokenKind::VarIntValue || tok.kind == TokenKind::VarElementValue;
+    return var ? 1u << (tok.getVar() - 'A') : 0;
+}
+bool Instruction::_fold(const Expr *expr, const KnownVars &known, int32_t *result) {
+    if (expr->isLeaf()) return _known_value(expr->tok, known, result);
+    int32_t l, r;
+    if (!_fold(expr->lhs, known, &l)) return false;
+    uint32_t ul = static_cast<uint32_t>(l);
+    if (expr->rhs == nullptr) {
+        *result = static_cast<int32_t>(0u - ul);
+        return true;
+    }
+    if (!_fold(expr->rhs, known, &r)) return false;
+    uint32_t ur = static_cast<uint32_t>(r);
+    switch (expr->tok.kind) {
+        case TokenKind::Plus: *result = static_cast<int32_t>(ul + ur); return true;
+        case TokenKind::Minus: *result = static_cast<int32_t>(ul - ur); return true;
+        case TokenKind::Mul: *result = static_cast<int32_t>(ul * ur); return true;
+        case TokenKind::Div:
+            // Division by zero is left to fail at run time
+            if (r == 0) return false;
+            *result = r == -1 ? static_cast<int32_t>(0u - ul) : l / r;
+            return true;
+        default: return false;
+    }
+}
+void Instruction::_substitute(Expr *expr, const KnownVars &known) {
+    int32_t val;
+    if (_fold(expr, known, &val)) {
+        *expr = Expr{Token{TokenKind::ConstIntValue, 0, val, expr->tok.line}, nullptr, nullptr};
+    } else if (expr->isLeaf()) {
+        _substitute(&expr->tok, known);
+    } else {
+        _substitute(expr->lhs, known);
+        if (expr->rhs != nullptr) _substitute(expr->rhs, known);
+    }
+}
+uint32_t Instruction::_read_bits(const Expr *expr) {
+    if (expr->isLeaf()) return _read_bit(expr->tok);
+    return _read_bits(expr->lhs) | (expr->rhs != nullptr ? _read_bits(expr->rhs) : 0);
+}
+bool Instruction::_may_trap(const Expr *expr) {
+    // Every element access is bounds checked
+    if (expr->isLeaf()) return expr->tok.isElement();
+    // So does every division by what might be zero
+    if (expr->tok.kind == TokenKind::Div) {
+        const Token &divisor = expr->rhs->tok;
+        if (!expr->rhs->isLeaf() || divisor.kind != TokenKind::ConstIntValue || divisor.getInt() == 0)
+            return true;
+    }
+    return _may_trap(expr->lhs) || (expr->rhs != nullptr && _may_trap(expr->rhs));
+}
+void Instruction::_key(const Token &tok, ExprKey *key) {
+    if (tok.kind == TokenKind::ConstIntValue) {
+        key->text += '#';
+        key->text += std::to_string(tok.getInt());
+    } else if (tok.isElement()) {
+        key->arrays |= 1u << (tok.array - 'A');
+        key->text += tok.array;
+        key->text += '(';
+        _key(tok.indexToken(), key);
+        key->text += ')';
+    } else {
+        key->vars |= 1u << (tok.getVar() - 'A');
+        key->text += tok.getVar();
+    }
+}
+void Instruction::_key(const Expr *expr, ExprKey *key) {
+    if (expr->isLeaf()) {
+        _key(expr->tok, key);
+        return;
+    }
+    ExprKey lhs, rhs;
+    _key(expr->lhs, &lhs);
+    if (expr->rhs != nullptr) _key(expr->rhs, &rhs);
+    // Operands of + and * are ordered so that A + B and B + A share a key
+    bool commutes = expr->tok.kind == TokenKind::Plus || expr->tok.kind == TokenKind::Mul;
+    if (commutes && rhs.text < lhs.text) std::swap(lhs, rhs);
+    key->text += '(';
+    key->text += "+-*/"[static_cast<int>(expr->tok.kind) - static_cast<int>(TokenKind::Plus)];
+    key->text += ' ';
+    key->text += lhs.text;
+    if (expr->rhs != nullptr) {
+        key->text += ' ';
+        key->text += rhs.text;
+    }
+    key->text += ')';
+    key->vars |= lhs.vars | rhs.vars;
+    key->arrays |= lhs.arrays | rhs.arrays;
+}
+
+PRINTInstruction::PRINTInstruction(int label, llvm::StringRef str, StringPool *strings)
+  : Instruction(label), _str(str), _strings(strings), _val{TokenKind::StringValue} {}
+PRINTInstruction::PRINTInstruction(ArrayTable *arrays, ExprCache *exprs, int label, const Token &val)
+  : Instruction(label, arrays, exprs), _val(val) {}
 bool PRINTInstruction::addToBuilder(llvm::IRBuilder<> *builder, llvm::Module *mod) {
-    std::vector<llvm::Value *> printf_args;
-    if (_str != nullptr) {
-        auto str_ptr = builder->CreateGlobalStringPtr(_str->getVal());
-        printf_args.push_back(str_ptr);
+    if (_val.kind == TokenKind::StringValue) {
+        _print_str(builder, mod, _str, _strings);
     } else {
-        auto str_ptr = builder->CreateGlobalStringPtr("%d");
-        printf_args.push_back(str_ptr);
-        llvm::Value *var = _get_var(builder, mod, _var->getVal());
-        printf_args.push_back(var);
+        _print_value(builder, mod, _val);
     }
-    builder->CreateCall(mod->getFunction("printf"), printf_args);
     return true;
 }
 
-PRINTLNInstruction::PRINTLNInstruction(int label, StringValueToken *str)
-  : Instruction(label), _str(str) {}
-PRINTLNInstruction::PRINTLNInstruction(int label, VarIntValueToken *var)
-  : Instruction(label), _var(var) {}
+bool PRINTInstruction::addToBytecode(Bytecode *code) {
+    if (_val.kind == TokenKind::StringValue) {
+        code->emit(Opcode::PrintStr, 0, code->string(_str));
+    } else {
+        code->emit(Opcode::PrintInt, 0, code->operand(_val));
+    }
+    return true;
+}
+bool PRINTInstruction::rewrite(const KnownVars &known) {
+    _substitute(&_val, known);
+    return true;
+}
+
+PRINTLNInstruction::PRINTLNInstruction(int label, llvm::StringRef str, StringPool *strings)
+  : Instruction(label), _str(str), _strings(strings), _val{TokenKind::StringValue} {}
+PRINTLNInstruction::PRINTLNInstruction(ArrayTable *arrays, ExprCache *exprs, int label,
+                                       const Token &val)
+  : Instruction(label, arrays, exprs), _val(val) {}
 bool PRINTLNInstruction::addToBuilder(llvm::IRBuilder<> *builder, llvm::Module *mod) {
-    std::vector<llvm::Value *> printf_args;
-    if (_str != nullptr) {
-        auto str_ptr = builder->CreateGlobalStringPtr(_str->getVal() + '\n');
-        printf_args.push_back(str_ptr);
+    if (_val.kind == TokenKind::StringValue) {
+        _print_str(builder, mod, _str, _strings);
     } else {
-        auto str_ptr = builder->CreateGlobalStringPtr("%d\n");
-        printf_args.push_back(str_ptr);
-        llvm::Value *var = _get_var(builder, mod, _var->getVal());
-        printf_args.push_back(var);
-    }
-    builder->CreateCall(mod->getFunction("printf"), printf_args);
-    return true;
-}
-
-LETInstruction::LETInstruction(int label,
-                               VarIntValueToken *var,
-                               IntValueToken *lhs,
-                               OpToken *op,
-                               IntValueToken *rhs)
-  : Instruction(label), _var(var), _lhs(lhs), _op(op), _rhs(rhs) {}
-llvm::Value *LETInstruction::_calc_op(llvm::IRBuilder<> *build, llvm::Value *l, llvm::Value *r) {
-    if (_op->getName() == "PlusToken") {
-        return build->CreateAdd(l, r);
-    } else if (_op->getName() == "MinusToken") {
-        return build->CreateSub(l, r);
-    } else if (_op->getName() == "MulToken") {
-        return build->CreateMul(l, r);
-    } else if (_op->getName() == "DivToken") {
-        return build->CreateSDiv(l, r);
+        _print_value(builder, mod, _val);
     }
-    return nullptr;
+    builder->CreateCall(mod->getFunction("basic_print_newline"));
+    return true;
+}
+bool PRINTLNInstruction::addToBytecode(Bytecode *code) {
+    if (_val.kind == TokenKind::StringValue) {
+        code->emit(Opcode::PrintStr, 0, code->string(_str));
+    } else {
+        code->emit(Opcode::PrintInt, 0, code->operand(_val));
+    }
+    code->emit(Opcode::Newline);
+    return true;
+}
+bool PRINTLNInstruction::rewrite(const KnownVars &known) {
+    _substitute(&_val, known);
+    return true;
+}
+
+DIMInstruction::DIMInstruction(ArrayTable *arrays, ExprCache *exprs, int label, char array)
+  : Instruction(label, arrays, exprs), _array(array) {}
+bool DIMInstruction::addToBuilder(llvm::IRBuilder<> *builder, llvm::Module *mod) {
+    builder->CreateMemSet(_arrays->globals[_array - 'A'], builder->getInt8(0),
+                          static_cast<uint64_t>(_arrays->sizes[_array - 'A']) * 4, llvm::Align(64));
+    _exprs->assignArray(_array);
+    return true;
+}
+bool DIMInstruction::addToBytecode(Bytecode *code) {
+    code->emit(Opcode::Clear, _array - 'A');
+    return true;
 }
+
+LETInstruction::LETInstruction(ArrayTable *arrays, ExprCache *exprs, int label, const Token &dst,
+                               Expr *value)
+  : Instruction(label, arrays, exprs), _dst(dst), _value(value) {}
 bool LETInstruction::addToBuilder(llvm::IRBuilder<> *builder, llvm::Module *mod) {
-    if (_op == nullptr) {
-        llvm::Value *single_store = _token_to_value(builder, mod, _lhs);
-        _set_var(builder, mod, _var->getVal(), single_store);
+    _store_value(builder, mod, _dst, _expr_to_value(builder, mod, _value));
+    return true;
+}
+bool LETInstruction::addToBytecode(Bytecode *code) {
+    // The value is computed before the element stored to is checked, as in
+    // the generated code
+    if (_dst.isElement()) {
+        uint32_t value = _expr_to_register(code, _value);
+        code->emit(Opcode::Store, _dst.array - 'A', code->operand(_dst.indexToken()), value);
+    } else if (_value->isLeaf()) {
+        code->emit(Opcode::Mov, _dst.getVar() - 'A', code->operand(_value->tok));
     } else {
-        llvm::Value *left = _token_to_value(builder, mod, _lhs);
-        llvm::Value *right = _token_to_value(builder, mod, _rhs);
-        llvm::Value *result = _calc_op(builder, left, right);
-        _set_var(builder, mod, _var->getVal(), result);
+        _expr_to_register(code, _value, _dst.getVar() - 'A');
     }
     return true;
 }
+void LETInstruction::transfer(KnownVars *known) const {
+    int32_t result;
+    if (_dst.isElement()) return;
+    if (_fold(_value, *known, &result)) {
+        known->set(_dst.getVar(), result);
+    } else {
+        known->clobber(_dst.getVar());
+    }
+}
+bool LETInstruction::rewrite(const KnownVars &known) {
+    if (_dst.isElement()) _substitute(&_dst, known);
+    _substitute(_value, known);
+    return true;
+}
+uint32_t LETInstruction::reads() const {
+    // The index of an element stored to is read
+    uint32_t dst = _dst.isElement() ? _read_bit(_dst) : 0;
+    return dst | _read_bits(_value);
+}
 
-IFInstruction::IFInstruction(std::map<int, llvm::BasicBlock *> *blocks,
+IFInstruction::IFInstruction(LabelTable *labels,
+                             ArrayTable *arrays,
+                             ExprCache *exprs,
                              int label,
-                             IntValueToken *lhs,
-                             CmpToken *cmp,
-                             IntValueToken *rhs,
-                             ConstIntValueToken *true_label)
-  : Instruction(label), _blocks(blocks), _label(label), _lhs(lhs), _cmp(cmp), _rhs(rhs), _true_label(true_label) {}
+                             Expr *lhs,
+                             const Token &cmp,
+                             Expr *rhs,
+                             int true_label)
+  : Instruction(label, arrays, exprs), _labels(labels), _label(label), _lhs(lhs), _cmp(cmp), _rhs(rhs),
+    _true_label(true_label) {}
 llvm::Value *IFInstruction::_calc_cmp(llvm::IRBuilder<> *build, llvm::Value *l, llvm::Value *r) {
-    if (_cmp->getName() == "EqToken") {
-        return build->CreateICmpEQ(l, r);
-    } else if (_cmp->getName() == "LtToken") {
-        return build->CreateICmpSLT(l, r);
-    } else if (_cmp->getName() == "GtToken") {
-        return build->CreateICmpSGT(l, r);
-    } else if (_cmp->getName() == "NeToken") {
-        return build->CreateICmpNE(l, r);
-    } else if (_cmp->getName() == "LteToken") {
-        return build->CreateICmpSLE(l, r);
-    } else if (_cmp->getName() == "GteToken") {
-        return build->CreateICmpSGE(l, r);
+    switch (_cmp.kind) {
+        case TokenKind::Eq: return build->CreateICmpEQ(l, r);
+        case TokenKind::Lt: return build->CreateICmpSLT(l, r);
+        case TokenKind::Gt: return build->CreateICmpSGT(l, r);
+        case TokenKind::Ne: return build->CreateICmpNE(l, r);
+        case TokenKind::Lte: return build->CreateICmpSLE(l, r);
+        case TokenKind::Gte: return build->CreateICmpSGE(l, r);
+        default: return nullptr;
     }
-    return nullptr;
 }
 bool IFInstruction::addToBuilder(llvm::IRBuilder<> *builder, llvm::Module *mod) {
-    llvm::Value *left = _token_to_value(builder, mod, _lhs);
-    llvm::Value *right = _token_to_value(builder, mod, _rhs);
+    llvm::BasicBlock *true_block = _labels->target(builder, _labels->indexOf(_true_label));
+    if (_always) {
+        builder->CreateBr(true_block);
+        return true;
+    }
+    llvm::Value *left = _expr_to_value(builder, mod, _lhs);
+    llvm::Value *right = _expr_to_value(builder, mod, _rhs);
     llvm::Value *result = _calc_cmp(builder, left, right);
-    llvm::BasicBlock *true_block = (*_blocks)[_true_label->getVal()];
-    llvm::BasicBlock *fallthrough_block;
-    for (auto it : *_blocks) {
-        if (it.first > _label) {
-            fallthrough_block = it.second;
-            break;
-        }
+    int index = _labels->indexOf(_label);
+    ProfileTable *profile = _labels->profile;
+    if (profile != nullptr && profile->counters != nullptr)
+        profile->count(builder, index, 1, builder->CreateZExt(result, builder->getInt64Ty()));
+    llvm::BasicBlock *fallthrough_block = _labels->target(builder, _labels->successors[index]);
+    llvm::BranchInst *branch = builder->CreateCondBr(result, true_block, fallthrough_block);
+    if (profile != nullptr)
+        branch->setMetadata(llvm::LLVMContext::MD_prof, profile->jumpWeights(mod->getContext(), index));
+    return true;
+}
+bool IFInstruction::addToBytecode(Bytecode *code) {
+    uint32_t left = _expr_to_register(code, _lhs);
+    uint32_t right = _expr_to_register(code, _rhs);
+    code->emit(Bytecode::compare(_cmp.kind), 0, left, right, _labels->indexOf(_true_label));
+    return true;
+}
+int IFInstruction::evaluate(const KnownVars &known) const {
+    int32_t l, r;
+    if (!_fold(_lhs, known, &l) || !_fold(_rhs, known, &r)) return -1;
+    switch (_cmp.kind) {
+        case TokenKind::Eq: return l == r;
+        case TokenKind::Lt: return l < r;
+        case TokenKind::Gt: return l > r;
+        case TokenKind::Ne: return l != r;
+        case TokenKind::Lte: return l <= r;
+        case TokenKind::Gte: return l >= r;
+        default: return -1;
     }
-    builder->CreateCondBr(result, true_block, fallthrough_block);
+}
+bool IFInstruction::rewrite(const KnownVars &known) {
+    int taken = evaluate(known);
+    if (taken == 0) return false;
+    _always = taken == 1;
+    _substitute(_lhs, known);
+    _substitute(_rhs, known);
+    return true;
+}
+uint32_t IFInstruction::reads() const {
+    return _always ? 0 : _read_bits(_lhs) | _read_bits(_rhs);
+}
+
+FORInstruction::FORInstruction(LabelTable *labels,
+                               ArrayTable *arrays,
+                               int label,
+                               char var,
+                               const Token &start,
+                               const Token &limit,
+                               const Token &step,
+                               unsigned int slot)
+  : Instruction(label, arrays), _labels(labels), _var(var), _start(start), _limit(limit),
+    _step(step), _slot(slot) {}
+bool FORInstruction::resolveLoops(std::vector<FORInstruction *> *open, int index) {
+    _index = index;
+    open->push_back(this);
+    return true;
+}
+bool FORInstruction::_counted() const {
+    // The variable stops at the first value past the limit, which must fit
+    if (!_single_entry || _limit.kind != TokenKind::ConstIntValue) return false;
+    int64_t last = static_cast<int64_t>(_limit.getInt()) + _step.getInt();
+    return last >= INT32_MIN && last <= INT32_MAX;
+}
+bool FORInstruction::bodyRange(int64_t *lo, int64_t *hi) const {
+    if (!_counted() || _start.kind != TokenKind::ConstIntValue) return false;
+    *lo = _step.getInt() > 0 ? _start.getInt() : _limit.getInt();
+    *hi = _step.getInt() > 0 ? _limit.getInt() : _start.getInt();
+    return true;
+}
+void FORInstruction::_create_header(llvm::IRBuilder<> *builder, llvm::Module *mod) {
+    if (_header != nullptr) return;
+    llvm::LLVMContext &ctx = mod->getContext();
+    llvm::BasicBlock *body = _labels->blocks[_labels->successors[_index]];
+    _header = llvm::BasicBlock::Create(
+        ctx, std::string("for.") + _var, builder->GetInsertBlock()->getParent(), body);
+    llvm::IRBuilder<> header(_header);
+    _phi = header.CreatePHI(llvm::Type::getInt32Ty(ctx), 2, std::string(1, _var));
+    _set_var(&header, mod, _var, _phi);
+    llvm::Value *limit = header.CreateLoad(
+        llvm::Type::getInt32Ty(ctx), _get_slot_ptr(&header, mod, _slot));
+    llvm::Value *cond = _step.getInt() > 0 ? header.CreateICmpSLE(_phi, limit)
+                                           : header.CreateICmpSGE(_phi, limit);
+    llvm::BranchInst *branch = header.CreateCondBr(
+        cond, body, _labels->target(builder, _labels->successors[_next_index]));
+    if (_labels->profile != nullptr)
+        branch->setMetadata(llvm::LLVMContext::MD_prof, _labels->profile->loopWeights(ctx, _index));
+}
+bool FORInstruction::addToBuilder(llvm::IRBuilder<> *builder, llvm::Module *mod) {
+    llvm::Value *start = _token_to_value(builder, mod, _start);
+    llvm::Value *limit = _token_to_value(builder, mod, _limit);
+    builder->CreateStore(limit, _get_slot_ptr(builder, mod, _slot));
+    _create_header(builder, mod);
+    _phi->addIncoming(start, builder->GetInsertBlock());
+    builder->CreateBr(_header);
+    return true;
+}
+void FORInstruction::addLatch(llvm::IRBuilder<> *builder, llvm::Module *mod) {
+    // The FOR line may have been optimized away as unreachable
+    _create_header(builder, mod);
+    llvm::LLVMContext &ctx = mod->getContext();
+    llvm::Type *int_type = llvm::Type::getInt32Ty(ctx);
+    llvm::Value *step = llvm::ConstantInt::get(int_type, _step.getInt());
+    llvm::Value *var = _get_var(builder, mod, _var);
+    bool counted = _counted();
+
+    // Self-referential loop ID, counted loops are known to terminate
+    llvm::SmallVector<llvm::Metadata *, 2> ops = {nullptr};
+    if (counted) ops.push_back(llvm::MDNode::get(ctx, llvm::MDString::get(ctx, "llvm.loop.mustprogress")));
+    llvm::MDNode *loop_id = llvm::MDNode::getDistinct(ctx, ops);
+    loop_id->replaceOperandWith(0, loop_id);
+
+    if (counted) {
+        _phi->addIncoming(builder->CreateNSWAdd(var, step), builder->GetInsertBlock());
+        builder->CreateBr(_header)->setMetadata(llvm::LLVMContext::MD_loop, loop_id);
+        return;
+    }
+    // A step past INT32_MAX or INT32_MIN is past the limit too, the loop
+    // ends with the variable wrapped around
+    llvm::Function *sadd = llvm::Intrinsic::getDeclaration(
+        mod, llvm::Intrinsic::sadd_with_overflow, {int_type});
+    llvm::Value *sum = builder->CreateCall(sadd, {var, step});
+    llvm::Value *next = builder->CreateExtractValue(sum, 0);
+    _set_var(builder, mod, _var, next);
+    _phi->addIncoming(next, builder->GetInsertBlock());
+    llvm::BasicBlock *done = _labels->target(builder, _labels->successors[_next_index]);
+    builder->CreateCondBr(builder->CreateExtractValue(sum, 1), done, _header)
+        ->setMetadata(llvm::LLVMContext::MD_loop, loop_id);
+}
+bool FORInstruction::addToBytecode(Bytecode *code) {
+    uint32_t start = code->operand(_start);
+    code->emit(Opcode::Mov, _slot, code->operand(_limit));
+    code->emit(Opcode::Mov, _var - 'A', start);
+    code->emit(_step.getInt() > 0 ? Opcode::IfGt : Opcode::IfLt, 0, _var - 'A', _slot,
+               _next_index + 1);
+    return true;
+}
+void FORInstruction::addLatchBytecode(Bytecode *code) {
+    code->emit(Opcode::Next, _var - 'A', code->operand(_step), _slot, _index + 1);
+}
+void FORInstruction::transfer(KnownVars *known) const {
+    known->clobber(_var);
+}
+bool FORInstruction::rewrite(const KnownVars &known) {
+    _substitute(&_start, known);
+    _substitute(&_limit, known);
+    return true;
+}
+uint32_t FORInstruction::reads() const {
+    return _read_bit(_start) | _read_bit(_limit);
+}
+
+NEXTInstruction::NEXTInstruction(int label, char var)
+  : Instruction(label), _var(var) {}
+bool NEXTInstruction::resolveLoops(std::vector<FORInstruction *> *open, int index) {
+    if (open->empty() || open->back()->var() != _var) {
+        std::cout << "NEXT " << _var << " without a matching FOR (label: " << label << ")\n";
+        return false;
+    }
+    _for = open->back();
+    open->pop_back();
+    _for->setNextIndex(index);
+    return true;
+}
+bool NEXTInstruction::addToBuilder(llvm::IRBuilder<> *builder, llvm::Module *mod) {
+    _for->addLatch(builder, mod);
+    return true;
+}
+bool NEXTInstruction::addToBytecode(Bytecode *code) {
+    _for->addLatchBytecode(code);
+    return true;
+}
+void NEXTInstruction::transfer(KnownVars *known) const {
+    known->clobber(_var);
+}
+
+GOSUBInstruction::GOSUBInstruction(LabelTable *labels, ReturnStack *stack, int label, int target_label)
+  : Instruction(label), _labels(labels), _stack(stack), _target_label(target_label) {}
+bool GOSUBInstruction::addToBuilder(llvm::IRBuilder<> *builder, llvm::Module *mod) {
+    llvm::Type *int_type = builder->getInt32Ty();
+    llvm::Value *depth_ptr = _get_slot_ptr(builder, mod, _stack->slot);
+    llvm::Value *depth = builder->CreateLoad(int_type, depth_ptr);
+    llvm::Value *max_depth = builder->getInt32(ReturnStack::kDepth);
+    _guard(builder, mod, builder->CreateICmpULT(depth, max_depth), "gosub", "basic_stack_overflow",
+           {builder->getInt32(label), max_depth});
+    llvm::Value *top = builder->CreateInBoundsGEP(
+        _stack->global->getValueType(), _stack->global, {builder->getInt32(0), depth});
+    builder->CreateStore(builder->getInt32(_labels->key(_labels->indexOf(label))), top);
+    builder->CreateStore(builder->CreateNUWAdd(depth, builder->getInt32(1)), depth_ptr);
+    builder->CreateBr(_labels->target(builder, jumpIndex()));
+    return true;
+}
+bool GOSUBInstruction::addToBytecode(Bytecode *code) {
+    code->emit(Opcode::Gosub, _stack->slot, _labels->indexOf(label), 0, jumpIndex());
+    return true;
+}
+
+RETURNInstruction::RETURNInstruction(LabelTable *labels, ReturnStack *stack, int label)
+  : Instruction(label), _labels(labels), _stack(stack) {}
+bool RETURNInstruction::addToBuilder(llvm::IRBuilder<> *builder, llvm::Module *mod) {
+    llvm::LLVMContext &ctx = mod->getContext();
+    llvm::Function *fn = builder->GetInsertBlock()->getParent();
+    llvm::BasicBlock *fail = llvm::BasicBlock::Create(ctx, "return.fail", fn);
+    llvm::IRBuilder<> fail_builder(fail);
+    fail_builder.CreateCall(mod->getFunction("basic_return_error"), {builder->getInt32(label)});
+    fail_builder.CreateUnreachable();
+    // Sites the optimizer removed as unreachable never push themselves. With
+    // no site left the stack can only be empty here.
+    llvm::SmallVector<int, 8> live;
+    for (int site : _sites) {
+        if (_labels->instrs[site] != nullptr) live.push_back(site);
+    }
+    if (live.empty()) {
+        builder->CreateBr(fail);
+        return true;
+    }
+    llvm::Type *int_type = builder->getInt32Ty();
+    llvm::Value *depth_ptr = _get_slot_ptr(builder, mod, _stack->slot);
+    llvm::Value *depth = builder->CreateLoad(int_type, depth_ptr);
+    llvm::BasicBlock *pop = llvm::BasicBlock::Create(
+        ctx, "return.pop", fn, builder->GetInsertBlock()->getNextNode());
+    builder->CreateCondBr(builder->CreateICmpEQ(depth, builder->getInt32(0)), fail, pop);
+    builder->SetInsertPoint(pop);
+    llvm::Value *top = builder->CreateNUWSub(depth, builder->getInt32(1));
+    builder->CreateStore(top, depth_ptr);
+    llvm::Value *site = builder->CreateLoad(int_type, builder->CreateInBoundsGEP(
+        _stack->global->getValueType(), _stack->global, {builder->getInt32(0), top}));
+    llvm::SwitchInst *dispatch = builder->CreateSwitch(site, fail, live.size());
+    for (int s : live) {
+        dispatch->addCase(builder->getInt32(_labels->key(s)),
+                          _labels->target(builder, _labels->successors[s]));
+    }
+    return true;
+}
+bool RETURNInstruction::addToBytecode(Bytecode *code) {
+    code->emit(Opcode::Return, _stack->slot);
     return true;
 }
@@ -1,106 +1,596 @@
 #ifndef PARSER_H_
 #define PARSER_H_
 
-#include <vector>
+#include <cstdint>
 #include <map>
-#include <set>
+#include <utility>
+#include <vector>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/Module.h>
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/StringMap.h>
 #include <llvm/IR/IRBuilder.h>
+#include <llvm/Support/Allocator.h>
 
+#include "lexer.h"
+#include "profile.h"
 #include "tokens.h"
 
+class Bytecode;
+struct ExprKey;
+class FORInstruction;
+class GOSUBInstruction;
+class Instruction;
+class RETURNInstruction;
+struct KnownVars;
+
+// Owns the text of each distinct string literal and, once generated, its global
+typedef llvm::StringMap<llvm::Constant *> StringPool;
+
+//
+// A program split into regions keeps the blocks of each region in its own
+// function, int region(i32 *vars, i32 *limits, i32 line), which starts at
+// the line with key line (see LabelTable::key) and returns the key of the
+// line to continue at once control leaves it. main loops over a switch that
+// calls the region holding that line until the end comes back. Lines are
+// only registered as entries when some other region (or main) continues at
+// them. Regions get the variables and GOSUB depth in vars and the limits of
+// their own FOR loops, which they number from the slot after the depth, in
+// limits.
+//
+struct RegionTable {
+    struct Region {
+        llvm::Function *fn;
+        // Switch on the line argument to the entry lines
+        llvm::SwitchInst *entry;
+        // Block in main that calls the region
+        llvm::BasicBlock *call;
+        // Position of the region's first FOR limit among main's
+        unsigned int limits;
+    };
+
+    std::vector<Region> regions;
+    // Region holding each line
+    std::vector<unsigned int> region_of;
+    // main's switch on the line to continue at
+    llvm::SwitchInst *dispatch = nullptr;
+    llvm::PHINode *next = nullptr;
+    // Lines some region or main continues at, the switches get their cases
+    // in line order once all code is generated
+    std::vector<bool> entries;
+    // Slots passed in vars, the variables and the GOSUB depth
+    unsigned int shared = 0;
+    // Blocks returning a line key, by region and index
+    std::map<std::pair<llvm::Function *, int>, llvm::BasicBlock *> exits;
+
+    // Copies the slots of fn's vars to main's (to_main) or back
+    void copyVars(llvm::IRBuilder<> *builder, llvm::Function *fn, bool to_main) const;
+};
+
+//
+// Profile-guided code generation, see CompileOptions. Instrumented code
+// counts into a global laid out as basic_profile_start expects. With a
+// profile loaded, executed[i] and taken[i] tell how often line i ran and
+// its IF jumped, and become branch weights.
+//
+struct ProfileTable {
+    llvm::GlobalVariable *counters = nullptr;
+    std::vector<uint64_t> executed;
+    std::vector<uint64_t> taken;
+
+    // Adds amount (an i64, or 1 if null) to the block (0) or jump (1)
+    // counter of line index
+    void count(llvm::IRBuilder<> *builder, int index, int counter, llvm::Value *amount = nullptr);
+    // Branch weights for the IF on line index jumping or not, and for the
+    // FOR on line index entering its body or not. Null without a profile.
+    llvm::MDNode *jumpWeights(llvm::LLVMContext &ctx, int index) const;
+    llvm::MDNode *loopWeights(llvm::LLVMContext &ctx, int index) const;
+};
+
+//
+// Flat, label-sorted view of the program, built once after parsing. Line i
+// of the sorted program is instrs[i]; blocks[i] is the block that starts at
+// line i (null if the line continues the previous block) and successors[i]
+// is the index of the block control reaches by falling off the end of line
+// i. Index size() holds the end block that returns from main.
+//
+struct LabelTable {
+    std::vector<int> labels;
+    std::vector<Instruction *> instrs;
+    std::vector<llvm::BasicBlock *> blocks;
+    std::vector<int> successors;
+    // Set when main is split into regions
+    RegionTable *regions = nullptr;
+    // Set when code is instrumented or a profile is loaded
+    ProfileTable *profile = nullptr;
+
+    size_t size() const {return instrs.size();}
+    // Index of the line with this label, -1 if there is none
+    int indexOf(int label) const;
+    // Block to branch to from the builder's function to continue at the
+    // block starting at line index, which is an exit when the line is in
+    // another region
+    llvm::BasicBlock *target(llvm::IRBuilder<> *builder, int index);
+    // Makes main and the region holding line index able to continue there
+    void enter(int index);
+    // Stands for line index in the region switches and on the GOSUB return
+    // stack. When main is split that is the line's label (-1 for the end),
+    // so that a region's code does not change when lines are added before
+    // it, otherwise the index, which the interpreter pushes too.
+    int key(int index) const;
+};
+
+//
+// Arrays declared with DIM, indexed by letter; size 0 means undeclared.
+// Native code keeps each array in a zeroed, aligned global, the interpreter
+// all of them in one buffer at the given offsets. While IR is generated,
+// lo and hi hold the range each variable is known to stay in on the
+// current line, so that bounds checks it proves redundant are left out.
+//
+struct ArrayTable {
+    // Largest array DIM accepts
+    static const int32_t kMaxSize = 1 << 28;
+
+    uint32_t sizes[26] = {};
+    uint64_t offsets[26] = {};
+    uint64_t total = 0;
+    llvm::GlobalVariable *globals[26] = {};
+    int64_t lo[26];
+    int64_t hi[26];
+
+    ArrayTable() {clearRanges();}
+    bool declared(char array) const {return sizes[array - 'A'] != 0;}
+    void setRange(char var, int64_t low, int64_t high);
+    void clearRanges();
+    // True if every value the element's index can have is in bounds
+    bool inBounds(const Token &elem) const;
+};
+
+//
+// GOSUB pushes the index of its line on a fixed-size return stack and
+// RETURN pops it. The depth is kept in the slot after the variables. Native
+// code keeps the stack in a global, the interpreter after the arrays in
+// its buffer.
+//
+struct ReturnStack {
+    // Deepest GOSUB nesting allowed
+    static const int32_t kDepth = 1024;
+
+    unsigned int slot = 26;
+    llvm::GlobalVariable *global = nullptr;
+};
+
+//
+// Arithmetic expression tree, allocated in the parser's arena. A leaf holds
+// a value token, an inner node an operator token and its operands.
+// Negation is a Minus node without rhs.
+//
+struct Expr {
+    Token tok;
+    Expr *lhs;
+    Expr *rhs;
+
+    bool isLeaf() const {return lhs == nullptr;}
+    // Number of nodes
+    unsigned int size() const;
+};
+
+//
+// Values already computed in the block being generated, so that repeated
+// subexpressions and reloaded variables reuse them. Entries are keyed by
+// the expression's text and stay valid until a variable or array they read
+// is assigned, which is tracked with a clock instead of by removing them.
+//
+struct ExprCache {
+    struct Entry {
+        llvm::Value *value;
+        uint64_t stamp;
+        uint32_t vars;
+        uint32_t arrays;
+    };
+
+    llvm::StringMap<Entry> entries;
+    uint64_t now = 0;
+    uint64_t var_writes[26] = {};
+    uint64_t array_writes[26] = {};
+
+    // Null if there is no valid entry
+    llvm::Value *lookup(const ExprKey &key) const;
+    void insert(const ExprKey &key, llvm::Value *value);
+    void assignVar(char var) {var_writes[var - 'A'] = ++now;}
+    void assignArray(char array) {array_writes[array - 'A'] = ++now;}
+    // Called at the start of each block
+    void clear() {entries.clear();}
+};
+
+//
+// Instructions are allocated in the parser's arena and never destroyed
+// individually, so they must not own anything that needs a destructor.
+//
 class Instruction {
   public:
     int label;
-    Instruction(int lbl);
+    Instruction(int lbl, ArrayTable *arrays = nullptr, ExprCache *exprs = nullptr);
     virtual bool addToBuilder(llvm::IRBuilder<> *builder, llvm::Module *mod) = 0;
+    // Lowers the line for the interpreter, every line emits at least one op
+    virtual bool addToBytecode(Bytecode *code) = 0;
+
+    // Hooks for the front-end optimizer, see lineopt.h. transfer applies the
+    // line's effect to known, evaluate tells whether a jump is taken (1),
+    // skipped (0) or unknown (-1). rewrite replaces operands with the
+    // constants in known and returns false if the line does nothing.
+    virtual void transfer(KnownVars *known) const {}
+    virtual int evaluate(const KnownVars &known) const {return -1;}
+    virtual bool rewrite(const KnownVars &known) {return true;}
+    // Line index jumped to (size() for the end), -1 for lines that never jump
+    virtual int jumpIndex() const {return -1;}
+    // Bit (var - 'A') is set for each variable read
+    virtual uint32_t reads() const = 0;
+    // Scratch registers addToBytecode needs beyond Bytecode::kNumScratch
+    virtual unsigned int scratchNeeded() const {return 0;}
+    // Variable assigned, -1 for none
+    virtual int writes() const {return -1;}
+    // True if the line can stop the program with a run time error, so it
+    // must run even when nothing reads what it assigns
+    virtual bool mayTrap() const {return false;}
+    // Indices of the GOSUB lines a RETURN can return to, it continues after
+    // one of them. Null for every other line.
+    virtual const llvm::ArrayRef<int> *returnSites() const {return nullptr;}
+
+    // Pairs NEXT lines with their FOR, called in label order with each
+    // line's index. open holds the FOR lines whose NEXT is still to come.
+    virtual bool resolveLoops(std::vector<FORInstruction *> *open, int index) {return true;}
   protected:
-    llvm::Value *_token_to_value(llvm::IRBuilder<> *build, llvm::Module *mod, IntValueToken *tok);
+    // Needed by lines that can access array elements
+    ArrayTable *_arrays;
+    // Lines that reuse values computed earlier in their block, null otherwise
+    ExprCache *_exprs;
+
+    llvm::Value *_token_to_value(llvm::IRBuilder<> *build, llvm::Module *mod, const Token &tok);
+    // Stores to a variable or an array element
+    void _store_value(llvm::IRBuilder<> *builder, llvm::Module *mod, const Token &dst, llvm::Value *val);
+    // Address of an element, checking its index unless that is provably in bounds
+    llvm::Value *_element_ptr(llvm::IRBuilder<> *builder, llvm::Module *mod, const Token &elem);
+    // Continues in a new block if ok holds, otherwise calls the noreturn
+    // runtime function error with args
+    void _guard(llvm::IRBuilder<> *builder, llvm::Module *mod, llvm::Value *ok, const std::string &name,
+                const char *error, llvm::ArrayRef<llvm::Value *> args);
+    llvm::Value *_get_slot_ptr(llvm::IRBuilder<> *builder, llvm::Module *mod, unsigned int slot);
     llvm::Value *_get_var_ptr(llvm::IRBuilder<> *builder, llvm::Module *mod, char var);
     llvm::Value *_get_var(llvm::IRBuilder<> *builder, llvm::Module *mod, char var);
     llvm::Value *_set_var(llvm::IRBuilder<> *builder, llvm::Module *mod, char var, llvm::Value *val);
+    void _print_str(llvm::IRBuilder<> *builder, llvm::Module *mod, llvm::StringRef str,
+                    StringPool *strings);
+    void _print_value(llvm::IRBuilder<> *builder, llvm::Module *mod, const Token &tok);
+    // Expressions evaluate left to right in every tier, so the same bounds
+    // error is reported first
+    llvm::Value *_expr_to_value(llvm::IRBuilder<> *builder, llvm::Module *mod, const Expr *expr);
+    // lhs / rhs, stopping the program if rhs is zero. INT32_MIN / -1 wraps
+    // like the other operations.
+    llvm::Value *_divide(llvm::IRBuilder<> *builder, llvm::Module *mod, llvm::Value *lhs,
+                         llvm::Value *rhs);
+    // Register holding the value, inner nodes are computed into dst unless
+    // it is -1
+    uint32_t _expr_to_register(Bytecode *code, const Expr *expr, int dst = -1);
+    static bool _known_value(const Token &tok, const KnownVars &known, int32_t *val);
+    static void _substitute(Token *tok, const KnownVars &known);
+    static uint32_t _read_bit(const Token &tok);
+    // Folds the way the generated code computes, division that would trap
+    // is left for run time
+    static bool _fold(const Expr *expr, const KnownVars &known, int32_t *result);
+    // Replaces known variables with constants and folds constant subtrees
+    static void _substitute(Expr *expr, const KnownVars &known);
+    static uint32_t _read_bits(const Expr *expr);
+    static bool _may_trap(const Expr *expr);
+    static void _key(const Token &tok, ExprKey *key);
+    static void _key(const Expr *expr, ExprKey *key);
 };
 class LETInstruction : public Instruction {
   public:
-    LETInstruction(int label,
-                   VarIntValueToken *var,
-                   IntValueToken *rhs,
-                   OpToken *op = nullptr,
-                   IntValueToken *lhs = nullptr);
+    LETInstruction(ArrayTable *arrays, ExprCache *exprs, int label, const Token &dst, Expr *value);
     virtual bool addToBuilder(llvm::IRBuilder<> *builder, llvm::Module *mod) override;
+    virtual bool addToBytecode(Bytecode *code) override;
+    virtual void transfer(KnownVars *known) const override;
+    virtual bool rewrite(const KnownVars &known) override;
+    virtual uint32_t reads() const override;
+    virtual int writes() const override {return _dst.kind == TokenKind::VarIntValue ? _dst.getVar() : -1;}
+    // Element accesses and divisions by anything but a nonzero constant
+    virtual bool mayTrap() const override {return _dst.isElement() || _may_trap(_value);}
+    virtual unsigned int scratchNeeded() const override {return _value->size();}
   private:
-    VarIntValueToken *_var;
-    IntValueToken *_lhs;
-    OpToken *_op;
-    IntValueToken *_rhs;
-    llvm::Value *_calc_op(llvm::IRBuilder<> *build, llvm::Value *l, llvm::Value *r);
+    // A variable or an array element
+    Token _dst;
+    Expr *_value;
 };
 class IFInstruction : public Instruction {
   public:
-    IFInstruction(std::map<int, llvm::BasicBlock *> *blocks,
+    IFInstruction(LabelTable *labels,
+                  ArrayTable *arrays,
+                  ExprCache *exprs,
                   int label,
-                  IntValueToken *lhs,
-                  CmpToken *cmp,
-                  IntValueToken *rhs,
-                  ConstIntValueToken *true_label);
+                  Expr *lhs,
+                  const Token &cmp,
+                  Expr *rhs,
+                  int true_label);
     virtual bool addToBuilder(llvm::IRBuilder<> *builder, llvm::Module *mod) override;
+    virtual bool addToBytecode(Bytecode *code) override;
+    virtual int evaluate(const KnownVars &known) const override;
+    virtual bool rewrite(const KnownVars &known) override;
+    virtual int jumpIndex() const override {return _labels->indexOf(_true_label);}
+    virtual uint32_t reads() const override;
+    virtual unsigned int scratchNeeded() const override {return _lhs->size() + _rhs->size();}
   private:
-    std::map<int, llvm::BasicBlock *> *_blocks;
+    LabelTable *_labels;
     int _label;
-    IntValueToken *_lhs;
-    CmpToken *_cmp;
-    IntValueToken *_rhs;
-    ConstIntValueToken *_true_label;
+    Expr *_lhs;
+    Token _cmp;
+    Expr *_rhs;
+    int _true_label;
+    // Set when the condition is known to hold
+    bool _always = false;
     llvm::Value *_calc_cmp(llvm::IRBuilder<> *build, llvm::Value *l, llvm::Value *r);
 };
 class PRINTInstruction : public Instruction {
   public:
-    PRINTInstruction(int label, StringValueToken *str);
-    PRINTInstruction(int label, VarIntValueToken *var);
+    PRINTInstruction(int label, llvm::StringRef str, StringPool *strings);
+    PRINTInstruction(ArrayTable *arrays, ExprCache *exprs, int label, const Token &val);
     virtual bool addToBuilder(llvm::IRBuilder<> *builder, llvm::Module *mod) override;
+    virtual bool addToBytecode(Bytecode *code) override;
+    virtual bool rewrite(const KnownVars &known) override;
+    virtual uint32_t reads() const override {return _read_bit(_val);}
   private:
-    StringValueToken *_str = nullptr;
-    VarIntValueToken *_var = nullptr;
+    llvm::StringRef _str;
+    StringPool *_strings = nullptr;
+    // StringValue when printing _str
+    Token _val;
 };
 class PRINTLNInstruction : public Instruction {
   public:
-    PRINTLNInstruction(int label, StringValueToken *str);
-    PRINTLNInstruction(int label, VarIntValueToken *var);
+    PRINTLNInstruction(int label, llvm::StringRef str, StringPool *strings);
+    PRINTLNInstruction(ArrayTable *arrays, ExprCache *exprs, int label, const Token &val);
     virtual bool addToBuilder(llvm::IRBuilder<> *builder, llvm::Module *mod) override;
+    virtual bool addToBytecode(Bytecode *code) override;
+    virtual bool rewrite(const KnownVars &known) override;
+    virtual uint32_t reads() const override {return _read_bit(_val);}
   private:
-    StringValueToken *_str = nullptr;
-    VarIntValueToken *_var = nullptr;
+    llvm::StringRef _str;
+    StringPool *_strings = nullptr;
+    // StringValue when printing _str
+    Token _val;
 };
 
+//
+// DIM A(n) declares A(0) to A(n-1). Arrays exist for the whole run and
+// start out zeroed, executing the DIM line zeroes the array again.
+//
+class DIMInstruction : public Instruction {
+  public:
+    DIMInstruction(ArrayTable *arrays, ExprCache *exprs, int label, char array);
+    virtual bool addToBuilder(llvm::IRBuilder<> *builder, llvm::Module *mod) override;
+    virtual bool addToBytecode(Bytecode *code) override;
+    virtual uint32_t reads() const override {return 0;}
+  private:
+    char _array;
+};
+
+//
+// FOR V = start TO limit [STEP step] ... NEXT V. The FOR line is the
+// preheader: it evaluates start and limit once, keeping the limit in a
+// slot after the 26 variables, and enters a header block that holds V as
+// a phi and tests it. NEXT is the latch. Leaving the loop continues after
+// the NEXT line.
+//
+class FORInstruction : public Instruction {
+  public:
+    FORInstruction(LabelTable *labels, ArrayTable *arrays, int label, char var,
+                   const Token &start, const Token &limit, const Token &step,
+                   unsigned int slot);
+    virtual bool addToBuilder(llvm::IRBuilder<> *builder, llvm::Module *mod) override;
+    virtual bool addToBytecode(Bytecode *code) override;
+    virtual void transfer(KnownVars *known) const override;
+    virtual bool rewrite(const KnownVars &known) override;
+    virtual int jumpIndex() const override {return _next_index + 1;}
+    virtual uint32_t reads() const override;
+    virtual int writes() const override {return _var;}
+    virtual bool resolveLoops(std::vector<FORInstruction *> *open, int index) override;
+
+    char var() const {return _var;}
+    int index() const {return _index;}
+    int nextIndex() const {return _next_index;}
+    void setNextIndex(int index) {_next_index = index;}
+    // Regions number the limits of their loops themselves
+    void setSlot(unsigned int slot) {_slot = slot;}
+    // Called once nothing but NEXT can change V inside the loop and the
+    // loop is only entered through FOR
+    void setSingleEntry() {_single_entry = true;}
+    // Values V takes inside the body, false unless known at compile time
+    bool bodyRange(int64_t *lo, int64_t *hi) const;
+    // Used by the matching NEXT
+    void addLatch(llvm::IRBuilder<> *builder, llvm::Module *mod);
+    void addLatchBytecode(Bytecode *code);
+
+  private:
+    LabelTable *_labels;
+    char _var;
+    Token _start;
+    Token _limit;
+    Token _step;
+    unsigned int _slot;
+    int _index = -1;
+    int _next_index = -1;
+    bool _single_entry = false;
+    llvm::BasicBlock *_header = nullptr;
+    llvm::PHINode *_phi = nullptr;
+
+    // Single entry with a constant limit that the step cannot overflow past,
+    // so the loop is finite. The optimizer may make the limit constant.
+    bool _counted() const;
+    void _create_header(llvm::IRBuilder<> *builder, llvm::Module *mod);
+};
+class NEXTInstruction : public Instruction {
+  public:
+    NEXTInstruction(int label, char var);
+    virtual bool addToBuilder(llvm::IRBuilder<> *builder, llvm::Module *mod) override;
+    virtual bool addToBytecode(Bytecode *code) override;
+    virtual void transfer(KnownVars *known) const override;
+    virtual int jumpIndex() const override {return _for->index() + 1;}
+    virtual uint32_t reads() const override {return 1u << (_var - 'A');}
+    virtual int writes() const override {return _var;}
+    virtual bool resolveLoops(std::vector<FORInstruction *> *open, int index) override;
+  private:
+    char _var;
+    FORInstruction *_for = nullptr;
+};
+
+//
+// GOSUB L jumps to L after pushing its own line on the return stack, so
+// the line after it is only reached through a RETURN.
+//
+class GOSUBInstruction : public Instruction {
+  public:
+    GOSUBInstruction(LabelTable *labels, ReturnStack *stack, int label, int target_label);
+    virtual bool addToBuilder(llvm::IRBuilder<> *builder, llvm::Module *mod) override;
+    virtual bool addToBytecode(Bytecode *code) override;
+    virtual int evaluate(const KnownVars &known) const override {return 1;}
+    virtual int jumpIndex() const override {return _labels->indexOf(_target_label);}
+    virtual uint32_t reads() const override {return 0;}
+  private:
+    LabelTable *_labels;
+    ReturnStack *_stack;
+    int _target_label;
+};
+
+//
+// RETURN pops a GOSUB line and continues after it. It lowers to a switch
+// over the GOSUB lines whose subroutine can reach it, as found by
+// BASICParser::_resolve_calls.
+//
+class RETURNInstruction : public Instruction {
+  public:
+    RETURNInstruction(LabelTable *labels, ReturnStack *stack, int label);
+    virtual bool addToBuilder(llvm::IRBuilder<> *builder, llvm::Module *mod) override;
+    virtual bool addToBytecode(Bytecode *code) override;
+    virtual uint32_t reads() const override {return 0;}
+    virtual const llvm::ArrayRef<int> *returnSites() const override {return &_sites;}
+    // sites must outlive the instruction
+    void setSites(llvm::ArrayRef<int> sites) {_sites = sites;}
+  private:
+    LabelTable *_labels;
+    ReturnStack *_stack;
+    // Sorted, in the parser's arena
+    llvm::ArrayRef<int> _sites;
+};
 
 class BASICParser
 {
   public:
-    BASICParser();
+    BASICParser(llvm::LLVMContext &ctx);
 
-    bool parseFromTokenList(const std::vector<Token *> &tk_lst);
-    llvm::Module *generateModule();
+    bool parseFromTokenList(const TokenList &tk_lst);
+    // Pulls lines from an opened lexer until its input runs out
+    bool parseFromLexer(BASICLexer &lexer);
+    std::unique_ptr<llvm::Module> generateModule();
+    // Builds int basic_resume(i32 *vars, i32 *arrays) instead of main. It
+    // starts with the variables, GOSUB depth and FOR limits in vars and
+    // continues at label, which must be a jump target. Arrays are copied in
+    // from arrays, laid out as in ArrayTable and followed by the return stack.
+    std::unique_ptr<llvm::Module> generateResumeModule(int label);
+    // Lowers the program for the interpreter, generateResumeModule may
+    // follow to take the same program native
+    bool generateBytecode(Bytecode *code);
+    // Runs the front-end optimizer (lineopt.h) before generating IR
+    void setLineOptimization(bool enable) {_optimize_lines = enable;}
+    // Splits main into up to count region functions (see RegionTable) of
+    // similar length, so that they can be optimized and compiled apart.
+    // Regions only start at blocks outside every FOR body.
+    void setRegions(unsigned int count) {_region_count = count;}
+    // Splits main into regions of a few hundred lines instead, starting at
+    // blocks picked by their label. An edit then moves no region boundary
+    // but those next to it, which incremental builds rely on.
+    void setStableRegions(bool enable) {_stable_regions = enable;}
+    // Number of region functions, 0 unless main was split
+    size_t regionCount() {return _regions.regions.size();}
+    // Instruments the program to write a profile to path when it ends
+    void setProfileOutput(const std::string &path) {_profile_path = path;}
+    // Takes branch weights from an instrumented run's counts, which must
+    // outlive generateModule
+    void setProfile(const Profile *profile) {_profile_in = profile;}
+    // Number of program lines, valid after generateModule()
+    size_t instructionCount() {return _labels.size();}
 
   private:
-    std::map<int, llvm::BasicBlock *> _blocks;
-    std::map<int, Instruction *> _instrs;
-    std::set<int> _jump_landings;
-    std::set<int> _jump_fallthrough;
-    llvm::LLVMContext _global_ctx;
+    // Owns every Instruction, freed in one step with the parser
+    llvm::BumpPtrAllocator _arena;
+    // Lines in source order, sorted into _labels by _sort_lines
+    std::vector<Instruction *> _instrs;
+    LabelTable _labels;
+    StringPool _strings;
+    // Labels that are jumped to and labels of lines that end with a jump
+    std::vector<int> _jump_landings;
+    std::vector<int> _jump_fallthrough;
+    llvm::LLVMContext &_global_ctx;
     std::unique_ptr<llvm::Module> _mod;
     std::unique_ptr<llvm::IRBuilder<>> _builder;
 
     llvm::Function *_main;
-    llvm::Function *_printf;
+    int _resume_label = -1;
+    // Every FOR line parsed, each owns one slot after the variables
+    std::vector<FORInstruction *> _loops;
+    ArrayTable _arrays;
+    ReturnStack _stack;
+    ExprCache _exprs;
+    // Expression nodes are carved from chunks of the arena, most lines need
+    // only a few and allocating them one by one dominated parsing
+    Expr *_expr_next = nullptr;
+    Expr *_expr_end = nullptr;
+    // Every GOSUB and RETURN line parsed
+    std::vector<GOSUBInstruction *> _calls;
+    std::vector<RETURNInstruction *> _returns;
+    // Sorted indices of the GOSUB lines left after _sort_lines
+    std::vector<int> _call_lines;
+    // Label of the first line using each array, to report missing DIMs
+    int _array_uses[26];
+    bool _optimize_lines = false;
+    unsigned int _region_count = 1;
+    bool _stable_regions = false;
+    RegionTable _regions;
+    std::string _profile_path;
+    const Profile *_profile_in = nullptr;
+    ProfileTable _profile;
+
+    bool _parse_line(const TokenList &tk_lst, unsigned int &curr_pos);
+    llvm::StringRef _intern(llvm::StringRef str);
+    Expr *_parse_expr(const std::vector<Token> &tokens, unsigned int &curr_pos, int label,
+                      int min_precedence = 0);
+    Expr *_parse_operand(const std::vector<Token> &tokens, unsigned int &curr_pos, int label);
+    Expr *_new_expr(const Token &tok, Expr *lhs, Expr *rhs);
+    bool _make_let(const TokenList &tk_lst, unsigned int &curr_pos, int label);
+    bool _make_if(const TokenList &tk_lst, unsigned int &curr_pos, int label);
+    bool _make_print(const TokenList &tk_lst, unsigned int &curr_pos, int label);
+    bool _make_println(const TokenList &tk_lst, unsigned int &curr_pos, int label);
+    bool _make_for(const TokenList &tk_lst, unsigned int &curr_pos, int label);
+    bool _make_next(const TokenList &tk_lst, unsigned int &curr_pos, int label);
+    bool _make_dim(const TokenList &tk_lst, unsigned int &curr_pos, int label);
+    bool _make_gosub(const TokenList &tk_lst, unsigned int &curr_pos, int label);
+    bool _make_return(const TokenList &tk_lst, unsigned int &curr_pos, int label);
 
-    bool _make_let(const std::vector<Token *> &tk_list, unsigned int &curr_pos, int label);
-    bool _make_if(const std::vector<Token *> &tk_list, unsigned int &curr_pos, int label);
-    bool _make_print(const std::vector<Token *> &tk_list, unsigned int &curr_pos, int label);
-    bool _make_println(const std::vector<Token *> &tk_list, unsigned int &curr_pos, int label);
-    
     bool _create_functions();
+    bool _sort_lines();
+    bool _resolve_loops();
+    void _find_counted_loops();
+    bool _resolve_calls();
+    bool _layout_arrays();
+    void _create_arrays();
+    void _create_stack();
     bool _create_blocks();
+    std::vector<bool> _region_starts(const std::vector<bool> &starts_block);
+    void _create_regions(const std::vector<bool> &region_starts);
+    void _call_regions(llvm::AllocaInst *vars, int start);
+    void _enter_regions();
+    // Variables, the GOSUB depth and the FOR limits
+    unsigned int _slot_count() const {return _stack.slot + 1 + _loops.size();}
+    void _create_profile();
     bool _create_vars();
 };
 
@@ -0,0 +1,79 @@
+#include <iostream>
+#include <utility>
+#include <vector>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/PassInstrumentation.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/Timer.h>
+
+#include "passes.h"
+
+#if LLVM_VERSION_MAJOR >= 14
+typedef llvm::OptimizationLevel OptLevel;
+#else
+typedef llvm::PassBuilder::OptimizationLevel OptLevel;
+#endif
+
+// Times passes through the instrumentation callbacks. Pass managers and
+// adaptors nest, so each pass is charged only for time not spent in the
+// passes it runs.
+class PassTimer {
+  public:
+    PassTimer(std::map<std::string, double> *pass_wall) : _pass_wall(pass_wall) {}
+
+    void registerCallbacks(llvm::PassInstrumentationCallbacks &pic) {
+        pic.registerBeforeNonSkippedPassCallback([this](llvm::StringRef, llvm::Any) {
+            _stack.push_back({llvm::TimeRecord::getCurrentTime(true).getWallTime(), 0});
+        });
+        pic.registerAfterPassCallback(
+            [this](llvm::StringRef pass, llvm::Any, const llvm::PreservedAnalyses &) {_pop(pass);});
+        pic.registerAfterPassInvalidatedCallback(
+            [this](llvm::StringRef pass, const llvm::PreservedAnalyses &) {_pop(pass);});
+    }
+
+  private:
+    std::map<std::string, double> *_pass_wall;
+    // Start time and time spent in nested passes for each running pass
+    std::vector<std::pair<double, double>> _stack;
+
+    void _pop(llvm::StringRef pass) {
+        if (_stack.empty()) return;
+        double elapsed = llvm::TimeRecord::getCurrentTime(false).getWallTime() - _stack.back().first;
+        double exclusive = elapsed - _stack.back().second;
+        _stack.pop_back();
+        if (!_stack.empty()) _stack.back().second += elapsed;
+        (*_pass_wall)[pass.str()] += exclusive;
+    }
+};
+
+bool optimizeModule(llvm::Module *mod, int opt_level, llvm::TargetMachine *tm,
+                    std::map<std::string, double> *pass_wall) {
+    OptLevel level;
+    switch (opt_level) {
+        case 0: return true;
+        case 1: level = OptLevel::O1; break;
+        case 2: level = OptLevel::O2; break;
+        case 3: level = OptLevel::O3; break;
+        default:
+            std::cout << "Unknown optimization level -O" << opt_level << "\n";
+            return false;
+    }
+
+    llvm::LoopAnalysisManager lam;
+    llvm::FunctionAnalysisManager fam;
+    llvm::CGSCCAnalysisManager cgam;
+    llvm::ModuleAnalysisManager mam;
+    llvm::PassInstrumentationCallbacks pic;
+    PassTimer timer(pass_wall);
+    if (pass_wall != nullptr) timer.registerCallbacks(pic);
+    llvm::PassBuilder pb(tm, llvm::PipelineTuningOptions(), llvm::None, &pic);
+    pb.registerModuleAnalyses(mam);
+    pb.registerCGSCCAnalyses(cgam);
+    pb.registerFunctionAnalyses(fam);
+    pb.registerLoopAnalyses(lam);
+    pb.crossRegisterProxies(lam, fam, cgam, mam);
+
+    llvm::ModulePassManager mpm = pb.buildPerModuleDefaultPipeline(level);
+    mpm.run(*mod, mam);
+    return true;
+}
@@ -0,0 +1,15 @@
+#ifndef PASSES_H_
+#define PASSES_H_
+
+#include <map>
+#include <string>
+#include <llvm/IR/Module.h>
+#include <llvm/Target/TargetMachine.h>
+
+// Runs the new pass manager's default pipeline for -O<opt_level> (0-3),
+// tm (if given) provides target cost information to the optimizer. When
+// pass_wall is given, each pass's exclusive wall time is added to it.
+bool optimizeModule(llvm::Module *mod, int opt_level, llvm::TargetMachine *tm = nullptr,
+                    std::map<std::string, double> *pass_wall = nullptr);
+
+#endif  // PASSES_H_
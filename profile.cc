@@ -0,0 +1,35 @@
+#include <cstdio>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include "profile.h"
+#include "runtime.h"
+
+bool readProfile(const std::string &path, Profile *profile) {
+    auto buffer = llvm::MemoryBuffer::getFile(path);
+    if (!buffer) {
+        printf("Could not open %s: %s\n", path.c_str(), buffer.getError().message().c_str());
+        return false;
+    }
+    llvm::SmallVector<llvm::StringRef, 0> lines;
+    (*buffer)->getBuffer().split(lines, '\n', -1, false);
+    if (lines.empty() || lines[0] != kProfileHeader) {
+        printf("%s is not a BASIC profile\n", path.c_str());
+        return false;
+    }
+    for (size_t i = 1; i < lines.size(); ++i) {
+        // label entries taken
+        llvm::SmallVector<llvm::StringRef, 3> fields;
+        lines[i].split(fields, ' ', -1, false);
+        int label;
+        LineCounts counts;
+        if (fields.size() != 3 || fields[0].getAsInteger(10, label) ||
+            fields[1].getAsInteger(10, counts.entries) || fields[2].getAsInteger(10, counts.taken)) {
+            printf("Malformed line %zu in profile %s\n", i + 1, path.c_str());
+            return false;
+        }
+        (*profile)[label] = counts;
+    }
+    return true;
+}
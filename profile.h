@@ -0,0 +1,25 @@
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+//
+// Counts written by a program built with CompileOptions::profile_generate,
+// see basic_profile_start in runtime.h. Lines that never ran are left out.
+//
+struct LineCounts {
+    // Times the block starting at the line was entered
+    uint64_t entries = 0;
+    // Times the IF on the line jumped
+    uint64_t taken = 0;
+};
+
+// By label
+typedef std::map<int, LineCounts> Profile;
+
+// Prints an error and returns false if path cannot be read or is malformed
+bool readProfile(const std::string &path, Profile *profile);
+
+#endif  // PROFILE_H_
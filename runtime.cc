@@ -0,0 +1,133 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+
+#include "runtime.h"
+
+static const size_t kBufferSize = 1 << 16;
+static char _buffer[kBufferSize];
+static size_t _used = 0;
+
+// Registered by basic_profile_start
+static const char *_profile_path = nullptr;
+static const int32_t *_profile_labels;
+static const uint64_t *_profile_counts;
+static int32_t _profile_lines;
+
+// "00" to "99", so integers are converted two digits at a time
+static const char kDigitPairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static void _write_all(const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(STDOUT_FILENO, data, len);
+        if (written <= 0) return;
+        data += written;
+        len -= written;
+    }
+}
+
+void basic_flush() {
+    _write_all(_buffer, _used);
+    _used = 0;
+}
+
+void basic_print_int(int32_t val) {
+    // Sign and 10 digits
+    if (_used + 11 > kBufferSize) basic_flush();
+    uint32_t mag = val < 0 ? 0u - static_cast<uint32_t>(val) : static_cast<uint32_t>(val);
+    char digits[10];
+    char *end = digits + sizeof(digits);
+    char *p = end;
+    while (mag >= 100) {
+        uint32_t pair = (mag % 100) * 2;
+        mag /= 100;
+        *--p = kDigitPairs[pair + 1];
+        *--p = kDigitPairs[pair];
+    }
+    if (mag >= 10) {
+        *--p = kDigitPairs[mag * 2 + 1];
+        *--p = kDigitPairs[mag * 2];
+    } else {
+        *--p = static_cast<char>('0' + mag);
+    }
+    if (val < 0) _buffer[_used++] = '-';
+    memcpy(_buffer + _used, p, end - p);
+    _used += end - p;
+}
+
+void basic_print_str(const char *str, int32_t len) {
+    if (_used + len > kBufferSize) {
+        basic_flush();
+        if (static_cast<size_t>(len) > kBufferSize) {
+            _write_all(str, len);
+            return;
+        }
+    }
+    memcpy(_buffer + _used, str, len);
+    _used += len;
+}
+
+void basic_print_newline() {
+    if (_used == kBufferSize) basic_flush();
+    _buffer[_used++] = '\n';
+}
+
+void basic_index_error(int32_t label, int32_t array, int32_t index, int32_t size) {
+    basic_flush();
+    fprintf(stderr, "Index %d out of range for %c(%d) at line %d\n", index, array, size, label);
+    basic_profile_write();
+    exit(1);
+}
+
+void basic_stack_overflow(int32_t label, int32_t depth) {
+    basic_flush();
+    fprintf(stderr, "GOSUB nested deeper than %d at line %d\n", depth, label);
+    basic_profile_write();
+    exit(1);
+}
+
+void basic_return_error(int32_t label) {
+    basic_flush();
+    fprintf(stderr, "RETURN without GOSUB at line %d\n", label);
+    basic_profile_write();
+    exit(1);
+}
+
+void basic_division_error(int32_t label) {
+    basic_flush();
+    fprintf(stderr, "Division by zero at line %d\n", label);
+    basic_profile_write();
+    exit(1);
+}
+
+void basic_profile_start(const char *path, const int32_t *labels, const uint64_t *counts,
+                         int32_t lines) {
+    _profile_path = path;
+    _profile_labels = labels;
+    _profile_counts = counts;
+    _profile_lines = lines;
+}
+
+void basic_profile_write() {
+    if (_profile_path == nullptr) return;
+    FILE *out = fopen(_profile_path, "w");
+    if (out == nullptr) {
+        fprintf(stderr, "Could not write profile %s\n", _profile_path);
+        return;
+    }
+    fprintf(out, "%s\n", kProfileHeader);
+    for (int32_t i = 0; i < _profile_lines; ++i) {
+        uint64_t entries = _profile_counts[2 * i];
+        uint64_t taken = _profile_counts[2 * i + 1];
+        if (entries == 0 && taken == 0) continue;
+        fprintf(out, "%d %llu %llu\n", _profile_labels[i], static_cast<unsigned long long>(entries),
+                static_cast<unsigned long long>(taken));
+    }
+    fclose(out);
+    // Counters belong to the program, which may be gone once it returns
+    _profile_path = nullptr;
+}
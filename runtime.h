@@ -0,0 +1,39 @@
+#ifndef RUNTIME_H_
+#define RUNTIME_H_
+
+#include <cstdint>
+
+//
+// Runtime support linked into every compiled program (libbasicrt.a) and
+// into the compiler itself for --run. Output is collected in one large
+// buffer and written out when it fills up and when main returns.
+//
+extern "C" {
+void basic_print_int(int32_t val);
+void basic_print_str(const char *str, int32_t len);
+void basic_print_newline();
+void basic_flush();
+// Reports an array index outside 0..size-1 on the line with this label,
+// then exits
+[[noreturn]] void basic_index_error(int32_t label, int32_t array, int32_t index, int32_t size);
+// Report a GOSUB that would nest deeper than the return stack and a RETURN
+// with no GOSUB to return to, then exit
+[[noreturn]] void basic_stack_overflow(int32_t label, int32_t depth);
+[[noreturn]] void basic_return_error(int32_t label);
+// Reports a division by zero on the line with this label, then exits
+[[noreturn]] void basic_division_error(int32_t label);
+
+// Instrumented programs register their counters when they start. For line
+// i of the sorted program, labels[i] is its label, counts[2 * i] how often
+// the block starting there was entered and counts[2 * i + 1] how often its
+// IF jumped. basic_profile_write writes the counts to path, it is called
+// when main returns and before a runtime error exits.
+void basic_profile_start(const char *path, const int32_t *labels, const uint64_t *counts,
+                         int32_t lines);
+void basic_profile_write();
+}
+
+// First line of a profile, each further line holds a label and its two counts
+static const char kProfileHeader[] = "BASIC profile 1";
+
+#endif  // RUNTIME_H_
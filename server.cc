@@ -0,0 +1,248 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include "codegen.h"
+#include "server.h"
+
+static const char kMagic[4] = {'B', 'A', 'S', 'C'};
+static const uint32_t kProtocolVersion = 1;
+// Longest source or output either side accepts
+static const uint32_t kMaxString = 1u << 30;
+// Longest CPU name or feature string the server accepts
+static const uint32_t kMaxTargetString = 4096;
+// Strings are received this much at a time
+static const size_t kReceiveChunk = 64 * 1024;
+// A client that stops sending releases its worker after this long
+static const int kReceiveSeconds = 30;
+
+static bool _read(int fd, void *data, size_t size) {
+    char *p = static_cast<char *>(data);
+    while (size > 0) {
+        ssize_t n = recv(fd, p, size, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool _write(int fd, const void *data, size_t size) {
+    const char *p = static_cast<const char *>(data);
+    while (size > 0) {
+        // A client that hung up must not kill the server with SIGPIPE
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool _read_u32(int fd, uint32_t &value) {
+    return _read(fd, &value, sizeof(value));
+}
+
+// str only grows as data arrives, so a large length on its own allocates
+// nothing
+template <typename String>
+static bool _read_string(int fd, String &str, uint32_t max_size) {
+    uint32_t size;
+    if (!_read_u32(fd, size) || size > max_size) return false;
+    str.clear();
+    while (str.size() < size) {
+        size_t used = str.size();
+        size_t chunk = std::min<size_t>(size - used, kReceiveChunk);
+        str.resize(used + chunk);
+        if (!_read(fd, &str[used], chunk)) return false;
+    }
+    return true;
+}
+
+static void _append_u32(std::string &msg, uint32_t value) {
+    msg.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+static void _append_string(std::string &msg, llvm::StringRef str) {
+    _append_u32(msg, str.size());
+    msg.append(str.data(), str.size());
+}
+
+static bool _respond(int fd, uint32_t status, llvm::StringRef payload) {
+    std::string header;
+    _append_u32(header, status);
+    _append_u32(header, payload.size());
+    return _write(fd, header.data(), header.size()) && _write(fd, payload.data(), payload.size());
+}
+
+static bool _socket_address(const std::string &path, sockaddr_un &addr) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) return false;
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+CompileServer::CompileServer(const std::string &socket_path, unsigned int threads)
+    : _socket_path(socket_path), _threads(threads), _stopping(false), _requests(0), _failures(0) {
+}
+
+CompileServer::~CompileServer() {
+    stop();
+}
+
+bool CompileServer::start() {
+    sockaddr_un addr;
+    if (!_socket_address(_socket_path, addr)) {
+        printf("Socket path too long: %s\n", _socket_path.c_str());
+        return false;
+    }
+    // Everything a request would otherwise pay for at process start
+    initializeNativeTarget();
+
+    _listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (_listen_fd < 0) {
+        printf("Could not create socket: %s\n", strerror(errno));
+        return false;
+    }
+    int ret = bind(_listen_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+    if (ret < 0 && errno == EADDRINUSE) {
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        bool live = probe >= 0 && connect(probe, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0;
+        if (probe >= 0) close(probe);
+        if (live) {
+            printf("A server is already listening on %s\n", _socket_path.c_str());
+            close(_listen_fd);
+            _listen_fd = -1;
+            return false;
+        }
+        unlink(_socket_path.c_str());
+        ret = bind(_listen_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+    }
+    if (ret < 0 || listen(_listen_fd, SOMAXCONN) < 0) {
+        printf("Could not listen on %s: %s\n", _socket_path.c_str(), strerror(errno));
+        close(_listen_fd);
+        _listen_fd = -1;
+        return false;
+    }
+
+    if (_threads == 0) _threads = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned int t = 0; t < _threads; ++t) _workers.emplace_back([this]() {_worker();});
+    return true;
+}
+
+void CompileServer::stop() {
+    if (_listen_fd < 0) return;
+    _stopping = true;
+    // Wakes every worker blocked in accept()
+    shutdown(_listen_fd, SHUT_RDWR);
+    for (auto &t : _workers) t.join();
+    _workers.clear();
+    close(_listen_fd);
+    _listen_fd = -1;
+    unlink(_socket_path.c_str());
+}
+
+// Workers accept on the shared socket themselves, the kernel hands each
+// connection to exactly one of them
+void CompileServer::_worker() {
+    while (!_stopping) {
+        int fd = accept4(_listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (_stopping || errno == EBADF || errno == EINVAL) return;
+            continue;
+        }
+        _serve(fd);
+        close(fd);
+    }
+}
+
+void CompileServer::_serve(int fd) {
+    timeval timeout = {kReceiveSeconds, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    char magic[sizeof(kMagic)];
+    uint32_t version, opt_level, emit;
+    std::string cpu, features, source;
+    if (!_read(fd, magic, sizeof(magic)) || memcmp(magic, kMagic, sizeof(kMagic)) != 0 ||
+        !_read_u32(fd, version)) return;
+    if (version != kProtocolVersion) {
+        _respond(fd, 1, "unsupported protocol version");
+        return;
+    }
+    if (!_read_u32(fd, opt_level) || !_read_u32(fd, emit) ||
+        !_read_string(fd, cpu, kMaxTargetString) || !_read_string(fd, features, kMaxTargetString) ||
+        !_read_string(fd, source, kMaxString)) return;
+
+    ++_requests;
+    if (opt_level > 3 || emit > static_cast<uint32_t>(OutputKind::Object)) {
+        ++_failures;
+        _respond(fd, 1, "unsupported options");
+        return;
+    }
+    CompileOptions options;
+    options.opt_level = opt_level;
+    options.emit = static_cast<OutputKind>(emit);
+    options.cpu = cpu;
+    options.features = features;
+
+    llvm::SmallVector<char, 0> out;
+    if (!compileToBuffer(llvm::MemoryBufferRef(source, "request"), options, out)) {
+        ++_failures;
+        _respond(fd, 1, "compilation failed, see the server's output");
+        return;
+    }
+    _respond(fd, 0, llvm::StringRef(out.data(), out.size()));
+}
+
+bool compileRemote(const std::string &socket_path, llvm::StringRef source,
+                   const CompileOptions &options, llvm::SmallVectorImpl<char> &out,
+                   std::string &error) {
+    if (options.emit == OutputKind::Executable) {
+        error = "the server cannot link executables";
+        return false;
+    }
+    sockaddr_un addr;
+    if (!_socket_address(socket_path, addr)) {
+        error = "socket path too long";
+        return false;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+        error = std::string("could not connect to ") + socket_path + ": " + strerror(errno);
+        if (fd >= 0) close(fd);
+        return false;
+    }
+
+    std::string request(kMagic, sizeof(kMagic));
+    _append_u32(request, kProtocolVersion);
+    _append_u32(request, options.opt_level);
+    _append_u32(request, static_cast<uint32_t>(options.emit));
+    _append_string(request, options.cpu);
+    _append_string(request, options.features);
+    _append_string(request, source);
+
+    uint32_t status;
+    bool ok = _write(fd, request.data(), request.size()) && _read_u32(fd, status) &&
+              _read_string(fd, out, kMaxString);
+    close(fd);
+    if (!ok) {
+        error = "connection to the server was lost";
+        return false;
+    }
+    if (status != 0) {
+        error.assign(out.data(), out.size());
+        out.clear();
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,61 @@
+#ifndef SERVER_H_
+#define SERVER_H_
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringRef.h>
+
+#include "compiler.h"
+
+//
+// A compile daemon listening on a Unix domain socket. The LLVM target is
+// initialized once at start, then a pool of worker threads accepts
+// connections directly from the listening socket and compiles with
+// compileToBuffer. Each connection carries one request:
+//
+//   request:  "BASC" u32 version u32 opt_level u32 emit
+//             str cpu str features str source
+//   response: u32 status (0 on success) str output-or-error
+//
+// where u32 is in host byte order and str is a u32 length followed by that
+// many bytes. Executable output is not supported; compiler diagnostics go to
+// the server's own stdout.
+//
+class CompileServer {
+  public:
+    CompileServer(const std::string &socket_path, unsigned int threads);
+    ~CompileServer();
+
+    // Binds the socket, replacing a stale one left by a server that died,
+    // and starts the workers
+    bool start();
+    // Stops accepting, waits for requests in flight and removes the socket
+    void stop();
+
+    size_t requests() const {return _requests;}
+    size_t failures() const {return _failures;}
+
+  private:
+    std::string _socket_path;
+    unsigned int _threads;
+    int _listen_fd = -1;
+    std::atomic<bool> _stopping;
+    std::atomic<size_t> _requests;
+    std::atomic<size_t> _failures;
+    std::vector<std::thread> _workers;
+
+    void _worker();
+    void _serve(int fd);
+};
+
+// Sends one request to the server at socket_path and waits for the result.
+// Only opt_level, emit, cpu and features are taken from options. On failure
+// error holds the reason and false is returned.
+bool compileRemote(const std::string &socket_path, llvm::StringRef source,
+                   const CompileOptions &options, llvm::SmallVectorImpl<char> &out,
+                   std::string &error);
+
+#endif  // SERVER_H_
@@ -0,0 +1,74 @@
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include <sys/resource.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/JSON.h>
+
+#include "stats.h"
+
+long peakRSSKilobytes() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+    return usage.ru_maxrss;
+}
+
+static std::vector<std::pair<const char *, const PhaseTime *>> _phases(const CompileStats &stats) {
+    return {
+        {"lex", &stats.lex},
+        {"parse", &stats.parse},
+        {"irgen", &stats.irgen},
+        {"optimize", &stats.optimize},
+        {"codegen", &stats.codegen},
+    };
+}
+
+void CompileStats::print(llvm::raw_ostream &out) const {
+    out << "===-------------------------------------------------------------------------===\n"
+        << "                          BASIC compiler statistics\n"
+        << "===-------------------------------------------------------------------------===\n";
+    out << "  phase           wall (ms)     cpu (ms)\n";
+    PhaseTime total;
+    for (auto &phase : _phases(*this)) {
+        out << llvm::format("  %-12s %12.3f %12.3f\n", phase.first,
+                            phase.second->wall * 1000, phase.second->cpu * 1000);
+        total.wall += phase.second->wall;
+        total.cpu += phase.second->cpu;
+    }
+    out << llvm::format("  total        %12.3f %12.3f\n\n", total.wall * 1000, total.cpu * 1000);
+    out << "  tokens        " << tokens << "\n"
+        << "  instructions  " << instructions << "\n"
+        << "  basic blocks  " << basic_blocks << "\n"
+        << "  peak RSS      " << peak_rss_kb << " KB\n";
+
+    if (pass_wall.empty()) return;
+    std::vector<std::pair<double, std::string>> passes;
+    for (auto &it : pass_wall) passes.emplace_back(it.second, it.first);
+    std::sort(passes.rbegin(), passes.rend());
+    out << "\n  LLVM pass                                       wall (ms)\n";
+    for (auto &it : passes) {
+        out << llvm::format("  %-44s %12.3f\n", it.second.c_str(), it.first * 1000);
+    }
+}
+
+void CompileStats::printJSON(llvm::raw_ostream &out) const {
+    llvm::json::OStream json(out, 2);
+    json.object([&]() {
+        json.attributeObject("phases", [&]() {
+            for (auto &phase : _phases(*this)) {
+                json.attributeObject(phase.first, [&]() {
+                    json.attribute("wall_ms", phase.second->wall * 1000);
+                    json.attribute("cpu_ms", phase.second->cpu * 1000);
+                });
+            }
+        });
+        json.attribute("tokens", static_cast<int64_t>(tokens));
+        json.attribute("instructions", static_cast<int64_t>(instructions));
+        json.attribute("basic_blocks", static_cast<int64_t>(basic_blocks));
+        json.attribute("peak_rss_kb", static_cast<int64_t>(peak_rss_kb));
+        json.attributeObject("passes", [&]() {
+            for (auto &it : pass_wall) json.attribute(it.first, it.second * 1000);
+        });
+    });
+    out << "\n";
+}
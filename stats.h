@@ -0,0 +1,58 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <cstddef>
+#include <map>
+#include <string>
+#include <llvm/Support/Timer.h>
+#include <llvm/Support/raw_ostream.h>
+
+struct PhaseTime {
+    double wall = 0;
+    double cpu = 0;
+};
+
+//
+// Where one compilation spent its time and how big the program was
+//
+struct CompileStats {
+    // Lexing is interleaved with parsing and taken out of the parse, its
+    // CPU time is estimated from its share of the wall time
+    PhaseTime lex;
+    PhaseTime parse;
+    PhaseTime irgen;
+    PhaseTime optimize;
+    PhaseTime codegen;
+    size_t tokens = 0;
+    size_t instructions = 0;
+    size_t basic_blocks = 0;
+    long peak_rss_kb = 0;
+    // Exclusive wall time of each LLVM pass, summed over all its runs
+    std::map<std::string, double> pass_wall;
+
+    void print(llvm::raw_ostream &out) const;
+    void printJSON(llvm::raw_ostream &out) const;
+};
+
+//
+// Adds the wall and CPU time of its own lifetime to a phase, if there is one
+//
+class PhaseTimer {
+  public:
+    PhaseTimer(PhaseTime *phase)
+      : _phase(phase), _start(llvm::TimeRecord::getCurrentTime(true)) {}
+    ~PhaseTimer() {
+        if (_phase == nullptr) return;
+        llvm::TimeRecord end = llvm::TimeRecord::getCurrentTime(false);
+        _phase->wall += end.getWallTime() - _start.getWallTime();
+        _phase->cpu += end.getProcessTime() - _start.getProcessTime();
+    }
+  private:
+    PhaseTime *_phase;
+    llvm::TimeRecord _start;
+};
+
+// Peak resident set size of this process so far
+long peakRSSKilobytes();
+
+#endif  // STATS_H_
@@ -0,0 +1 @@
+10 DIM X(0)
@@ -0,0 +1,9 @@
+10 DIM X(10)
+20 FOR I = 0 TO 9
+30 LET X(I) = I
+40 NEXT I
+50 PRINTLN "in range"
+60 FOR I = 0 TO 10
+70 LET S = S + X(I)
+80 NEXT I
+90 PRINTLN "never"
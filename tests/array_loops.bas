@@ -0,0 +1,29 @@
+10 DIM X(100)
+20 DIM Y(100)
+30 FOR I = 0 TO 99
+40 LET X(I) = I * 3
+50 NEXT I
+60 FOR I = 99 TO 0 STEP -1
+70 LET Y(I) = X(I) + Y(I)
+80 LET S = S + Y(I)
+90 NEXT I
+100 FOR I = 0 TO 9
+110 FOR J = 0 TO 9
+120 LET K = I * 10 + J
+130 LET X(K) = X(K) + I
+140 NEXT J
+150 NEXT I
+160 PRINT S
+170 PRINTLN ""
+180 PRINT X(99)
+190 PRINTLN ""
+200 LET X(5) = 3
+210 IF X(5) < Y(2) THEN GOTO 240
+220 PRINTLN "not less"
+230 IF 0 = 0 THEN GOTO 250
+240 PRINTLN "less"
+250 FOR J = X(5) TO Y(1) STEP 2
+260 PRINT J
+270 PRINTLN ""
+280 NEXT J
+290 PRINTLN X(0)
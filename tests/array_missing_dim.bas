@@ -0,0 +1 @@
+10 LET X(1) = 2
@@ -0,0 +1,7 @@
+10 DIM X(5)
+20 LET X(0) = 1
+30 PRINT X(0)
+40 PRINTLN ""
+50 LET I = 0 - 1
+60 LET X(I) = 2
+70 PRINTLN "never"
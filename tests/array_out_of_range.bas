@@ -0,0 +1,4 @@
+10 DIM X(5)
+20 PRINTLN "before"
+30 PRINT X(5)
+40 PRINTLN "never"
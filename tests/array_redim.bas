@@ -0,0 +1,12 @@
+10 DIM X(3)
+20 LET X(1) = 7
+30 PRINT X(1)
+40 PRINTLN ""
+50 LET N = N + 1
+60 DIM X(3)
+70 PRINT X(1)
+80 PRINTLN ""
+90 LET X(1) = N
+100 IF N < 2 THEN GOTO 50
+110 PRINT X(1)
+120 PRINTLN ""
@@ -0,0 +1,2 @@
+10 DIM X(3)
+20 DIM X(4)
@@ -0,0 +1,17 @@
+10 DIM X(1000)
+20 DIM Y(7)
+30 LET Y(3) = 42
+40 FOR I = 0 TO 999
+50 LET X(I) = X(I) + I * 2
+60 NEXT I
+70 FOR R = 1 TO 3
+80 FOR I = 0 TO 999
+90 LET S = S + X(I)
+100 NEXT I
+110 NEXT R
+120 PRINT S
+130 PRINTLN ""
+140 PRINT Y(3)
+150 PRINTLN ""
+160 LET I = 1000
+170 PRINT X(I)
@@ -0,0 +1,4 @@
+10 DIM X(5)
+20 LET I = 7
+30 LET A = X(I)
+40 PRINTLN "after"
@@ -0,0 +1,3 @@
+10 LET Z = 0
+20 LET A = 5 / Z
+30 PRINTLN "after"
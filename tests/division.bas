@@ -0,0 +1,13 @@
+10 LET M = 0 - 2147483647
+20 LET M = M - 1
+30 LET N = 0 - 1
+40 LET A = M / N
+50 PRINT A
+60 PRINTLN ""
+70 LET B = 7 / N
+80 PRINT B
+90 PRINTLN ""
+100 PRINTLN "dividing"
+110 LET Z = 0
+120 LET C = A / Z
+130 PRINTLN "after"
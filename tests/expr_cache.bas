@@ -0,0 +1,36 @@
+10 DIM X(4)
+20 FOR N = 1 TO 3
+30 LET A = N
+40 LET B = A + 1
+50 LET A = A + 1
+60 LET C = A + 1
+70 LET X(1) = A * 2
+80 LET D = X(1) + 1
+90 LET X(1) = A * 3
+100 LET E = X(1) + 1
+110 DIM X(4)
+120 LET F = X(1) + 1
+130 LET I = 1
+140 LET X(I) = N
+150 LET G = X(I) * 2
+160 LET I = 2
+170 LET H = X(I) * 2
+180 LET X(2) = X(1) + X(2) + 5
+190 LET J = X(I) * 2
+200 PRINT B
+210 PRINT " "
+220 PRINT C
+230 PRINT " "
+240 PRINT D
+250 PRINT " "
+260 PRINT E
+270 PRINT " "
+280 PRINT F
+290 PRINT " "
+300 PRINT G
+310 PRINT " "
+320 PRINT H
+330 PRINT " "
+340 PRINT J
+350 PRINTLN ""
+360 NEXT N
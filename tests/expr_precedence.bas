@@ -0,0 +1,52 @@
+10 FOR N = 1 TO 2
+20 LET A = 10 * N
+30 LET B = 3 * N
+40 LET C = 2
+50 LET R = A - B - C
+60 PRINT R
+70 PRINT " "
+80 LET R = A / B * C
+90 PRINT R
+100 PRINT " "
+110 LET R = A + B * C
+120 PRINT R
+130 PRINT " "
+140 LET R = (A + B) * C
+150 PRINT R
+160 PRINT " "
+170 LET R = -(A + B)
+180 PRINT R
+190 PRINT " "
+200 LET R = A - (B - C)
+210 PRINT R
+220 PRINT " "
+230 LET R = A * -B + -C
+240 PRINT R
+250 PRINT " "
+260 LET R = ((A)) / (B - C * 2 + 4)
+270 PRINT R
+280 PRINTLN ""
+290 LET R = A -5
+300 PRINT R
+310 PRINT " "
+320 LET R = A - -5
+330 PRINT R
+340 PRINT " "
+350 LET R = - 5 + A
+360 PRINT R
+370 PRINT " "
+380 LET R = --5
+390 PRINT R
+400 PRINT " "
+410 LET R = -7 / 2
+420 PRINT R
+430 PRINT " "
+440 LET R = A / -3
+450 PRINT R
+460 PRINT " "
+470 LET R = -A / 3 - -B
+480 PRINT R
+490 PRINTLN ""
+500 IF A - B * C > -(C - A) THEN GOTO 520
+510 PRINTLN "not greater"
+520 NEXT N
@@ -0,0 +1,17 @@
+10 FOR I = 1 TO 1000
+20 LET S = S + I
+30 IF S > 100 THEN GOTO 60
+40 NEXT I
+50 PRINTLN "finished"
+60 PRINT I
+70 PRINT " "
+80 PRINT S
+90 PRINTLN ""
+100 FOR J = 1 TO 3
+110 FOR K = 1 TO 3
+120 IF K = 2 THEN GOTO 140
+130 NEXT K
+140 PRINT J
+150 PRINT K
+160 PRINTLN ""
+170 NEXT J
@@ -0,0 +1,15 @@
+10 FOR I = 10 TO 1 STEP -3
+20 PRINT I
+30 PRINTLN ""
+40 NEXT I
+50 PRINT I
+60 PRINTLN ""
+70 LET A = 5
+80 LET B = 0 - 5
+90 FOR J = A TO B STEP -2
+100 LET S = S + J
+110 NEXT J
+120 PRINT S
+130 PRINT " "
+140 PRINT J
+150 PRINTLN ""
@@ -0,0 +1,22 @@
+10 FOR I = 1 TO 3
+20 FOR J = I TO 3
+30 LET S = S + I * J
+40 PRINT I
+50 PRINT " "
+60 PRINT J
+70 PRINTLN ""
+80 NEXT J
+90 NEXT I
+100 PRINT S
+110 PRINTLN ""
+120 PRINT I
+130 PRINT " "
+140 PRINT J
+150 PRINTLN ""
+160 FOR K = 1 TO 200
+170 FOR L = 1 TO 100
+180 LET T = T + L
+190 NEXT L
+200 NEXT K
+210 PRINT T
+220 PRINTLN ""
@@ -0,0 +1,4 @@
+10 FOR I = 1 TO 3
+20 FOR J = 1 TO 3
+30 NEXT I
+40 NEXT J
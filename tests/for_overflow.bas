@@ -0,0 +1,26 @@
+10 LET Q = 2147483647
+20 FOR J = 2147483645 TO Q
+30 PRINT J
+40 PRINTLN ""
+50 NEXT J
+60 PRINT J
+70 PRINTLN ""
+80 FOR K = 2147483640 TO 2147483647 STEP 3
+90 PRINT K
+100 PRINTLN ""
+110 NEXT K
+120 PRINT K
+130 PRINTLN ""
+140 FOR M = -2147483646 TO -2147483648 STEP -1
+150 PRINT M
+160 PRINTLN ""
+170 NEXT M
+180 PRINT M
+190 PRINTLN ""
+200 LET R = 0 - 2147483647
+210 LET R = R - 1
+220 FOR N = -2147483643 TO R STEP -2
+230 LET S = S + 1
+240 NEXT N
+250 PRINT S
+260 PRINTLN " done"
@@ -0,0 +1,2 @@
+10 FOR I = 1 TO 3 STEP 0
+20 NEXT I
@@ -0,0 +1,20 @@
+10 FOR I = 1 TO 20
+20 PRINT I
+30 PRINTLN ""
+40 LET I = I * 2
+50 NEXT I
+60 PRINT I
+70 PRINTLN ""
+80 LET L = 3
+90 FOR J = 1 TO L
+100 LET L = 100
+110 PRINT J
+120 PRINTLN ""
+130 NEXT J
+140 FOR K = 1 TO 10
+150 IF K = 3 THEN GOTO 170
+160 IF K < 5 THEN GOTO 180
+170 LET K = K + 3
+180 NEXT K
+190 PRINT K
+200 PRINTLN ""
@@ -0,0 +1,16 @@
+10 FOR I = 5 TO 1
+20 PRINTLN "never"
+30 NEXT I
+40 PRINT I
+50 PRINTLN ""
+60 FOR J = 1 TO 5 STEP -1
+70 PRINTLN "never"
+80 NEXT J
+90 PRINT J
+100 PRINTLN ""
+110 LET N = 0
+120 FOR K = 1 TO N
+130 PRINTLN "never"
+140 NEXT K
+150 PRINT K
+160 PRINTLN ""
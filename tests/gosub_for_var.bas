@@ -0,0 +1,11 @@
+10 FOR I = 1 TO 10
+20 PRINT I
+30 PRINTLN ""
+40 GOSUB 100
+50 NEXT I
+60 PRINT I
+70 PRINTLN ""
+80 IF 0 = 0 THEN GOTO 200
+100 LET I = I + 2
+110 RETURN
+200 PRINTLN "end"
@@ -0,0 +1,23 @@
+10 LET A = 1
+20 GOSUB 500
+30 PRINT A
+40 PRINTLN ""
+50 GOSUB 600
+60 PRINT A
+70 PRINTLN ""
+80 GOSUB 500
+90 PRINT A
+100 PRINTLN ""
+110 IF 0 = 0 THEN GOTO 900
+500 LET A = A * 2
+510 RETURN
+600 PRINTLN "outer"
+610 GOSUB 700
+620 GOSUB 500
+630 PRINTLN "outer done"
+640 RETURN
+700 PRINTLN "inner"
+710 GOSUB 500
+720 LET A = A + 1
+730 RETURN
+900 PRINTLN "end"
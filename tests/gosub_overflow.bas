@@ -0,0 +1,8 @@
+10 GOSUB 100
+20 PRINTLN "never"
+100 LET D = D + 1
+110 IF D / 100 * 100 <> D THEN GOTO 140
+120 PRINT D
+130 PRINTLN ""
+140 GOSUB 100
+150 RETURN
@@ -0,0 +1,7 @@
+10 LET A = 1
+20 GOSUB 100
+30 PRINTLN "back"
+100 PRINT A
+110 PRINTLN ""
+120 LET A = A + 1
+130 RETURN
@@ -0,0 +1,19 @@
+10 DIM X(10)
+20 FOR I = 0 TO 9
+30 GOSUB 100
+40 NEXT I
+50 PRINT S
+60 PRINTLN ""
+70 PRINT X(9)
+80 PRINTLN ""
+90 IF 0 = 0 THEN GOTO 300
+100 GOSUB 200
+110 LET X(I) = T
+120 RETURN
+200 LET T = 0
+210 FOR J = 1 TO 50
+220 LET T = T + J * I
+230 NEXT J
+240 LET S = S + T
+250 RETURN
+300 PRINTLN "end"
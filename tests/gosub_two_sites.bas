@@ -0,0 +1,14 @@
+10 FOR I = 1 TO 6
+20 IF I / 2 * 2 = I THEN GOTO 50
+30 GOSUB 200
+40 IF 0 = 0 THEN GOTO 60
+50 GOSUB 200
+60 PRINT I
+70 PRINT " "
+80 PRINT S
+90 PRINTLN ""
+100 NEXT I
+110 IF 0 = 0 THEN GOTO 300
+200 LET S = S + I
+210 RETURN
+300 PRINTLN "end"
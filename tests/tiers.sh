@@ -0,0 +1,37 @@
+#!/bin/sh
+#
+# Runs each BASIC program given under every tier and checks that they all
+# print the same and exit with the same status as -O0. Timing lines on
+# stderr are left out of the comparison.
+#
+# Usage: tests/tiers.sh COMPILER PROGRAM...
+#
+compiler=$1
+shift
+tmp=${TMPDIR:-/tmp}/tiers.$$
+trap 'rm -f "$tmp".*' EXIT
+
+run() {
+    "$compiler" "$@" >"$tmp.out" 2>"$tmp.err"
+    echo "exit $?" >>"$tmp.out"
+    grep -v -e '^compile: ' -e '^load: ' "$tmp.err" >>"$tmp.out"
+}
+
+failed=0
+for program in "$@"; do
+    run --run -O0 "$program"
+    mv "$tmp.out" "$tmp.expected"
+    ok=1
+    for tier in "--run -O1" "--run -O2" "--interp" "--interp --hot-threshold=0" \
+                "--interp --hot-threshold=1" "--interp --hot-threshold=5"; do
+        run $tier "$program"
+        if ! cmp -s "$tmp.expected" "$tmp.out"; then
+            echo "FAIL $program: $tier differs from --run -O0"
+            diff "$tmp.expected" "$tmp.out"
+            ok=0
+            failed=1
+        fi
+    done
+    [ $ok = 1 ] && echo "ok   $program"
+done
+exit $failed
@@ -1,110 +1,122 @@
-
 #ifndef TOKENS_H_
 #define TOKENS_H_
 
-#include <string>
-
-// 
-// Base token class
-//
-class Token {
-  public:
-    virtual std::string getName() = 0;
-};
+#include <cstdint>
+#include <vector>
+#include <llvm/ADT/StringRef.h>
 
 //
-// Tokens for syntax
+// Token kinds, grouped so that the category checks below are range tests
 //
-class SyntaxToken : public Token {};
-class EOLToken : public SyntaxToken {
-    virtual std::string getName() {return "EOLToken";}
+enum class TokenKind : uint8_t {
+    // Syntax
+    EOL,
+    LParen,
+    RParen,
+    // Values
+    StringValue,
+    ConstIntValue,
+    VarIntValue,
+    // Array elements, A(5) and A(I)
+    ConstElementValue,
+    VarElementValue,
+    // Operations
+    Plus,
+    Minus,
+    Mul,
+    Div,
+    // Comparisons
+    Eq,
+    Lt,
+    Gt,
+    Ne,
+    Lte,
+    Gte,
+    // Instructions
+    LET,
+    IF,
+    PRINT,
+    PRINTLN,
+    FOR,
+    NEXT,
+    DIM,
+    GOSUB,
+    RETURN,
 };
 
-//
-// Tokens for values
-//
-class ValueToken : public Token {};
-class StringValueToken : public ValueToken {
-  public:
-    StringValueToken(std::string val) {_val = val;}
-    std::string getVal() {return _val;}
-    virtual std::string getName() {return "StringValueToken";}
-  private:
-    std::string _val;
-};
-class IntValueToken : public ValueToken {};
-class ConstIntValueToken : public IntValueToken {
-  public:
-    ConstIntValueToken(int val) {_val = val;}
-    int getVal() {return _val;}
-    virtual std::string getName() {return "ConstIntValueToken";}
-  private:
-    int _val;
-};
-class VarIntValueToken : public IntValueToken {
-  public:
-    VarIntValueToken(char val) {_val = val;}
-    char getVal() {return _val;}
-    virtual std::string getName() {return "VarIntValueToken";}
-  public:
-    char _val;
-};
+inline const char *tokenKindName(TokenKind kind) {
+    switch (kind) {
+        case TokenKind::EOL: return "EOLToken";
+        case TokenKind::LParen: return "LParenToken";
+        case TokenKind::RParen: return "RParenToken";
+        case TokenKind::StringValue: return "StringValueToken";
+        case TokenKind::ConstIntValue: return "ConstIntValueToken";
+        case TokenKind::VarIntValue: return "VarIntValueToken";
+        case TokenKind::ConstElementValue: return "ConstElementValueToken";
+        case TokenKind::VarElementValue: return "VarElementValueToken";
+        case TokenKind::Plus: return "PlusToken";
+        case TokenKind::Minus: return "MinusToken";
+        case TokenKind::Mul: return "MulToken";
+        case TokenKind::Div: return "DivToken";
+        case TokenKind::Eq: return "EqToken";
+        case TokenKind::Lt: return "LtToken";
+        case TokenKind::Gt: return "GtToken";
+        case TokenKind::Ne: return "NeToken";
+        case TokenKind::Lte: return "LteToken";
+        case TokenKind::Gte: return "GteToken";
+        case TokenKind::LET: return "LETToken";
+        case TokenKind::IF: return "IFToken";
+        case TokenKind::PRINT: return "PRINTToken";
+        case TokenKind::PRINTLN: return "PRINTLNToken";
+        case TokenKind::FOR: return "FORToken";
+        case TokenKind::NEXT: return "NEXTToken";
+        case TokenKind::DIM: return "DIMToken";
+        case TokenKind::GOSUB: return "GOSUBToken";
+        case TokenKind::RETURN: return "RETURNToken";
+    }
+    return "UnknownToken";
+}
 
 //
-// Tokens for operations
+// A token is a small POD record. The payload is the integer value for
+// ConstIntValue, the variable letter for VarIntValue and an index into the
+// token list's string pool for StringValue. Array elements keep the array
+// letter in array and their index in val, as a constant for
+// ConstElementValue and a variable letter for VarElementValue.
 //
-class OpToken : public Token {};
-class PlusToken : public OpToken {
-    virtual std::string getName() {return "PlusToken";}
-};
-class MinusToken : public OpToken {
-    virtual std::string getName() {return "MinusToken";}
-};
-class MulToken : public OpToken {
-    virtual std::string getName() {return "MulToken";}
-};
-class DivToken : public OpToken {
-    virtual std::string getName() {return "DivToken";}
-};
+struct Token {
+    TokenKind kind;
+    char array;
+    int32_t val;
+    int32_t line;
 
-//
-// Tokens for comparisons
-//
-class CmpToken : public Token {};
-class EqToken : public CmpToken {
-    virtual std::string getName() {return "EqToken";}
-};
-class LtToken : public CmpToken {
-    virtual std::string getName() {return "LtToken";}
-};
-class GtToken : public CmpToken {
-    virtual std::string getName() {return "GtToken";}
-};
-class NeToken : public CmpToken {
-    virtual std::string getName() {return "NeToken";}
-};
-class LteToken : public CmpToken {
-    virtual std::string getName() {return "LteToken";}
-};
-class GteToken : public CmpToken {
-    virtual std::string getName() {return "GteToken";}
+    int getInt() const {return val;}
+    char getVar() const {return static_cast<char>(val);}
+    uint32_t getStr() const {return static_cast<uint32_t>(val);}
+
+    bool isIntValue() const {
+        return kind >= TokenKind::ConstIntValue && kind <= TokenKind::VarElementValue;
+    }
+    bool isElement() const {
+        return kind == TokenKind::ConstElementValue || kind == TokenKind::VarElementValue;
+    }
+    // The index of an element as a value token
+    Token indexToken() const {
+        TokenKind index_kind = kind == TokenKind::ConstElementValue ? TokenKind::ConstIntValue
+                                                                    : TokenKind::VarIntValue;
+        return Token{index_kind, 0, val, line};
+    }
+    bool isOp() const {return kind >= TokenKind::Plus && kind <= TokenKind::Div;}
+    bool isCmp() const {return kind >= TokenKind::Eq && kind <= TokenKind::Gte;}
 };
 
 //
-// Tokens for instructions
+// Contiguous token stream produced by the lexer. Strings point into the
+// lexer's source buffer, which must outlive the list.
 //
-class InstrToken : public Token {};
-class LETToken : public InstrToken {
-    virtual std::string getName() {return "LETToken";}
-};
-class IFToken : public InstrToken {
-    virtual std::string getName() {return "IFToken";}
-};
-class PRINTToken : public InstrToken {
-    virtual std::string getName() {return "PRINTToken";}
-};
-class PRINTLNToken : public InstrToken {
-    virtual std::string getName() {return "PRINTLNToken";}
+struct TokenList {
+    std::vector<Token> tokens;
+    std::vector<llvm::StringRef> strings;
 };
 
 #endif  // TOKENS_H_